@@ -0,0 +1,443 @@
+/************************************************************************/
+/*                                                                      */
+/*   dataset.c                                                          */
+/*                                                                      */
+/*   Parsing of training data and its binary CSR cache.                 */
+/*                                                                      */
+/*   Author: Peter N Robinson                                           */
+/*   Date: 12.04.15                                                     */
+/*                                                                      */
+/*   Copyright (c) 2015  Peter Robinson - All rights reserved           */
+/*                                                                      */
+/*   This software is available on a BSD2 license.                      */
+/*                                                                      */
+/************************************************************************/
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dataset.h"
+#include "threadpool.h"
+
+
+/**
+ * \brief Write parsed examples as a binary dataset file (see DATASET_HEADER).
+ *
+ * As with model_save(), a temporary file is renamed to path, so that
+ * other processes that train from a mapping of the old file keep it.
+ * @param path The dataset file, which is replaced
+ * @param fvecs The examples
+ * @param n_fvecs Number of examples
+ * @param n_features Largest feature number
+ * @return 0 on success, -1 if the file could not be written
+ */
+int dataset_save(const char *path, FVECTOR **fvecs, unsigned long n_fvecs,
+		 unsigned long n_features)
+{
+  DATASET_HEADER h;
+  uint64_t start = 0;
+  uint32_t zero = 0;
+  unsigned long i;
+  int ret = 0;
+  char *tmp_path;
+  FILE *fp;
+
+  if ((fp = replace_open(path,&tmp_path)) == NULL)
+    return -1;
+  memset(&h,0,sizeof(h));
+  memcpy(h.magic,DATASET_MAGIC,sizeof(h.magic));
+  h.version = DATASET_VERSION;
+  h.feature_size = sizeof(uint32_t)+sizeof(float);
+  h.n_fvecs = n_fvecs;
+  h.n_features = n_features;
+  for (i=0;i<n_fvecs;++i)
+    h.n_entries += fvecs[i]->n_features+1;
+  if (fwrite(&h,sizeof(h),1,fp) != 1)
+    ret = -1;
+  for (i=0;i<n_fvecs && !ret;++i)
+    if (fwrite(&fvecs[i]->data_class,sizeof(double),1,fp) != 1)
+      ret = -1;
+  for (i=0;i<n_fvecs && !ret;++i)
+    if (fwrite(&fvecs[i]->twonorm_sq,sizeof(double),1,fp) != 1)
+      ret = -1;
+  for (i=0;i<=n_fvecs && !ret;++i) {
+    if (fwrite(&start,sizeof(start),1,fp) != 1)
+      ret = -1;
+    if (i < n_fvecs)
+      start += fvecs[i]->n_features+1;
+  }
+  for (i=0;i<n_fvecs && !ret;++i) {
+    size_t len = fvecs[i]->n_features+1;
+    if (fwrite(fvecs[i]->fnum,sizeof(uint32_t),len,fp) != len)
+      ret = -1;
+  }
+  if (!ret && (h.n_entries & 1) && fwrite(&zero,sizeof(uint32_t),1,fp) != 1)
+    ret = -1; /* fval begins at a multiple of 8 bytes */
+  for (i=0;i<n_fvecs && !ret;++i) {
+    size_t len = fvecs[i]->n_features+1;
+    if (fwrite(fvecs[i]->fval,sizeof(float),len,fp) != len)
+      ret = -1;
+  }
+  if (replace_close(fp,tmp_path,path,ret == 0) != 0)
+    ret = -1;
+  if (ret < 0)
+    fprintf(stderr,"Could not write dataset file %s\n",path);
+  return ret;
+}
+
+
+/**
+ * \brief Load a binary dataset file.
+ *
+ * The file is mapped read-only and only the FVECTOR views of the examples
+ * are allocated, so loading costs no parsing and no copying of features.
+ * @param path The dataset file
+ * @return The dataset, or NULL if the file is not a valid dataset file
+ */
+DATASET *dataset_load(const char *path)
+{
+  const DATASET_HEADER *h;
+  const double *label, *twonorm_sq;
+  const uint64_t *start;
+  uint32_t *fnum;
+  float *fval;
+  DATASET *ds;
+  struct stat st;
+  void *mapping;
+  size_t expected;
+  unsigned long i;
+  int fd;
+
+  if ((fd = open(path,O_RDONLY)) < 0) {
+    perror(path);
+    return NULL;
+  }
+  if (fstat(fd,&st) != 0 || (size_t)st.st_size < sizeof(DATASET_HEADER)) {
+    fprintf(stderr,"%s: not a dataset file\n",path);
+    close(fd);
+    return NULL;
+  }
+  mapping = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    perror(path);
+    return NULL;
+  }
+  h = (const DATASET_HEADER*)mapping;
+  expected = sizeof(DATASET_HEADER)+h->n_fvecs*(2*sizeof(double)+sizeof(uint64_t))
+    +sizeof(uint64_t)+(h->n_entries+(h->n_entries & 1))*sizeof(uint32_t)+h->n_entries*sizeof(float);
+  if (memcmp(h->magic,DATASET_MAGIC,sizeof(h->magic)) || h->version != DATASET_VERSION ||
+      h->feature_size != sizeof(uint32_t)+sizeof(float) || (size_t)st.st_size != expected) {
+    fprintf(stderr,"%s: not a dataset file of version %d\n",path,DATASET_VERSION);
+    munmap(mapping,st.st_size);
+    return NULL;
+  }
+  label = (const double*)(h+1);
+  twonorm_sq = label+h->n_fvecs;
+  start = (const uint64_t*)(twonorm_sq+h->n_fvecs);
+  fnum = (uint32_t*)(start+h->n_fvecs+1);
+  fval = (float*)(fnum+h->n_entries+(h->n_entries & 1));
+
+  ds = (DATASET*)xmalloc(sizeof(DATASET));
+  ds->n_fvecs = h->n_fvecs;
+  ds->n_features = h->n_features;
+  ds->mapping = mapping;
+  ds->mapping_size = st.st_size;
+  /* the pointers and the views share one block, as in dataset_parse() */
+  ds->fvecs = (FVECTOR**)xmalloc((sizeof(FVECTOR*)+sizeof(FVECTOR))*ds->n_fvecs);
+  ds->views = (FVECTOR*)(ds->fvecs+ds->n_fvecs);
+  for (i=0;i<ds->n_fvecs;++i) {
+    FVECTOR *v = &ds->views[i];
+    v->id = i;
+    v->fnum = fnum+start[i];
+    v->fval = fval+start[i];
+    v->n_features = start[i+1]-start[i]-1;
+    v->twonorm_sq = twonorm_sq[i];
+    v->factor = 1.0;
+    v->data_class = label[i];
+    ds->fvecs[i] = v;
+  }
+  return ds;
+}
+
+
+/**
+ * \brief Check whether a dataset file can be used instead of parsing its source.
+ * @return 1 if the cache exists and was modified after the source, 0 otherwise
+ */
+int dataset_is_current(const char *cache, const char *source)
+{
+  struct stat sc, ss;
+  if (stat(cache,&sc) != 0 || stat(source,&ss) != 0)
+    return 0;
+  if (sc.st_mtim.tv_sec != ss.st_mtim.tv_sec)
+    return sc.st_mtim.tv_sec > ss.st_mtim.tv_sec;
+  return sc.st_mtim.tv_nsec > ss.st_mtim.tv_nsec;
+}
+
+
+/** \brief Unmap a dataset file and free the views of the examples. */
+void dataset_free(DATASET *ds)
+{
+  if (!ds)
+    return;
+  munmap(ds->mapping,ds->mapping_size);
+  free(ds->fvecs);
+  free(ds);
+}
+
+
+/** Initial number of feature vectors for which parse_chunk() allocates room */
+#define INITIAL_FVECS 1024
+
+/** \brief A range of lines of the input and the examples parsed from it.
+ *
+ * The features of all examples of the range are stored one after the
+ * other in a single pair of arrays of feature numbers and values
+ * (compressed sparse rows), each example terminated by fnum=0.
+ */
+typedef struct parse_chunk {
+  const char *begin;       /**< First line of the range */
+  const char *end;         /**< End of the range (after the last newline) */
+  uint32_t *fnum;          /**< The feature numbers of the examples of the range */
+  float *fval;             /**< The values of the features */
+  unsigned long n_entries; /**< Used length of fnum and fval (including terminators) */
+  unsigned long max_entries; /**< Capacity of fnum and fval */
+  unsigned long *start;    /**< Offset of the first feature of each example */
+  double *label;           /**< Label of each example */
+  double *twonorm_sq;      /**< Squared norm of each example */
+  unsigned long n_fvecs;
+  unsigned long max_fvecs; /**< Capacity of start, label and twonorm_sq */
+  long n_lines;            /**< Lines in the range (up to the error, if any) */
+  long dpos, dneg, dunlab; /**< Positive, negative and unlabeled examples */
+  unsigned long n_features;/**< Largest feature number */
+  int result;              /**< PARSE_OK or the first error of the range */
+  const char *error_line;  /**< The line with the error */
+  const char *error_eol;
+  int progress;            /**< If nonzero, print progress on stdout */
+} PARSE_CHUNK;
+
+/**
+ * \brief Parse the lines of one chunk of the input.
+ *
+ * The lines are parsed in place with parse_line_range(), directly into the
+ * feature arrays of the chunk. The arrays of the chunk grow geometrically
+ * as needed. Parsing stops at the first malformed line, which is recorded
+ * in the chunk.
+ */
+static void parse_chunk(PARSE_CHUNK *c)
+{
+  const char *line, *eol;
+  long wpos;
+  double doc_label;
+
+  c->max_fvecs = INITIAL_FVECS;
+  c->start = (unsigned long *)xmalloc(sizeof(unsigned long)*c->max_fvecs);
+  c->label = (double *)xmalloc(sizeof(double)*c->max_fvecs);
+  c->twonorm_sq = (double *)xmalloc(sizeof(double)*c->max_fvecs);
+  c->max_entries = INITIAL_FVECS*16;
+  c->fnum = (uint32_t *)xmalloc(sizeof(uint32_t)*c->max_entries);
+  c->fval = (float *)xmalloc(sizeof(float)*c->max_entries);
+  c->n_entries = 0;
+  c->n_fvecs = 0;
+  c->n_lines = 0;
+  c->dpos = c->dneg = c->dunlab = 0;
+  c->n_features = 0;
+  c->result = PARSE_OK;
+  for (line=c->begin; line<c->end; line=eol+1) {
+    long n_words; /* bound on the number of features of the line */
+    uint32_t *fnum;
+    FVECTOR v;
+    if (!(eol = memchr(line,'\n',c->end-line)))
+      eol = c->end;
+    c->n_lines++;
+    if(line[0] == '#') continue;  /* line contains comments */
+    /* each feature needs at least four characters (" 1:1") */
+    n_words = (eol-line)/4+1;
+    if (c->n_entries+n_words+1 > c->max_entries) {
+      while (c->n_entries+n_words+1 > c->max_entries)
+	c->max_entries *= 2;
+      c->fnum = (uint32_t *)xrealloc(c->fnum,sizeof(uint32_t)*c->max_entries);
+      c->fval = (float *)xrealloc(c->fval,sizeof(float)*c->max_entries);
+    }
+    fnum = c->fnum+c->n_entries;
+    if((c->result=parse_line_range(line,eol,fnum,c->fval+c->n_entries,&doc_label,&wpos,
+				   n_words)) != PARSE_OK){
+      c->error_line = line;
+      c->error_eol = eol;
+      break;
+    }
+    if(doc_label > 0) c->dpos++;
+    if (doc_label < 0) c->dneg++;
+    if (doc_label == 0) c->dunlab++;
+
+    if((wpos>1) && (fnum[wpos-2]>c->n_features)) 
+      c->n_features=fnum[wpos-2];
+
+    if (c->n_fvecs == c->max_fvecs) {
+      c->max_fvecs *= 2;
+      c->start = (unsigned long *)xrealloc(c->start,sizeof(unsigned long)*c->max_fvecs);
+      c->label = (double *)xrealloc(c->label,sizeof(double)*c->max_fvecs);
+      c->twonorm_sq = (double *)xrealloc(c->twonorm_sq,sizeof(double)*c->max_fvecs);
+    }
+    v.fnum = fnum;
+    v.fval = c->fval+c->n_entries;
+    v.n_features = wpos;
+    c->start[c->n_fvecs] = c->n_entries;
+    c->label[c->n_fvecs] = doc_label;
+    c->twonorm_sq[c->n_fvecs] = sparse_dotproduct(&v,&v);
+    c->n_fvecs++;
+    c->n_entries += wpos+1;
+    if(c->progress && (c->n_fvecs % 100) == 0) {
+      printf("%lu..",c->n_fvecs); fflush(stdout);
+    }
+  } 
+}
+
+/** \brief Worker function for dataset_parse(): thread t parses chunk t. */
+static void parse_chunk_worker(void *arg, int thread_id)
+{
+  parse_chunk(&((PARSE_CHUNK*)arg)[thread_id]);
+}
+
+/** \brief Free the arrays of all chunks and the chunks. */
+static void free_chunks(PARSE_CHUNK *chunks, int n_chunks)
+{
+  for (int t=0;t<n_chunks;++t) {
+    free(chunks[t].fnum);
+    free(chunks[t].fval);
+    free(chunks[t].start);
+    free(chunks[t].label);
+    free(chunks[t].twonorm_sq);
+  }
+  free(chunks);
+}
+
+/**
+ * \brief Parse training data in the text (sparse) format.
+ *
+ * The lines are parsed in place with parse_line_range(), without copying
+ * them into a line buffer. With several threads, the data are split into
+ * byte ranges that begin at the start of a line, and each thread parses
+ * one range. The examples are then concatenated in the order of the data,
+ * so the result (including FVECTOR.id) does not depend on the number of
+ * threads, and a parse error is reported with its line number.
+ *
+ * All examples are stored in a single block of memory: the array of
+ * pointers (*fvecs), followed by the FVECTORs, followed by the feature
+ * numbers and then the values of all examples in the order of the data.
+ * The whole data set is released with free(*fvecs).
+ * @param data The text (need not be NUL-terminated)
+ * @param size Number of bytes of data
+ * @param n_threads The number of threads used for parsing
+ * @param progress If nonzero (and n_threads is 1), print progress on stdout
+ * @param fvecs The data will be put here
+ * @param n_features The largest feature number will be put here
+ * @param n_fvecs The number of examples will be put here
+ * @param error Receives the first malformed line if parsing fails
+ * @return 0 on success, -1 if a line could not be parsed
+ */
+int dataset_parse(const char *data, size_t size, int n_threads, int progress,
+		  FVECTOR ***fvecs, unsigned long *n_features, unsigned long *n_fvecs,
+		  PARSE_ERROR *error)
+{
+  PARSE_CHUNK *chunks;
+  const char *end = data+size;
+  long line_number = 0;
+  unsigned long dnum = 0, n_entries = 0;
+  size_t offset;
+  char *block;
+  uint32_t *fnum;
+  float *fval;
+  FVECTOR *views;
+  int t;
+
+  if (n_threads < 1)
+    n_threads = 1;
+  /* split the data into n_threads ranges of whole lines */
+  chunks = (PARSE_CHUNK*)xmalloc(sizeof(PARSE_CHUNK)*n_threads);
+  for (t=0;t<n_threads;++t) {
+    const char *b = t ? chunks[t-1].end : data;
+    const char *e = data+size/n_threads*(t+1);
+    if (t == n_threads-1 || e <= b) {
+      e = t == n_threads-1 ? end : b;
+    } else {
+      const char *nl = memchr(e-1,'\n',end-(e-1));
+      e = nl ? nl+1 : end;
+    }
+    chunks[t].begin = b;
+    chunks[t].end = e;
+    chunks[t].progress = (n_threads == 1 && progress);
+  }
+  if (n_threads > 1) {
+    THREAD_POOL *pool = threadpool_create(n_threads);
+    threadpool_run(pool,parse_chunk_worker,chunks);
+    threadpool_free(pool);
+  } else {
+    parse_chunk(&chunks[0]);
+  }
+
+  /* stitch the chunks together in the order of the data */
+  (*n_features)=0;
+  for (t=0;t<n_threads;++t) {
+    PARSE_CHUNK *c = &chunks[t];
+    if (c->result != PARSE_OK) {
+      error->line = line_number+c->n_lines;
+      error->result = c->result;
+      error->text = c->error_line;
+      error->length = c->error_eol-c->error_line;
+      free_chunks(chunks,n_threads);
+      return -1;
+    }
+    line_number += c->n_lines;
+    dnum += c->n_fvecs;
+    if (c->n_features > (*n_features))
+      (*n_features) = c->n_features;
+  }
+  /* One block holds the pointers to the examples, the FVECTORs and all
+   * features. It grows out of the feature numbers of the first chunk,
+   * which are moved behind the FVECTORs, so that the largest part of the
+   * data is copied at most once. The values begin at a multiple of 8 bytes. */
+  for (t=0;t<n_threads;++t)
+    n_entries += chunks[t].n_entries;
+  offset = dnum*(sizeof(FVECTOR *)+sizeof(FVECTOR));
+  block = (char *)xrealloc(chunks[0].fnum,offset+sizeof(uint32_t)*(n_entries+(n_entries & 1))
+			   +sizeof(float)*n_entries);
+  fnum = (uint32_t *)(block+offset);
+  fval = (float *)(fnum+n_entries+(n_entries & 1));
+  memmove(fnum,block,sizeof(uint32_t)*chunks[0].n_entries);
+  (*fvecs) = (FVECTOR **)block;
+  views = (FVECTOR *)(block+dnum*sizeof(FVECTOR *));
+  dnum = 0;
+  n_entries = 0;
+  for (t=0;t<n_threads;++t) {
+    PARSE_CHUNK *c = &chunks[t];
+    if (t > 0) {
+      memcpy(fnum+n_entries,c->fnum,sizeof(uint32_t)*c->n_entries);
+      free(c->fnum);
+    }
+    memcpy(fval+n_entries,c->fval,sizeof(float)*c->n_entries);
+    free(c->fval);
+    for (unsigned long k=0;k<c->n_fvecs;++k) {
+      FVECTOR *v = &views[dnum];
+      unsigned long next = k+1 < c->n_fvecs ? c->start[k+1] : c->n_entries;
+      v->id = dnum;
+      v->fnum = fnum+n_entries+c->start[k];
+      v->fval = fval+n_entries+c->start[k];
+      v->n_features = next-c->start[k]-1;
+      v->twonorm_sq = c->twonorm_sq[k];
+      v->factor = 1.0; /* todo: implement this or remove it */
+      v->data_class = c->label[k];
+      (*fvecs)[dnum++] = v;
+    }
+    n_entries += c->n_entries;
+    free(c->start);
+    free(c->label);
+    free(c->twonorm_sq);
+  }
+  free(chunks);
+  (*n_fvecs)=dnum;
+  return 0;
+}
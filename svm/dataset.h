@@ -0,0 +1,81 @@
+/************************************************************************/
+/*                                                                      */
+/*   dataset.h                                                          */
+/*                                                                      */
+/*   Parsing of training data and its binary CSR cache.                 */
+/*                                                                      */
+/*   Author: Peter N Robinson                                           */
+/*   Date: 12.04.15                                                     */
+/*                                                                      */
+/*   Copyright (c) 2015  Peter Robinson - All rights reserved           */
+/*                                                                      */
+/*   This software is available on a BSD2 license.                      */
+/*                                                                      */
+/************************************************************************/
+
+#ifndef DATASET_H_
+#define DATASET_H_
+
+#include "svm_util.h"
+
+/** Identifies the binary dataset format (first 8 bytes of the file) */
+#define DATASET_MAGIC "XSVMDATA"
+/** Version of the binary dataset format */
+#define DATASET_VERSION 2
+/** Appended to the name of the text file to obtain the name of its cache */
+#define DATASET_SUFFIX ".xcsr"
+
+/** \brief Header of the binary dataset (CSR) file.
+ *
+ * The header is followed by the arrays
+ * - double label[n_fvecs],
+ * - double twonorm_sq[n_fvecs],
+ * - uint64_t start[n_fvecs+1] (row offsets into fnum and fval),
+ * - uint32_t fnum[n_entries] (feature numbers of the nonzeros),
+ * - float fval[n_entries] (values of the nonzeros),
+ * each beginning at a multiple of 8 bytes. Each row is terminated by
+ * fnum=0 (and fval=0), as in FVECTOR, so that the feature vectors can
+ * point directly into the mapped file. The numbers are stored
+ * in the byte order of the machine that wrote the file.
+ */
+typedef struct dataset_header {
+  char magic[8];          /**< DATASET_MAGIC */
+  uint32_t version;       /**< DATASET_VERSION */
+  uint32_t feature_size;  /**< Bytes per nonzero (sizeof(uint32_t)+sizeof(float)) */
+  uint64_t n_fvecs;       /**< Number of examples */
+  uint64_t n_entries;     /**< Length of fnum and fval (including terminators) */
+  uint64_t n_features;    /**< Largest feature number, as reported by the text reader */
+} DATASET_HEADER;
+
+/** \brief Examples loaded from a binary dataset file.
+ *
+ * The FVECTORs are views whose features point into the read-only mapping
+ * of the file.
+ */
+typedef struct dataset {
+  unsigned long n_fvecs;     /**< Number of examples */
+  unsigned long n_features;  /**< Largest feature number */
+  FVECTOR **fvecs;           /**< Pointers to the examples */
+  FVECTOR *views;            /**< The examples (in the block of fvecs) */
+  void *mapping;             /**< Mapping of the file */
+  size_t mapping_size;
+} DATASET;
+
+/** \brief The first malformed line found by dataset_parse(). */
+typedef struct parse_error {
+  long line;        /**< Line number (counted from 1) */
+  int result;       /**< The error (see enum parse_result) */
+  const char *text; /**< The line, in the parsed data */
+  int length;       /**< Length of the line */
+} PARSE_ERROR;
+
+int dataset_parse(const char *data, size_t size, int n_threads, int progress,
+		  FVECTOR ***fvecs, unsigned long *n_features, unsigned long *n_fvecs,
+		  PARSE_ERROR *error);
+int dataset_save(const char *path, FVECTOR **fvecs, unsigned long n_fvecs,
+		 unsigned long n_features);
+DATASET *dataset_load(const char *path);
+int dataset_is_current(const char *cache, const char *source);
+void dataset_free(DATASET *ds);
+
+#endif /* DATASET_H_ */
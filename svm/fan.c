@@ -11,6 +11,7 @@
 
 #include "svm.h"
 #include "fan.h"
+#include "simd.h"
 
 #include <math.h>
 #include <float.h>
@@ -28,83 +29,13 @@
 
 #define VERBOSE 1
 
+/** Below this number of active examples the gradient update and the
+ * working set selection are done by the calling thread alone, since
+ * waking the pool would cost more than it saves (see svm->parallel_min). */
+#ifndef PARALLEL_MIN
+#define PARALLEL_MIN 16384
+#endif
 
-/**
- * \brief Select the indices of two Lagrange multipliers to be optimized. 
- *
- * Put the values of the two selected Lagrange multipliers into I and J.
- * @param I pointer to index of first Lagrange multiplier
- * @param J pointer to index of second selected Lagrange multiplier
- * @param svm The SVM model
- * @param G todo ?
- */
-static void selectB(int *I, int *J,struct svm *svm, double *G){
-  int i,j;
-  int t;
-  int N;
-  double G_max, G_min,obj_min,b,a;
-  double k11,k22,k12;
-  signed char *y;
-  double *alpha;
-  
-  G_max = -FLT_MAX;
-  G_min = FLT_MAX;
-  
-  N = svm->training_count;
-  y = svm->data_class;
-  alpha = svm->alpha;
-  
-  /* ----   Select i  ----  */
-  i = -1;
-  for (t=0;t<N;++t) {
-    /* Is exemplar t in I_up ? */
-    /*printf("Example %d: class %d penalty %f\n",t,svm->data_class[t],GET_C(svm,t));*/
-    if ( (y[t] == 1 && alpha[t] < GET_C(svm,t) ) ||  
-	 (y[t] == -1 && alpha[t] > 0) ) { 
-      if (-y[t] * G[t] >= G_max){
-	G_max = -y[t] * G[t];
-	i = t;
-      }
-    }
-  }
-  
-  /* ----   Select j  ----  */
-  j = -1;	
-  obj_min = FLT_MAX;
-  for (t=0;t<N;++t) {
-    /* is exemplar t in I_low? */
-    if ( (y[t] == 1 && alpha[t] > 0) ||
-	 (y[t] == -1 && alpha[t] < GET_C(svm,t) ) ) {
-      b = G_max + y[t] * G[t];
-      if (-y[t] * G[t] <= G_min) {
-	G_min = -y[t] * G[t];
-      }
-      if (b > 0) {
-	k11 = svm->kernel(i, i, svm);
-	k12 = svm->kernel(i, t, svm);
-	k22 = svm->kernel(t, t, svm);
-	/* The following is equivalent to
-	 * a = Q[i][i] + Q[t][t] - 2*y[i]y[t]*Q[i][t];
-	 * recall that Q[i][j] = y[i]y[j]K(i,j) and
-	 * y[i]*y[i] = 1 forall i
-	 */
-	a = k11 + k22 - 2 * k12;
-	if (a <= 0){ a = TAU; }
-	if ( -(b*b)/a <= obj_min ) {
-	  j = t;
-	  obj_min = -(b*b)/a;
-	}
-      }
-    }
-  }
-  if (G_max - G_min < EPS) { /* This terminates training */
-    *I = -1; 
-    *J = -1; 
-  } else {
-    *I = i;
-    *J = j;
-  }		
-}
 
 /** \brief Calculate the bias (b) term of the SVM.
  *
@@ -184,12 +115,349 @@ double calculate_bias(struct svm *svm, double *G)
   return (r2 + r1)/2.0;  /* -b = 1/2*(r_1 - r_2) */	
 }
 
-/** \brief This function corresponds to algorithm 2 in Fan et al. */
+/** \brief The set of examples the solver currently works on.
+ *
+ * Examples whose alpha is at a bound and is not expected to move are
+ * removed from the active set (shrinking, see Chang and Lin, LIBSVM: A
+ * library for support vector machines, 2011). Only the gradient of the
+ * active examples is kept up to date; the gradient of the others is
+ * reconstructed from G_bar when they are needed again.
+ */
+typedef struct active_set {
+  int *index;    /**< The active examples in ascending order, followed by the inactive ones */
+  int size;      /**< Number of active examples */
+  double *G_bar; /**< G_bar[t] = sum of C_j*Q(t,j) over all j with alpha_j = C_j */
+  int *tmp;      /**< Scratch space used to compact index */
+  int unshrunk;  /**< Set once all examples were reactivated close to the optimum */
+} ACTIVE_SET;
+
+
+/** \brief Result of the selection on one chunk of the examples. */
+typedef struct select_result {
+  double G_max; int i;
+  double G_min, obj_min; int j;
+} SELECT_RESULT;
+
+/** \brief Data of selectB() that is shared by the threads. */
+typedef struct select_work {
+  const double *G;
+  const signed char *y;
+  const double *alpha;
+  const double *C;       /**< Upper bound C_t of each alpha */
+  const double *QD;      /**< Diagonal K(t,t) of the kernel matrix */
+  const double *Ki;      /**< Kernel row of the selected i (second pass) */
+  double G_max, k11;     /**< Result of the first pass */
+  const int *index;      /**< Active examples, or NULL if all examples are active */
+  int size;              /**< Number of active examples */
+  int n_threads;
+  int pass;              /**< 1: select i, 2: select j */
+  SELECT_RESULT *res;    /**< One result per thread */
+} SELECT_WORK;
+
+
+/** \brief Run one pass of the selection on the active examples first..last-1. */
+static void select_range(SELECT_WORK *w, int first, int last, SELECT_RESULT *r)
+{
+  if (w->pass == 1) {
+    r->G_max = -FLT_MAX;
+    r->i = -1;
+    simd_select_up(w->G,w->y,w->alpha,w->C,w->index,first,last,&r->G_max,&r->i);
+  } else {
+    r->G_min = FLT_MAX;
+    r->obj_min = FLT_MAX;
+    r->j = -1;
+    simd_select_low(w->G,w->y,w->alpha,w->C,w->QD,w->Ki,w->G_max,w->k11,TAU,
+		    w->index,first,last,&r->G_min,&r->obj_min,&r->j);
+  }
+}
+
+
+/** \brief Whether the pool is used for size active examples. */
+static int use_pool(const struct svm *svm, int size)
+{
+  int min = svm->parallel_min > 0 ? svm->parallel_min : PARALLEL_MIN;
+  return svm->pool && svm->pool->n_threads > 1 && size >= min;
+}
+
+
+/** \brief Thread pool function; each thread scans one contiguous chunk. */
+static void select_worker(void *arg, int thread_id)
+{
+  SELECT_WORK *w = (SELECT_WORK*)arg;
+  int chunk = (w->size + w->n_threads - 1)/w->n_threads;
+  int first = MIN(thread_id*chunk,w->size);
+  int last = MIN(first+chunk,w->size);
+  select_range(w,first,last,&w->res[thread_id]);
+}
+
+
+/** \brief Run one pass of the selection, in parallel if it is large enough.
+ *
+ * The results of the chunks are combined in the order of the chunks with
+ * the same comparisons as in a single scan, so the selected examples do
+ * not depend on the number of threads.
+ */
+static void select_pass(struct svm *svm, SELECT_WORK *w, SELECT_RESULT *r)
+{
+  int n = 1, k;
+  if (use_pool(svm,w->size)) {
+    n = w->n_threads = svm->pool->n_threads;
+    threadpool_run(svm->pool,select_worker,w);
+  } else
+    select_range(w,0,w->size,&w->res[0]);
+  *r = w->res[0];
+  for (k=1;k<n;++k) {
+    SELECT_RESULT *c = &w->res[k];
+    if (w->pass == 1) {
+      if (c->i != -1 && c->G_max >= r->G_max) {
+	r->G_max = c->G_max;
+	r->i = c->i;
+      }
+    } else {
+      if (c->G_min <= r->G_min)
+	r->G_min = c->G_min;
+      if (c->j != -1 && c->obj_min <= r->obj_min) {
+	r->obj_min = c->obj_min;
+	r->j = c->j;
+      }
+    }
+  }
+}
+
+
+/**
+ * \brief Select the indices of two Lagrange multipliers to be optimized. 
+ *
+ * Put the values of the two selected Lagrange multipliers into I and J.
+ * i maximizes -y_t*G_t over I_up, and j is chosen from I_low with the
+ * second order information of Fan et al. (see simd_select_low()).
+ * @param I pointer to index of first Lagrange multiplier
+ * @param J pointer to index of second selected Lagrange multiplier
+ * @param svm The SVM model
+ * @param G The gradient of the dual objective
+ * @param buf Space for one kernel row (training_count values)
+ * @param as The active set; only active examples are considered
+ * @param w Arrays and per-thread results of the selection
+ */
+static void selectB(int *I, int *J,struct svm *svm, double *G, double *buf,
+		    ACTIVE_SET *as, SELECT_WORK *w){
+  SELECT_RESULT r;
+  int N = svm->training_count;
+  int i;
+  
+  w->G = G;
+  w->index = as->size == N ? NULL : as->index;
+  w->size = as->size;
+  
+  /* ----   Select i  ----  */
+  w->pass = 1;
+  select_pass(svm,w,&r);
+  if (r.i == -1) {
+    *I = -1;
+    *J = -1;
+    return;
+  }
+  
+  /* ----   Select j  ----  */
+  i = r.i;
+  w->G_max = r.G_max;
+  w->k11 = w->QD[i];
+  w->Ki = svm_kernel_row(svm,i,0,N,buf);
+  w->pass = 2;
+  select_pass(svm,w,&r);
+  if (w->G_max - r.G_min < EPS) { /* This terminates training */
+    *I = -1; 
+    *J = -1; 
+  } else {
+    *I = i;
+    *J = r.j;
+  }		
+}
+
+/** \brief Recalculate the gradient of the inactive examples and make all
+ * examples active again.
+ * @param buf Space for one kernel row (training_count values)
+ */
+static void reconstruct_gradient(struct svm *svm, double *G, ACTIVE_SET *as, double *buf)
+{
+  int N = svm->training_count;
+  signed char *y = svm->data_class;
+  double *alpha = svm->alpha;
+  int k,m,t,j;
+
+  if (as->size == N)
+    return;
+  for (k=as->size;k<N;++k) {
+    t = as->index[k];
+    G[t] = as->G_bar[t] - 1.0;
+  }
+  /* Add the contribution of the free alphas. These are all active,
+     because only examples at a bound are removed. */
+  for (k=0;k<as->size;++k) {
+    j = as->index[k];
+    if (!IS_LOWER_BOUND(alpha[j]) && !IS_UPPER_BOUND(alpha[j],GET_C(svm,j))) {
+      const double *Kj = svm_kernel_row(svm,j,0,N,buf);
+      for (m=as->size;m<N;++m) {
+	t = as->index[m];
+	G[t] += alpha[j]*y[j]*y[t]*Kj[t];
+      }
+    }
+  }
+  for (t=0;t<N;++t)
+    as->index[t] = t;
+  as->size = N;
+}
+
+
+/** \brief Can example t be removed from the active set?
+ *
+ * This is the case if alpha_t is at a bound and the gradient indicates
+ * that it will stay there, i.e., t would not be selected by selectB().
+ */
+static int be_shrunk(struct svm *svm, int t, double *G, double Gmax1, double Gmax2)
+{
+  signed char y = svm->data_class[t];
+  double a = svm->alpha[t];
+
+  if (IS_UPPER_BOUND(a,GET_C(svm,t))) {
+    if (y == 1)
+      return -G[t] > Gmax1;
+    else
+      return -G[t] > Gmax2;
+  } else if (IS_LOWER_BOUND(a)) {
+    if (y == 1)
+      return G[t] > Gmax2;
+    else
+      return G[t] > Gmax1;
+  }
+  return 0;
+}
+
+
+/** \brief Remove the examples that are unlikely to change from the active set.
+ *
+ * Once the violation of the optimality conditions drops below 10*EPS,
+ * the full gradient is reconstructed (once), since examples that were
+ * removed early in the optimization may have been removed wrongly.
+ * The active examples stay in ascending order.
+ * @param buf Space for one kernel row (training_count values)
+ */
+static void do_shrinking(struct svm *svm, double *G, ACTIVE_SET *as, double *buf)
+{
+  signed char *y = svm->data_class;
+  double *alpha = svm->alpha;
+  double Gmax1 = -DBL_MAX; /* max { -y_t G_t | t in I_up } */
+  double Gmax2 = -DBL_MAX; /* max { y_t G_t | t in I_low } */
+  int k,t,kept,removed;
+
+  for (k=0;k<as->size;++k) {
+    t = as->index[k];
+    if (y[t] == 1) {
+      if (!IS_UPPER_BOUND(alpha[t],GET_C(svm,t)))
+	Gmax1 = MAX(Gmax1,-G[t]);
+      if (!IS_LOWER_BOUND(alpha[t]))
+	Gmax2 = MAX(Gmax2,G[t]);
+    } else {
+      if (!IS_UPPER_BOUND(alpha[t],GET_C(svm,t)))
+	Gmax2 = MAX(Gmax2,-G[t]);
+      if (!IS_LOWER_BOUND(alpha[t]))
+	Gmax1 = MAX(Gmax1,G[t]);
+    }
+  }
+  if (!as->unshrunk && Gmax1 + Gmax2 <= EPS*10) {
+    as->unshrunk = 1;
+    reconstruct_gradient(svm,G,as,buf);
+  }
+  kept = removed = 0;
+  for (k=0;k<as->size;++k) {
+    t = as->index[k];
+    if (be_shrunk(svm,t,G,Gmax1,Gmax2))
+      as->tmp[removed++] = t;
+    else
+      as->index[kept++] = t;
+  }
+  memcpy(as->index+kept,as->tmp,removed*sizeof(int));
+  as->size = kept;
+}
+
+
+/** \brief Update G_bar if alpha_t has moved to or away from its upper bound.
+ * @param Kt The kernel row of t
+ */
+static void update_G_bar(struct svm *svm, ACTIVE_SET *as, int t, double old_alpha_t,
+			 const double *Kt)
+{
+  int N = svm->training_count;
+  signed char *y = svm->data_class;
+  double C_t = GET_C(svm,t);
+  int was_upper = IS_UPPER_BOUND(old_alpha_t,C_t);
+  int u;
+
+  if (was_upper == IS_UPPER_BOUND(svm->alpha[t],C_t))
+    return;
+  if (was_upper)
+    C_t = -C_t;
+  for (u=0;u<N;++u)
+    as->G_bar[u] += C_t*y[t]*y[u]*Kt[u];
+}
+
+
+/** \brief Arguments of gradient_worker() */
+typedef struct gradient_work {
+  double *G;
+  const signed char *y;
+  const double *Ki, *Kj; /**< Kernel rows of the two updated examples */
+  double ci, cj;         /**< y_i*delta_alpha_i and y_j*delta_alpha_j */
+  const int *index;      /**< Active examples, or NULL if all examples are active */
+  int size;              /**< Number of active examples */
+  int n_threads;
+} GRADIENT_WORK;
+
+
+/** \brief Update the gradient of the active examples first..last-1. */
+static void update_gradient_range(GRADIENT_WORK *w, int first, int last)
+{
+  int k,t;
+  if (!w->index) {
+    simd_update_gradient(w->G+first,w->y+first,w->Ki+first,w->Kj+first,
+			 w->ci,w->cj,(unsigned int)(last-first));
+    return;
+  }
+  for (k=first;k<last;++k) {
+    t = w->index[k];
+    w->G[t] += w->y[t]*(w->Ki[t]*w->ci + w->Kj[t]*w->cj);
+  }
+}
+
+
+/** \brief Thread pool function; each thread updates one contiguous chunk. */
+static void gradient_worker(void *arg, int thread_id)
+{
+  GRADIENT_WORK *w = (GRADIENT_WORK*)arg;
+  /* chunks are multiples of 8 so that threads do not share cache lines of G */
+  int chunk = ((w->size + w->n_threads - 1)/w->n_threads + 7) & ~7;
+  int first = thread_id*chunk;
+  int last = MIN(first+chunk,w->size);
+  if (first < last)
+    update_gradient_range(w,first,last);
+}
+
+
+/** \brief This function corresponds to algorithm 2 in Fan et al.
+ *
+ * If svm->shrinking is set, the active set is reduced every
+ * min(N,1000) iterations (see do_shrinking()).
+ */
 void train_model_fan(struct svm *svm)
 {
   int N;
   int i,j;
   int k,t;
+  int counter;
+  ACTIVE_SET as;
+  GRADIENT_WORK gw;
+  SELECT_WORK sw;
+  double *C, *QD;
   double *G;
   int maxiter, iter;
   double a, k11,k12,k22;
@@ -197,6 +465,8 @@ void train_model_fan(struct svm *svm)
   double b;
   signed char *y; /* The class of the exemplar, +1 or -1 */
   double *alpha;
+  double *Ki_buf, *Kj_buf;
+  const double *Ki, *Kj;
   double old_alpha_i, old_alpha_j, new_alpha_i, new_alpha_j;
   double delta_alpha_i,delta_alpha_j;
   
@@ -210,21 +480,53 @@ void train_model_fan(struct svm *svm)
     fprintf(stderr,"Could not allocate memory for G array in fan.c\n");
     exit(1);
   }
+  Ki_buf = xmalloc(sizeof(double)*N);
+  Kj_buf = xmalloc(sizeof(double)*N);
+  as.index = xmalloc(sizeof(int)*N);
+  as.tmp = xmalloc(sizeof(int)*N);
+  as.G_bar = xmalloc(sizeof(double)*N);
+  as.size = N;
+  as.unshrunk = 0;
+  counter = MIN(N,1000)+1;
+  C = xmalloc(sizeof(double)*N);
+  QD = xmalloc(sizeof(double)*N);
+  for (t=0;t<N;t++) {
+    C[t] = GET_C(svm,t);
+    QD[t] = svm->kernel(t,t,svm);
+  }
+  sw.y = y;
+  sw.alpha = alpha;
+  sw.C = C;
+  sw.QD = QD;
+  sw.res = xmalloc(sizeof(SELECT_RESULT)*(svm->pool ? svm->pool->n_threads : 1));
   
   /* Initialize alpha Lagrange multiplier array to all zero. 
    * Also initialize the Gradient array G to all -1*/
   for (k=0;k<N;k++){
     svm->alpha[k] = 0.0;	
     G[k] = -1;
+    as.index[k] = k;
+    as.G_bar[k] = 0.0;
   }
   
   while (1)  {
     if (iter++ > maxiter) break;
-    selectB(&i,&j,svm,G);
-    if (j == -1) break;
-    k11 = svm->kernel(i, i, svm);
+    if (svm->shrinking && --counter == 0) {
+      counter = MIN(N,1000);
+      do_shrinking(svm,G,&as,Ki_buf);
+    }
+    selectB(&i,&j,svm,G,Ki_buf,&as,&sw);
+    if (j == -1) {
+      if (as.size == N) break;
+      /* optimal on the active set; check again on all examples */
+      reconstruct_gradient(svm,G,&as,Ki_buf);
+      selectB(&i,&j,svm,G,Ki_buf,&as,&sw);
+      if (j == -1) break;
+      counter = 1; /* shrink again in the next iteration */
+    }
+    k11 = QD[i];
     k12 = svm->kernel(i, j, svm);
-    k22 = svm->kernel(j, j, svm);
+    k22 = QD[j];
     /* The following is equivalent to
      * a = Q[i][i] + Q[t][t] - 2*y[i]y[t]*Q[i][t];
      * recall that Q[i][j] = y[i]y[j]K(i,j) and
@@ -242,13 +544,13 @@ void train_model_fan(struct svm *svm)
     
     /* project alpha back to feasible region */
     sum = y[i] * old_alpha_i + y[j] * old_alpha_j;
-    if (new_alpha_i  > GET_C(svm,i) )
-      new_alpha_i = GET_C(svm,i);
+    if (new_alpha_i  > C[i] )
+      new_alpha_i = C[i];
     if (new_alpha_i < 0) 
       new_alpha_i = 0;
     new_alpha_j = y[j] * (sum - y[i]*new_alpha_i);
-    if (new_alpha_j  > GET_C(svm,j) )
-      new_alpha_j = GET_C(svm,j) ;
+    if (new_alpha_j  > C[j] )
+      new_alpha_j = C[j] ;
     if (new_alpha_j < 0) 
       new_alpha_j = 0;
     new_alpha_i = y[i] * (sum - y[j]*new_alpha_j);
@@ -259,18 +561,32 @@ void train_model_fan(struct svm *svm)
     /* Update Gradient */
     delta_alpha_i = new_alpha_i - old_alpha_i;
     delta_alpha_j = new_alpha_j - old_alpha_j;
-    for (t=0;t<N;++t) {
-      double delta_Gt = 
-	y[i]*y[t]*svm->kernel(i,t,svm)*delta_alpha_i +
-	y[j]*y[t]*svm->kernel(j,t,svm)*delta_alpha_j ;
-      G[t] += delta_Gt;	
+    Ki = svm_kernel_row(svm,i,0,N,Ki_buf);
+    Kj = svm_kernel_row(svm,j,0,N,Kj_buf);
+    /* G[t] += y[i]*y[t]*K(i,t)*delta_alpha_i + y[j]*y[t]*K(j,t)*delta_alpha_j */
+    gw.G = G;
+    gw.y = y;
+    gw.Ki = Ki;
+    gw.Kj = Kj;
+    gw.ci = y[i]*delta_alpha_i;
+    gw.cj = y[j]*delta_alpha_j;
+    gw.index = as.size == N ? NULL : as.index;
+    gw.size = as.size;
+    if (use_pool(svm,as.size)) {
+      gw.n_threads = svm->pool->n_threads;
+      threadpool_run(svm->pool,gradient_worker,&gw);
+    } else
+      update_gradient_range(&gw,0,as.size);
+    if (svm->shrinking) {
+      update_G_bar(svm,&as,i,old_alpha_i,Ki);
+      update_G_bar(svm,&as,j,old_alpha_j,Kj);
     }
 #if VERBOSE
-    if (iter % MIN(100,svm->training_count) == 0){
+    if (svm->verbosity>=1 && iter % MIN(100,svm->training_count) == 0){
       svm->b = calculate_bias(svm, G);
       double obj = objective_function(svm);
       
-      fprintf(stderr,"Obj = %.3f; iter=%dn",obj, iter);
+      fprintf(stderr,"Obj = %.3f; iter=%d; active=%d\n",obj, iter, as.size);
       calculate_diagnostics(svm);
       fprintf(stderr,"\ttrain_err: %d/%d (TP:%d, TN:%d, FP:%d,FN:%d) test_err: %d/%d (TP:%d, TN:%d, FP:%d,FN:%d)\n",
 	      svm->training_err_count,svm->training_count,svm->train_TP,svm->train_TN,svm->train_FP,svm->train_FN,
@@ -282,8 +598,17 @@ void train_model_fan(struct svm *svm)
     }
 #endif
   }
+  reconstruct_gradient(svm,G,&as,Ki_buf);
   svm->b = calculate_bias(svm, G);
   free(G);	
+  free(Ki_buf);
+  free(Kj_buf);
+  free(as.index);
+  free(as.tmp);
+  free(as.G_bar);
+  free(C);
+  free(QD);
+  free(sw.res);
 }
 
 #undef IS_UPPER_BOUND
@@ -0,0 +1,185 @@
+/************************************************************************/
+/*                                                                      */
+/*   kcache.c                                                           */
+/*                                                                      */
+/*   LRU cache of kernel rows, used instead of the full Gram matrix.    */
+/*                                                                      */
+/*   Author: Peter N Robinson                                           */
+/*   Date: 12.04.15                                                     */
+/*                                                                      */
+/*   Copyright (c) 2015  Peter Robinson - All rights reserved           */
+/*                                                                      */
+/*   This software is available on a BSD2 license.                      */
+/*                                                                      */
+/************************************************************************/
+
+#include "kcache.h"
+
+
+/** \brief unlink a row from the LRU list. */
+static void lru_remove(KCACHE_ROW *r)
+{
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+}
+
+/** \brief insert a row at the head (most recently used end) of the LRU list. */
+static void lru_push_front(KERNEL_CACHE *kc, KCACHE_ROW *r)
+{
+  r->prev = &kc->lru;
+  r->next = kc->lru.next;
+  kc->lru.next->prev = r;
+  kc->lru.next = r;
+}
+
+
+/**
+ * \brief Allocate a kernel-row cache.
+ *
+ * The number of rows that are kept is derived from the byte budget,
+ * but at least two rows are always kept, because the solvers work on
+ * two rows at a time.
+ * @param n The number of examples
+ * @param fvecs The feature vectors of the examples
+ * @param kernel_parameters The kernel used to calculate the rows
+ * @param budget Maximum number of bytes to be used for cached rows
+ */
+KERNEL_CACHE *kcache_create(unsigned int n, FVECTOR **fvecs,
+			    KERNEL_PARAM *kernel_parameters, size_t budget)
+{
+  KERNEL_CACHE *kc = (KERNEL_CACHE*)xmalloc(sizeof(KERNEL_CACHE));
+  size_t rowsize = (size_t)n*sizeof(double);
+  size_t max_rows = budget / (rowsize > 0 ? rowsize : 1);
+
+  if (max_rows < 2) max_rows = 2;
+  if (max_rows > n) max_rows = n;
+  kc->n = n;
+  kc->fvecs = fvecs;
+  kc->kernel_parameters = kernel_parameters;
+  kc->max_rows = (unsigned int)max_rows;
+  kc->n_rows = 0;
+  kc->rows = (KCACHE_ROW*)xmalloc(max_rows*sizeof(KCACHE_ROW));
+  kc->slot = (KCACHE_ROW**)xmalloc(n*sizeof(KCACHE_ROW*));
+  for (unsigned int i=0;i<n;++i)
+    kc->slot[i] = NULL;
+  kc->lru.idx = -1;
+  kc->lru.data = NULL;
+  kc->lru.prev = kc->lru.next = &kc->lru;
+  kc->hits = kc->misses = 0;
+  kc->diag = (double*)xmalloc(n*sizeof(double));
+  kc->norms = (double*)xmalloc(n*sizeof(double));
+  for (unsigned int i=0;i<n;++i) {
+    kc->diag[i] = kernel_function(kernel_parameters,fvecs[i],fvecs[i]);
+    kc->norms[i] = fvecs[i]->twonorm_sq;
+  }
+  return kc;
+}
+
+
+/**
+ * \brief Return the row K(i,0..n-1), calculating it if it is not cached.
+ *
+ * The returned pointer stays valid until at least one other row has
+ * been requested, i.e., the two most recently requested rows can be
+ * used at the same time.
+ * @param kc The kernel cache
+ * @param i Index of the example
+ */
+double *kcache_get_row(KERNEL_CACHE *kc, unsigned int i)
+{
+  KCACHE_ROW *r = kc->slot[i];
+
+  if (r) {
+    kc->hits++;
+    if (kc->lru.next != r) {
+      lru_remove(r);
+      lru_push_front(kc,r);
+    }
+    return r->data;
+  }
+  kc->misses++;
+  if (kc->n_rows < kc->max_rows) {
+    r = &kc->rows[kc->n_rows++];
+    r->data = (double*)xmalloc(kc->n*sizeof(double));
+  } else {
+    /* recycle the least recently used row */
+    r = kc->lru.prev;
+    lru_remove(r);
+    kc->slot[r->idx] = NULL;
+  }
+  r->idx = (int)i;
+  FVECTOR *a = kc->fvecs[i];
+  for (unsigned int j=0;j<kc->n;++j)
+    r->data[j] = sparse_dotproduct(a,kc->fvecs[j]);
+  kernel_transform_row(kc->kernel_parameters,r->data,kc->n,a->twonorm_sq,kc->norms);
+  r->data[i] = kc->diag[i]; /* same value as kcache_kernel(i,i) */
+  kc->slot[i] = r;
+  lru_push_front(kc,r);
+  return r->data;
+}
+
+
+/**
+ * \brief Kernel callback for struct svm when svm->data is a KERNEL_CACHE.
+ *
+ * Since the kernel is symmetric, the value can be taken from the row of
+ * either example. If neither row is cached, the row of i1 is calculated,
+ * so callers that iterate over the second index should keep the first
+ * index fixed.
+ */
+double kcache_kernel(int i1, int i2, struct svm *svm)
+{
+  KERNEL_CACHE *kc = (KERNEL_CACHE*)svm->data;
+
+  if (i1 == i2)
+    return kc->diag[i1];
+  if (!kc->slot[i1] && kc->slot[i2])
+    return kcache_get_row(kc,(unsigned int)i2)[i1];
+  return kcache_get_row(kc,(unsigned int)i1)[i2];
+}
+
+
+/**
+ * \brief kernel_row callback for struct svm when svm->data is a KERNEL_CACHE.
+ *
+ * Returns a pointer into the cached row of i, which holds all n values,
+ * so out is not filled and last needs no clipping. Copying into out would
+ * cost a pass over the row for nothing: the callers (the Fan solver
+ * holds the rows of i and j at once) rely on the rule of kcache_get_row()
+ * that the rows of the two most recent calls stay valid.
+ */
+const double *kcache_kernel_row(int i, int first, int last, double *out, struct svm *svm)
+{
+  KERNEL_CACHE *kc = (KERNEL_CACHE*)svm->data;
+  (void)last;
+  (void)out;
+  return kcache_get_row(kc,(unsigned int)i) + first;
+}
+
+
+/** \brief Print the hit/miss counts of the cache (used to size the cache). */
+void kcache_print_statistics(KERNEL_CACHE *kc, FILE *fp)
+{
+  unsigned long total = kc->hits + kc->misses;
+  fprintf(fp,"Kernel cache: %u of %u rows (%.1f MB), hits=%lu, misses=%lu (hit rate %.2f%%)\n",
+	  kc->max_rows,kc->n,
+	  (double)kc->max_rows*kc->n*sizeof(double)/(1024.0*1024.0),
+	  kc->hits,kc->misses,
+	  total ? 100.0*kc->hits/total : 0.0);
+}
+
+
+/** \brief Deallocate memory */
+void kcache_free(KERNEL_CACHE *kc)
+{
+  for (unsigned int k=0;k<kc->n_rows;++k)
+    free(kc->rows[k].data);
+  free(kc->rows);
+  free(kc->slot);
+  free(kc->diag);
+  free(kc->norms);
+  free(kc);
+}
+
+
+/* eof */
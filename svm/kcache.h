@@ -0,0 +1,64 @@
+/************************************************************************/
+/*                                                                      */
+/*   kcache.h                                                           */
+/*                                                                      */
+/*   LRU cache of kernel rows, used instead of the full Gram matrix.    */
+/*                                                                      */
+/*   Author: Peter N Robinson                                           */
+/*   Date: 12.04.15                                                     */
+/*                                                                      */
+/*   Copyright (c) 2015  Peter Robinson - All rights reserved           */
+/*                                                                      */
+/*   This software is available on a BSD2 license.                      */
+/*                                                                      */
+/************************************************************************/
+
+#ifndef KCACHE_H_
+#define KCACHE_H_
+
+#include "svm_util.h"
+#include "svm.h"
+
+/** \brief One cached row of kernel evaluations.
+ *
+ * The rows are kept in a doubly linked list ordered by last use, so
+ * that the least recently used row can be recycled when the cache is full.
+ */
+typedef struct kcache_row {
+  int idx;                  /**< Example whose row is stored here (-1 if unused) */
+  double *data;             /**< K(idx,j) for j=0..n-1 */
+  struct kcache_row *prev;  /**< Next more recently used row */
+  struct kcache_row *next;  /**< Next less recently used row */
+} KCACHE_ROW;
+
+/** \brief Kernel-row cache with a fixed byte budget.
+ *
+ * Rows of the Gram matrix are computed on demand from the feature vectors
+ * with kernel_function() and the least recently used rows are evicted once
+ * the budget is exhausted. The diagonal K(i,i) is always kept, since both
+ * solvers need it for every candidate example.
+ */
+typedef struct kernel_cache {
+  unsigned int n;                  /**< Number of examples */
+  FVECTOR **fvecs;                 /**< The examples (not owned by the cache) */
+  KERNEL_PARAM *kernel_parameters; /**< Kernel used to fill the rows */
+  double *diag;                    /**< K(i,i) for all examples */
+  double *norms;                   /**< Squared norms of the examples */
+  unsigned int max_rows;           /**< Number of rows that fit into the budget */
+  unsigned int n_rows;             /**< Number of rows allocated so far */
+  KCACHE_ROW *rows;                /**< Row headers (max_rows) */
+  KCACHE_ROW **slot;               /**< slot[i] is the cached row of example i or NULL */
+  KCACHE_ROW lru;                  /**< List head; lru.next is the most recently used row */
+  unsigned long hits;              /**< Row requests served from the cache */
+  unsigned long misses;            /**< Row requests that required a kernel evaluation */
+} KERNEL_CACHE;
+
+KERNEL_CACHE *kcache_create(unsigned int n, FVECTOR **fvecs,
+			    KERNEL_PARAM *kernel_parameters, size_t budget);
+double *kcache_get_row(KERNEL_CACHE *kc, unsigned int i);
+double kcache_kernel(int i1, int i2, struct svm *svm);
+const double *kcache_kernel_row(int i, int first, int last, double *out, struct svm *svm);
+void kcache_print_statistics(KERNEL_CACHE *kc, FILE *fp);
+void kcache_free(KERNEL_CACHE *kc);
+
+#endif /* KCACHE_H_ */
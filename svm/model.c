@@ -0,0 +1,814 @@
+/************************************************************************/
+/*                                                                      */
+/*   model.c                                                            */
+/*                                                                      */
+/*   Saving and loading of trained models (support vectors only).       */
+/*                                                                      */
+/*   Author: Peter N Robinson                                           */
+/*   Date: 12.04.15                                                     */
+/*                                                                      */
+/*   Copyright (c) 2015  Peter Robinson - All rights reserved           */
+/*                                                                      */
+/*   This software is available on a BSD2 license.                      */
+/*                                                                      */
+/************************************************************************/
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "model.h"
+
+/** Names of the kernels in the text format (same as for the -k option) */
+static const char *kernel_names[] = {"linear","poly","rbf","sigmoid"};
+
+
+/** \brief Allocate an empty model with the given kernel. */
+static SVM_MODEL *model_alloc(const KERNEL_PARAM *kernel_parameters)
+{
+  SVM_MODEL *model = (SVM_MODEL*)xmalloc(sizeof(SVM_MODEL));
+  memset(model,0,sizeof(SVM_MODEL));
+  model->kernel_parameters = *kernel_parameters;
+  return model;
+}
+
+/** Number of uint32_t feature numbers that are stored before the float
+ * values, so that the values begin at a multiple of 8 bytes */
+#define FNUM_PADDED(n) ((n)+((n) & 1))
+
+/** \brief Set up the FVECTORs of the support vectors.
+ *
+ * @param fnum,fval The features of all support vectors, one after the other
+ *        and each terminated by fnum=0
+ * @param start Position of the first feature of each support vector
+ * @param twonorm_sq The squared norms (NULL: calculate them here)
+ */
+static void model_setup_vectors(SVM_MODEL *model, uint32_t *fnum, float *fval,
+				const uint64_t *start, const double *twonorm_sq)
+{
+  unsigned long k;
+  model->sv = (FVECTOR*)xmalloc(sizeof(FVECTOR)*model->n_sv);
+  model->sv_norm_sq = (double*)xmalloc(sizeof(double)*model->n_sv);
+  for (k=0;k<model->n_sv;++k) {
+    FVECTOR *v = &model->sv[k];
+    v->id = k;
+    v->fnum = fnum + start[k];
+    v->fval = fval + start[k];
+    v->n_features = 0;
+    while (v->fnum[v->n_features])
+      v->n_features++;
+    v->twonorm_sq = twonorm_sq ? twonorm_sq[k] : sparse_dotproduct(v,v);
+    model->sv_norm_sq[k] = v->twonorm_sq;
+    v->factor = 1.0;
+    v->data_class = model->coef[k] > 0 ? 1.0 : -1.0;
+  }
+}
+
+
+/**
+ * \brief Extract the model from a trained SVM.
+ *
+ * Only the training examples with alpha>0 are kept. The features of the
+ * support vectors are copied, so that the model does not depend on fv_list.
+ * If the SVM was collapsed into a weight vector (linear kernel), the model
+ * consists of w alone, dense or sparse as in the SVM.
+ * @param svm The trained SVM
+ * @param fv_list The training examples (svm->training_count)
+ * @param kernel_parameters The kernel with which the SVM was trained
+ */
+SVM_MODEL *model_create(struct svm *svm, FVECTOR **fv_list, KERNEL_PARAM *kernel_parameters)
+{
+  SVM_MODEL *model = model_alloc(kernel_parameters);
+  unsigned long n_features = 0, k = 0;
+  uint64_t *start;
+  double *coef;
+  uint32_t *fnum;
+  float *fval;
+  int i;
+
+  model->b = svm->b;
+  if (svm->w) {
+    double *w;
+    model->storage = xmalloc(sizeof(double)*svm->n_w);
+    w = (double*)model->storage;
+    memcpy(w,svm->w,sizeof(double)*svm->n_w);
+    model->coef = model->w = w;
+    model->n_w = svm->n_w;
+    model_setup_vectors(model,NULL,NULL,NULL,NULL);
+    return model;
+  }
+  if (svm->w_fnum) {
+    double *w_fval;
+    uint32_t *w_fnum;
+    /* w_fval and w_fnum share one allocation */
+    model->storage = xmalloc((sizeof(double)+sizeof(uint32_t))*svm->w_nnz+1);
+    w_fval = (double*)model->storage;
+    w_fnum = (uint32_t*)(w_fval+svm->w_nnz);
+    memcpy(w_fval,svm->w_fval,sizeof(double)*svm->w_nnz);
+    memcpy(w_fnum,svm->w_fnum,sizeof(uint32_t)*svm->w_nnz);
+    model->coef = model->w_fval = w_fval;
+    model->w_fnum = w_fnum;
+    model->w_nnz = svm->w_nnz;
+    model_setup_vectors(model,NULL,NULL,NULL,NULL);
+    return model;
+  }
+  for (i=0;i<svm->training_count;++i) {
+    if (svm->alpha[i] > 0) {
+      model->n_sv++;
+      n_features += fv_list[i]->n_features+1;
+    }
+  }
+  /* coef and the features share one allocation */
+  model->storage = xmalloc(sizeof(double)*model->n_sv+sizeof(uint32_t)*FNUM_PADDED(n_features)
+			   +sizeof(float)*n_features);
+  coef = (double*)model->storage;
+  fnum = (uint32_t*)(coef+model->n_sv);
+  fval = (float*)(fnum+FNUM_PADDED(n_features));
+  start = (uint64_t*)xmalloc(sizeof(uint64_t)*(model->n_sv+1));
+  start[0] = 0;
+  for (i=0;i<svm->training_count;++i) {
+    if (svm->alpha[i] > 0) {
+      unsigned long len = fv_list[i]->n_features+1;
+      coef[k] = svm->alpha[i]*svm->data_class[i];
+      memcpy(fnum+start[k],fv_list[i]->fnum,sizeof(uint32_t)*len);
+      memcpy(fval+start[k],fv_list[i]->fval,sizeof(float)*len);
+      start[k+1] = start[k]+len;
+      k++;
+    }
+  }
+  model->coef = coef;
+  model_setup_vectors(model,fnum,fval,start,NULL);
+  free(start);
+  return model;
+}
+
+
+/** \brief Write the model in the binary format (see MODEL_HEADER). */
+static int model_save_binary(const SVM_MODEL *model, FILE *fp)
+{
+  MODEL_HEADER h;
+  uint64_t start = 0;
+  uint32_t zero = 0;
+  unsigned long k;
+
+  memset(&h,0,sizeof(h));
+  memcpy(h.magic,MODEL_MAGIC,sizeof(h.magic));
+  h.version = MODEL_VERSION;
+  h.feature_size = sizeof(uint32_t)+sizeof(float);
+  h.kernel_type = model->kernel_parameters.kernel_type;
+  h.poly_degree = model->kernel_parameters.poly_degree;
+  h.rbf_gamma = model->kernel_parameters.rbf_gamma;
+  h.coef_lin = model->kernel_parameters.coef_lin;
+  h.coef_const = model->kernel_parameters.coef_const;
+  h.b = model->b;
+  h.n_sv = model->n_sv;
+  h.n_w = model->n_w;
+  h.w_nnz = model->w_nnz;
+  for (k=0;k<model->n_sv;++k)
+    h.n_features += model->sv[k].n_features+1;
+  if (fwrite(&h,sizeof(h),1,fp) != 1)
+    return -1;
+  if (fwrite(model->coef,sizeof(double),model->n_sv,fp) != model->n_sv)
+    return -1;
+  for (k=0;k<model->n_sv;++k)
+    if (fwrite(&model->sv[k].twonorm_sq,sizeof(double),1,fp) != 1)
+      return -1;
+  for (k=0;k<model->n_sv;++k) {
+    if (fwrite(&start,sizeof(start),1,fp) != 1)
+      return -1;
+    start += model->sv[k].n_features+1;
+  }
+  for (k=0;k<model->n_sv;++k) {
+    size_t len = model->sv[k].n_features+1;
+    if (fwrite(model->sv[k].fnum,sizeof(uint32_t),len,fp) != len)
+      return -1;
+  }
+  if (FNUM_PADDED(h.n_features) != h.n_features && fwrite(&zero,sizeof(zero),1,fp) != 1)
+    return -1;
+  for (k=0;k<model->n_sv;++k) {
+    size_t len = model->sv[k].n_features+1;
+    if (fwrite(model->sv[k].fval,sizeof(float),len,fp) != len)
+      return -1;
+  }
+  if (model->n_w && fwrite(model->w,sizeof(double),model->n_w,fp) != model->n_w)
+    return -1;
+  if (model->w_nnz && (fwrite(model->w_fval,sizeof(double),model->w_nnz,fp) != model->w_nnz
+		       || fwrite(model->w_fnum,sizeof(uint32_t),model->w_nnz,fp) != model->w_nnz))
+    return -1;
+  return 0;
+}
+
+/** \brief Write the model in the text format.
+ *
+ * The support vectors are written one per line in the format of the
+ * training data, with alpha_i*y_i in place of the label. The nonzero
+ * elements of a weight vector follow as lines "fnum value", for a dense
+ * (n_w) and a sparse (w_nnz) weight vector alike.
+ */
+static int model_save_text(const SVM_MODEL *model, FILE *fp)
+{
+  const KERNEL_PARAM *kp = &model->kernel_parameters;
+  unsigned long k;
+
+  fprintf(fp,"xsvm_model %d\n",MODEL_VERSION);
+  fprintf(fp,"kernel_type %s\n",kernel_names[kp->kernel_type]);
+  fprintf(fp,"poly_degree %ld\n",kp->poly_degree);
+  fprintf(fp,"rbf_gamma %.17g\n",kp->rbf_gamma);
+  fprintf(fp,"coef_lin %.17g\n",kp->coef_lin);
+  fprintf(fp,"coef_const %.17g\n",kp->coef_const);
+  fprintf(fp,"b %.17g\n",model->b);
+  fprintf(fp,"n_sv %lu\n",model->n_sv);
+  fprintf(fp,"n_w %lu\n",model->n_w);
+  fprintf(fp,"w_nnz %lu\n",model->w_nnz);
+  fprintf(fp,"SV\n");
+  for (k=0;k<model->n_sv;++k) {
+    const FVECTOR *v = &model->sv[k];
+    unsigned long t;
+    fprintf(fp,"%.17g",model->coef[k]);
+    for (t=0;t<v->n_features;t++)
+      fprintf(fp," %u:%.9g",v->fnum[t],v->fval[t]);
+    fprintf(fp,"\n");
+  }
+  if (model->n_w) {
+    fprintf(fp,"W\n");
+    for (k=0;k<model->n_w;++k)
+      if (model->w[k] != 0)
+	fprintf(fp,"%lu %.17g\n",k,model->w[k]);
+  }
+  if (model->w_nnz) {
+    fprintf(fp,"W\n");
+    for (k=0;k<model->w_nnz;++k)
+      fprintf(fp,"%u %.17g\n",model->w_fnum[k],model->w_fval[k]);
+  }
+  return ferror(fp) ? -1 : 0;
+}
+
+/**
+ * \brief Save a model.
+ *
+ * The model is written to a temporary file that is then renamed to path,
+ * so that processes that have mapped an older model file at path keep
+ * using it undisturbed.
+ * @param model The model
+ * @param path The model file, which is replaced
+ * @param format MODEL_BINARY or MODEL_TEXT
+ * @return 0 on success, -1 if the file could not be written
+ */
+int model_save(const SVM_MODEL *model, const char *path, enum model_format format)
+{
+  char *tmp_path;
+  FILE *fp;
+  int ret;
+
+  if ((fp = replace_open(path,&tmp_path)) == NULL)
+    return -1;
+  if (format == MODEL_BINARY)
+    ret = model_save_binary(model,fp);
+  else
+    ret = model_save_text(model,fp);
+  if (replace_close(fp,tmp_path,path,ret == 0) != 0)
+    ret = -1;
+  if (ret < 0)
+    fprintf(stderr,"Could not write model file %s\n",path);
+  return ret;
+}
+
+
+/** \brief Use a mapped binary model file.
+ *
+ * Only the FVECTOR headers of the support vectors are allocated; the
+ * coefficients, norms and features are used in place.
+ */
+static SVM_MODEL *model_from_mapping(void *mapping, size_t size, const char *path)
+{
+  const MODEL_HEADER *h = (const MODEL_HEADER*)mapping;
+  const char *base = (const char*)mapping;
+  KERNEL_PARAM kp;
+  SVM_MODEL *model;
+  uint32_t *fnum;
+  float *fval;
+  size_t expected;
+
+  if (h->version != MODEL_VERSION || h->feature_size != sizeof(uint32_t)+sizeof(float)) {
+    fprintf(stderr,"%s: unsupported model version %u (feature size %u)\n",
+	    path,h->version,h->feature_size);
+    return NULL;
+  }
+  expected = sizeof(MODEL_HEADER)+h->n_sv*(2*sizeof(double)+sizeof(uint64_t))
+    +FNUM_PADDED(h->n_features)*sizeof(uint32_t)+h->n_features*sizeof(float)
+    +h->n_w*sizeof(double)+h->w_nnz*(sizeof(double)+sizeof(uint32_t));
+  if (size != expected || h->kernel_type < 0 || h->kernel_type > SIGMOID) {
+    fprintf(stderr,"%s: corrupt model file\n",path);
+    return NULL;
+  }
+  memset(&kp,0,sizeof(kp));
+  kp.kernel_type = h->kernel_type;
+  kp.poly_degree = h->poly_degree;
+  kp.rbf_gamma = h->rbf_gamma;
+  kp.coef_lin = h->coef_lin;
+  kp.coef_const = h->coef_const;
+  model = model_alloc(&kp);
+  model->b = h->b;
+  model->n_sv = h->n_sv;
+  model->coef = (const double*)(base+sizeof(MODEL_HEADER));
+  model->mapping = mapping;
+  model->mapping_size = size;
+  fnum = (uint32_t*)(base+sizeof(MODEL_HEADER)+h->n_sv*(2*sizeof(double)+sizeof(uint64_t)));
+  fval = (float*)(fnum+FNUM_PADDED(h->n_features));
+  model_setup_vectors(model,fnum,fval,(const uint64_t*)(model->coef+2*h->n_sv),
+		      model->coef+h->n_sv);
+  if (h->n_w) {
+    model->w = (const double*)(fval+h->n_features);
+    model->n_w = h->n_w;
+  }
+  if (h->w_nnz) {
+    model->w_fval = (const double*)(fval+h->n_features)+h->n_w;
+    model->w_fnum = (const uint32_t*)(model->w_fval+h->w_nnz);
+    model->w_nnz = h->w_nnz;
+  }
+  return model;
+}
+
+/** \brief Parse one line in the format of the training data and append
+ * its features (terminated by fnum=0) to growing arrays.
+ *
+ * @param fnum,fval The arrays, which are enlarged with realloc() as needed
+ * @param allocated The capacity of the arrays (in features)
+ * @param used Number of features already in the arrays
+ * @param label Receives the label (or coefficient) of the line
+ * @param n_features Receives the number of features of the line
+ * @return The result of parse_line_range()
+ */
+static int parse_line_append(const char *line, uint32_t **fnum, float **fval,
+			     unsigned long *allocated, unsigned long used,
+			     double *label, long *n_features)
+{
+  /* each feature needs at least four characters (" 1:1") */
+  const char *c = line+strlen(line);
+  unsigned long max_words = (c-line)/4+1;
+  if (used+max_words+1 > *allocated) {
+    *allocated = 2*(used+max_words+1);
+    *fnum = (uint32_t*)xrealloc(*fnum,sizeof(uint32_t)*(*allocated));
+    *fval = (float*)xrealloc(*fval,sizeof(float)*(*allocated));
+  }
+  return parse_line_range(line,c,*fnum+used,*fval+used,label,n_features,max_words);
+}
+
+/** \brief Read the value of one "key value" line of the text format. */
+static int read_text_field(FILE *fp, const char *key, char *value)
+{
+  char name[64];
+  if (fscanf(fp,"%63s %63s",name,value) != 2 || strcmp(name,key)) {
+    fprintf(stderr,"Expected '%s' in model file\n",key);
+    return -1;
+  }
+  return 0;
+}
+
+/** \brief Read a model in the text format. */
+static SVM_MODEL *model_load_text(FILE *fp, const char *path)
+{
+  KERNEL_PARAM kp;
+  SVM_MODEL *model;
+  char value[64];
+  char *line = NULL;
+  size_t linesize = 0;
+  uint32_t *fnum = NULL, *sv_fnum;
+  float *fval = NULL, *sv_fval;
+  uint64_t *start;
+  double *coef, label, b;
+  unsigned long n_sv, n_w, w_nnz = 0, used = 0, allocated = 0, k;
+  long n_features;
+  int kt, result, version;
+
+  memset(&kp,0,sizeof(kp));
+  if (read_text_field(fp,"xsvm_model",value) < 0)
+    return NULL;
+  version = atoi(value);
+  if (version < 2 || version > MODEL_VERSION) {
+    fprintf(stderr,"%s: unsupported model version %s\n",path,value);
+    return NULL;
+  }
+  if (read_text_field(fp,"kernel_type",value) < 0)
+    return NULL;
+  for (kt=0;kt<=SIGMOID && strcmp(value,kernel_names[kt]);++kt)
+    ;
+  if (kt > SIGMOID) {
+    fprintf(stderr,"%s: did not recognize kernel %s\n",path,value);
+    return NULL;
+  }
+  kp.kernel_type = kt;
+  if (read_text_field(fp,"poly_degree",value) < 0)
+    return NULL;
+  kp.poly_degree = atol(value);
+  if (read_text_field(fp,"rbf_gamma",value) < 0)
+    return NULL;
+  kp.rbf_gamma = atof(value);
+  if (read_text_field(fp,"coef_lin",value) < 0)
+    return NULL;
+  kp.coef_lin = atof(value);
+  if (read_text_field(fp,"coef_const",value) < 0)
+    return NULL;
+  kp.coef_const = atof(value);
+  if (read_text_field(fp,"b",value) < 0)
+    return NULL;
+  b = atof(value);
+  if (read_text_field(fp,"n_sv",value) < 0)
+    return NULL;
+  n_sv = strtoul(value,NULL,10);
+  if (read_text_field(fp,"n_w",value) < 0)
+    return NULL;
+  n_w = strtoul(value,NULL,10);
+  if (version >= 4) {
+    if (read_text_field(fp,"w_nnz",value) < 0)
+      return NULL;
+    w_nnz = strtoul(value,NULL,10);
+  }
+  if (fscanf(fp,"%63s",value) != 1 || strcmp(value,"SV")) {
+    fprintf(stderr,"%s: expected 'SV' in model file\n",path);
+    return NULL;
+  }
+  getline(&line,&linesize,fp); /* rest of the SV line */
+
+  coef = (double*)xmalloc(sizeof(double)*n_sv);
+  start = (uint64_t*)xmalloc(sizeof(uint64_t)*(n_sv+1));
+  for (k=0;k<n_sv;++k) {
+    if (getline(&line,&linesize,fp) < 0) {
+      fprintf(stderr,"%s: expected %lu support vectors but found %lu\n",path,n_sv,k);
+      free(line); free(fnum); free(fval); free(coef); free(start);
+      return NULL;
+    }
+    if ((result = parse_line_append(line,&fnum,&fval,&allocated,used,&label,&n_features)) != PARSE_OK) {
+      fprintf(stderr,"%s: could not parse support vector %lu (%s)\n",path,k,
+	      parse_result_string(result));
+      free(line); free(fnum); free(fval); free(coef); free(start);
+      return NULL;
+    }
+    coef[k] = label;
+    start[k] = used;
+    used += n_features+1;
+  }
+  free(line);
+
+  /* same layout as in model_create(): coef and the features in one allocation */
+  model = model_alloc(&kp);
+  model->b = b;
+  model->n_sv = n_sv;
+  model->storage = xmalloc(sizeof(double)*n_sv+sizeof(uint32_t)*FNUM_PADDED(used)
+			   +sizeof(float)*used);
+  model->coef = (double*)model->storage;
+  sv_fnum = (uint32_t*)(model->coef+n_sv);
+  sv_fval = (float*)(sv_fnum+FNUM_PADDED(used));
+  memcpy(model->storage,coef,sizeof(double)*n_sv);
+  memcpy(sv_fnum,fnum,sizeof(uint32_t)*used);
+  memcpy(sv_fval,fval,sizeof(float)*used);
+  model_setup_vectors(model,sv_fnum,sv_fval,start,NULL);
+  if (n_w) {
+    /* the nonzero elements of the weight vector */
+    double *w, wk;
+    unsigned long k_w;
+    if (n_sv) {
+      fprintf(stderr,"%s: a model cannot have both support vectors and w\n",path);
+      free(fnum); free(fval); free(coef); free(start);
+      model_free(model);
+      return NULL;
+    }
+    free(model->storage);
+    model->storage = calloc(n_w,sizeof(double));
+    if (!model->storage) {
+      perror("Out of memory!\n");
+      exit(1);
+    }
+    model->coef = model->w = w = (double*)model->storage;
+    model->n_w = n_w;
+    if (fscanf(fp,"%63s",value) != 1 || strcmp(value,"W")) {
+      fprintf(stderr,"%s: expected 'W' in model file\n",path);
+      free(fnum); free(fval); free(coef); free(start);
+      model_free(model);
+      return NULL;
+    }
+    while ((result = fscanf(fp,"%lu %lf",&k_w,&wk)) == 2 && k_w < n_w)
+      w[k_w] = wk;
+    if (result != EOF) {
+      if (result == 2)
+	fprintf(stderr,"%s: index %lu of the weight vector is not below n_w=%lu\n",path,k_w,n_w);
+      else
+	fprintf(stderr,"%s: could not parse the weight vector\n",path);
+      free(fnum); free(fval); free(coef); free(start);
+      model_free(model);
+      return NULL;
+    }
+  } else if (w_nnz) {
+    /* the nonzero elements of a sparse weight vector, by ascending feature number */
+    double *w_fval;
+    uint32_t *w_fnum;
+    unsigned long k_w;
+    if (n_sv) {
+      fprintf(stderr,"%s: a model cannot have both support vectors and w\n",path);
+      free(fnum); free(fval); free(coef); free(start);
+      model_free(model);
+      return NULL;
+    }
+    free(model->storage);
+    model->storage = xmalloc((sizeof(double)+sizeof(uint32_t))*w_nnz);
+    model->coef = model->w_fval = w_fval = (double*)model->storage;
+    model->w_fnum = w_fnum = (uint32_t*)(w_fval+w_nnz);
+    model->w_nnz = w_nnz;
+    if (fscanf(fp,"%63s",value) != 1 || strcmp(value,"W")) {
+      fprintf(stderr,"%s: expected 'W' in model file\n",path);
+      free(fnum); free(fval); free(coef); free(start);
+      model_free(model);
+      return NULL;
+    }
+    for (k=0;k<w_nnz;++k) {
+      if (fscanf(fp,"%lu %lf",&k_w,&w_fval[k]) != 2 || k_w < 1 || k_w > UINT32_MAX
+	  || (k && k_w <= w_fnum[k-1])) {
+	fprintf(stderr,"%s: could not parse element %lu of the sparse weight vector\n",path,k);
+	free(fnum); free(fval); free(coef); free(start);
+	model_free(model);
+	return NULL;
+      }
+      w_fnum[k] = k_w;
+    }
+  }
+  free(fnum);
+  free(fval);
+  free(coef);
+  free(start);
+  return model;
+}
+
+/**
+ * \brief Load a model saved with model_save().
+ *
+ * The format is recognized automatically. A binary model file is mapped
+ * read-only into memory and used without parsing, so that loading is
+ * fast and the pages are shared by all processes using the same model.
+ * @param path The model file
+ * @return The model, or NULL if the file could not be read
+ */
+SVM_MODEL *model_load(const char *path)
+{
+  int fd;
+  struct stat st;
+  SVM_MODEL *model;
+  FILE *fp;
+
+  if ((fd = open(path,O_RDONLY)) < 0) {
+    perror(path);
+    return NULL;
+  }
+  if (fstat(fd,&st) == 0 && (size_t)st.st_size >= sizeof(MODEL_HEADER)) {
+    void *mapping = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+    if (mapping != MAP_FAILED) {
+      if (!memcmp(mapping,MODEL_MAGIC,strlen(MODEL_MAGIC))) {
+	close(fd);
+	model = model_from_mapping(mapping,st.st_size,path);
+	if (!model)
+	  munmap(mapping,st.st_size);
+	return model;
+      }
+      munmap(mapping,st.st_size);
+    }
+  }
+  if ((fp = fdopen(fd,"r")) == NULL) {
+    perror(path);
+    close(fd);
+    return NULL;
+  }
+  model = model_load_text(fp,path);
+  fclose(fp);
+  return model;
+}
+
+
+/** \brief The decision value f(x) = sum_i alpha_i y_i K(sv_i,x) - b.
+ *
+ * The terms are added in the order of the training examples, so that
+ * the result is the same as that of learned_func_nonlinear() for the
+ * kernel values of kernel_function(). For a collapsed linear model,
+ * f(x) = w*x - b costs only one lookup per feature of x (a binary search
+ * if w is sparse).
+ */
+double model_predict(const SVM_MODEL *model, FVECTOR *x)
+{
+  KERNEL_PARAM *kp = (KERNEL_PARAM*)&model->kernel_parameters;
+  double s = 0;
+  unsigned long k;
+
+  if (model->w) {
+    for (k=0;k<x->n_features;k++)
+      if (x->fnum[k] < model->n_w)
+	s += model->w[x->fnum[k]] * x->fval[k];
+    return s - model->b;
+  }
+  if (model->w_fnum)
+    return sparse_weight_dotproduct(model->w_fnum,model->w_fval,model->w_nnz,x) - model->b;
+  for (k=0;k<model->n_sv;++k)
+    s += model->coef[k]*kernel_function(kp,&model->sv[k],x);
+  s -= model->b;
+  return s;
+}
+
+/** Number of examples and support vectors in a tile of model_predict_batch() */
+#define PREDICT_TILE_X 64
+#define PREDICT_TILE_SV 256
+
+/** \brief Shared state of the threads of model_predict_batch(). */
+typedef struct predict_work {
+  const SVM_MODEL *model;
+  FVECTOR **x;
+  unsigned long n;
+  double *f;
+  unsigned long next_tile; /**< First example of the next tile (atomic) */
+} PREDICT_WORK;
+
+/**
+ * \brief Worker function for model_predict_batch().
+ *
+ * Each thread repeatedly takes the next PREDICT_TILE_X examples and
+ * goes through the support vectors in blocks of PREDICT_TILE_SV, so that
+ * the features of a block stay in the cache while they are used for all
+ * examples of the tile. The kernel values of each example and block are
+ * calculated from the dot products at once with kernel_transform_row(),
+ * using the stored norms of the support vectors for the RBF kernel.
+ */
+static void predict_tile_worker(void *arg, int thread_id)
+{
+  PREDICT_WORK *w = (PREDICT_WORK*)arg;
+  const SVM_MODEL *model = w->model;
+  KERNEL_PARAM *kp = (KERNEL_PARAM*)&model->kernel_parameters;
+  double values[PREDICT_TILE_SV];
+  unsigned long t0;
+  (void)thread_id;
+
+  while ((t0 = __atomic_fetch_add(&w->next_tile,PREDICT_TILE_X,__ATOMIC_RELAXED)) < w->n) {
+    unsigned long t1 = t0+PREDICT_TILE_X < w->n ? t0+PREDICT_TILE_X : w->n;
+    unsigned long t, s0, k;
+    if (model->w || model->w_fnum) {
+      for (t=t0;t<t1;++t)
+	w->f[t] = model_predict(model,w->x[t]);
+      continue;
+    }
+    for (t=t0;t<t1;++t)
+      w->f[t] = 0.0;
+    for (s0=0;s0<model->n_sv;s0+=PREDICT_TILE_SV) {
+      unsigned long s1 = s0+PREDICT_TILE_SV < model->n_sv ? s0+PREDICT_TILE_SV : model->n_sv;
+      for (t=t0;t<t1;++t) {
+	FVECTOR *x = w->x[t];
+	double s = w->f[t];
+	for (k=s0;k<s1;++k)
+	  values[k-s0] = sparse_dotproduct(x,&model->sv[k]);
+	kernel_transform_row(kp,values,s1-s0,x->twonorm_sq,model->sv_norm_sq+s0);
+	for (k=s0;k<s1;++k)
+	  s += model->coef[k]*values[k-s0];
+	w->f[t] = s;
+      }
+    }
+    for (t=t0;t<t1;++t)
+      w->f[t] -= model->b;
+  }
+}
+
+/**
+ * \brief Calculate the decision values of many examples.
+ *
+ * The examples are processed in tiles (see predict_tile_worker()), which
+ * are distributed over the threads of the pool. The terms of each sum are
+ * added in the same order as in model_predict(), and the kernel values
+ * agree with those of kernel_function() to about one unit in the last
+ * place, so the results do not depend on the number of threads.
+ * @param model The model
+ * @param x The examples (twonorm_sq must be set)
+ * @param n Number of examples
+ * @param f Receives the n decision values
+ * @param pool Threads to be used (NULL: serial)
+ */
+void model_predict_batch(const SVM_MODEL *model, FVECTOR **x, unsigned long n,
+			 double *f, THREAD_POOL *pool)
+{
+  PREDICT_WORK work;
+  work.model = model;
+  work.x = x;
+  work.n = n;
+  work.f = f;
+  work.next_tile = 0;
+  if (pool && n > PREDICT_TILE_X)
+    threadpool_run(pool,predict_tile_worker,&work);
+  else
+    predict_tile_worker(&work,0);
+}
+
+
+/**
+ * \brief Classify a stream of examples in the format of the training data.
+ *
+ * The examples are read, parsed and classified in chunks of PREDICT_CHUNK
+ * lines, so the memory used depends only on the chunk size and not on the
+ * number of examples. Each chunk is classified with model_predict_batch().
+ * For each example, the decision value and the label are written to out
+ * in the format of svm->output_file. Lines beginning with '#' and empty
+ * lines are skipped.
+ * @param model The model
+ * @param in The examples
+ * @param out Receives the decision values (may be NULL)
+ * @param counts Receives the numbers of true/false positives/negatives
+ * @param pool Threads used to classify a chunk (NULL: serial)
+ * @return The number of examples, or -1 if a line could not be parsed
+ */
+long model_predict_stream(const SVM_MODEL *model, FILE *in, FILE *out, MODEL_CONFUSION *counts,
+			  THREAD_POOL *pool)
+{
+  FVECTOR *chunk = (FVECTOR*)xmalloc(sizeof(FVECTOR)*PREDICT_CHUNK);
+  FVECTOR **chunk_ptr = (FVECTOR**)xmalloc(sizeof(FVECTOR*)*PREDICT_CHUNK);
+  double *decision = (double*)xmalloc(sizeof(double)*PREDICT_CHUNK);
+  uint64_t *start = (uint64_t*)xmalloc(sizeof(uint64_t)*PREDICT_CHUNK);
+  uint32_t *fnum = NULL;
+  float *fval = NULL;
+  unsigned long allocated = 0;
+  char *line = NULL;
+  size_t linesize = 0;
+  long n_examples = 0, line_number = 0;
+  int eof = 0;
+
+  memset(counts,0,sizeof(MODEL_CONFUSION));
+  while (!eof) {
+    unsigned long used = 0;
+    int n = 0, k;
+    /* read and parse the next chunk */
+    while (n < PREDICT_CHUNK) {
+      long n_features;
+      int result;
+      char *c;
+      if (getline(&line,&linesize,in) < 0) {
+	eof = 1;
+	break;
+      }
+      line_number++;
+      for (c=line;space_or_null((int)*c) && *c;++c)
+	;
+      if (*c == '#' || !*c)
+	continue;
+      if ((result = parse_line_append(line,&fnum,&fval,&allocated,used,&chunk[n].data_class,
+				      &n_features)) != PARSE_OK) {
+	fprintf(stderr,"Parsing error in line %ld: %s\n",line_number,parse_result_string(result));
+	n_examples = -1;
+	goto done;
+      }
+      start[n] = used;
+      chunk[n].n_features = n_features;
+      used += n_features+1;
+      n++;
+    }
+    /* the feature arrays may have moved while the chunk was read */
+    for (k=0;k<n;++k) {
+      FVECTOR *x = &chunk[k];
+      x->id = n_examples+k;
+      x->fnum = fnum+start[k];
+      x->fval = fval+start[k];
+      x->twonorm_sq = sparse_dotproduct(x,x);
+      x->factor = 1.0;
+      chunk_ptr[k] = x;
+    }
+    model_predict_batch(model,chunk_ptr,n,decision,pool);
+    for (k=0;k<n;++k) {
+      FVECTOR *x = &chunk[k];
+      double f = decision[k];
+      if (x->data_class > 0) {
+	if (f > 0) counts->TP++; else counts->FN++;
+      } else if (x->data_class < 0) {
+	if (f > 0) counts->FP++; else counts->TN++;
+      } else {
+	counts->unlabeled++;
+      }
+      if (out)
+	fprintf(out,"%e\t%e\n",f,x->data_class);
+    }
+    n_examples += n;
+  }
+ done:
+  free(line);
+  free(fnum);
+  free(fval);
+  free(start);
+  free(chunk);
+  free(chunk_ptr);
+  free(decision);
+  return n_examples;
+}
+
+/** \brief Free a model (or unmap the model file). */
+void model_free(SVM_MODEL *model)
+{
+  if (!model)
+    return;
+  if (model->mapping) {
+    munmap(model->mapping,model->mapping_size);
+  } else {
+    free(model->storage);
+  }
+  free(model->sv);
+  free(model->sv_norm_sq);
+  free(model);
+}
@@ -0,0 +1,115 @@
+/************************************************************************/
+/*                                                                      */
+/*   model.h                                                            */
+/*                                                                      */
+/*   Saving and loading of trained models (support vectors only).       */
+/*                                                                      */
+/*   Author: Peter N Robinson                                           */
+/*   Date: 12.04.15                                                     */
+/*                                                                      */
+/*   Copyright (c) 2015  Peter Robinson - All rights reserved           */
+/*                                                                      */
+/*   This software is available on a BSD2 license.                      */
+/*                                                                      */
+/************************************************************************/
+
+#ifndef MODEL_H_
+#define MODEL_H_
+
+#include "svm_util.h"
+#include "svm.h"
+
+/** Identifies the binary model format (first 8 bytes of the file) */
+#define MODEL_MAGIC "XSVMMODL"
+/** Version of the binary and text model formats (the text format is
+ * read back to version 2) */
+#define MODEL_VERSION 4
+
+/** Number of examples that model_predict_stream() reads and classifies at a time */
+#define PREDICT_CHUNK 4096
+
+/** \brief File formats of a saved model. */
+enum model_format {
+  MODEL_BINARY, /**< Native layout that is mapped into memory by model_load() */
+  MODEL_TEXT    /**< Human readable, for debugging */
+};
+
+/** \brief Header of the binary model file.
+ *
+ * The header is followed by the arrays
+ * - double coef[n_sv] (alpha_i*y_i),
+ * - double twonorm_sq[n_sv],
+ * - uint64_t start[n_sv] (position of the first feature of each support vector),
+ * - uint32_t fnum[n_features] (feature numbers),
+ * - float fval[n_features] (values of the features),
+ * - double w[n_w],
+ * - double w_fval[w_nnz],
+ * - uint32_t w_fnum[w_nnz],
+ * each beginning at a multiple of 8 bytes. A model of a linear kernel is
+ * stored as its weight vector and has no support vectors: densely as w
+ * (indexed by feature number), or, if w is too sparse, as its nonzero
+ * components w_fval with the feature numbers w_fnum. The features
+ * of each support vector are terminated by a feature with fnum=0, as in
+ * FVECTOR, so that the mapped file can be used without any parsing. The
+ * numbers are stored in the byte order of the machine that wrote the file.
+ */
+typedef struct model_header {
+  char magic[8];            /**< MODEL_MAGIC */
+  uint32_t version;         /**< MODEL_VERSION */
+  uint32_t feature_size;    /**< Bytes per feature (sizeof(uint32_t)+sizeof(float)) */
+  int64_t kernel_type;
+  int64_t poly_degree;
+  double rbf_gamma;
+  double coef_lin;
+  double coef_const;
+  double b;                 /**< The bias; f(x) = sum_i coef_i K(sv_i,x) - b */
+  uint64_t n_sv;            /**< Number of support vectors */
+  uint64_t n_features;      /**< Length of fnum and fval (including terminators) */
+  uint64_t n_w;             /**< Length of the dense weight vector (0 if not collapsed) */
+  uint64_t w_nnz;           /**< Length of the sparse weight vector (0 if not collapsed) */
+} MODEL_HEADER;
+
+/** \brief A trained model, reduced to the support vectors.
+ *
+ * If the model was loaded from a binary file, coef and the features of
+ * the support vectors point into the read-only mapping of the file, which
+ * the operating system shares among all processes that load the same model.
+ * If w or w_fnum is set, f(x) = w*x - b and there are no support vectors.
+ */
+typedef struct svm_model {
+  KERNEL_PARAM kernel_parameters;
+  double b;               /**< The bias */
+  unsigned long n_sv;     /**< Number of support vectors */
+  const double *coef;     /**< alpha_i*y_i of each support vector */
+  FVECTOR *sv;            /**< The support vectors (n_sv) */
+  double *sv_norm_sq;     /**< Squared norms of the support vectors (n_sv) */
+  const double *w;        /**< Weight vector of a linear kernel (or NULL) */
+  unsigned long n_w;      /**< Length of w */
+  const uint32_t *w_fnum; /**< Feature numbers of a sparse weight vector (or NULL) */
+  const double *w_fval;   /**< Nonzero components of a sparse weight vector */
+  unsigned long w_nnz;    /**< Length of w_fnum and w_fval */
+  void *storage;          /**< Memory owned by the model (NULL if mapped) */
+  void *mapping;          /**< Mapping of the binary model file (or NULL) */
+  size_t mapping_size;
+} SVM_MODEL;
+
+/** \brief Results of the classification of labeled examples. */
+typedef struct model_confusion {
+  unsigned long TP;        /**< positive examples with f(x)>0 */
+  unsigned long TN;        /**< negative examples with f(x)<=0 */
+  unsigned long FP;        /**< negative examples with f(x)>0 */
+  unsigned long FN;        /**< positive examples with f(x)<=0 */
+  unsigned long unlabeled; /**< examples with label 0 */
+} MODEL_CONFUSION;
+
+SVM_MODEL *model_create(struct svm *svm, FVECTOR **fv_list, KERNEL_PARAM *kernel_parameters);
+int model_save(const SVM_MODEL *model, const char *path, enum model_format format);
+SVM_MODEL *model_load(const char *path);
+double model_predict(const SVM_MODEL *model, FVECTOR *x);
+void model_predict_batch(const SVM_MODEL *model, FVECTOR **x, unsigned long n,
+			 double *f, THREAD_POOL *pool);
+long model_predict_stream(const SVM_MODEL *model, FILE *in, FILE *out, MODEL_CONFUSION *counts,
+			  THREAD_POOL *pool);
+void model_free(SVM_MODEL *model);
+
+#endif /* MODEL_H_ */
@@ -18,8 +18,24 @@
 #include <string.h>
 #include <stdlib.h>
 
-static int smo_examine_example(struct svm *svm,  int i1);
-static int takeStep(struct svm *svm, int i1, int i2);
+/** \brief State of one run of the Platt solver.
+ *
+ * All state lives here (and in struct svm) rather than in file-scope
+ * variables, so that several SVMs can be trained concurrently.
+ */
+typedef struct platt_context {
+  double C;            /**< The penalty for misclassifying an example during training */
+  double tolerance;
+  double b;            /**< bias of the SVM */
+  double eps;
+  double delta_b;
+  int end_support_i;
+  double *row1_buf, *row2_buf; /**< space for the kernel rows of i1 and i2 */
+  unsigned short rng[3]; /**< State of erand48() */
+} PLATT_CONTEXT;
+
+static int smo_examine_example(struct svm *svm, PLATT_CONTEXT *ctx, int i1);
+static int takeStep(struct svm *svm, PLATT_CONTEXT *ctx, int i1, int i2);
 
 /*************************************************************/
 #define SIGNT(x)  ( (x)>(0)  ?   (1):(-1) )
@@ -28,15 +44,6 @@ static int takeStep(struct svm *svm, int i1, int i2);
 
 #define VERBOSE 1  /* For debugging, to follow progress of training */
 
-/*************************************************************/
-/** C is the penalty for misclassifying an example during training. */
-static double C = 1;
-static double tolerance = 0.001;
-/** bias of the SVM */
-static double b = 0.0;
-static double eps=0.001;
-static double delta_b;
-static int end_support_i = -1;
 
 
 /**
@@ -53,10 +60,23 @@ void train_model_platt(struct svm *svm)
 {
   int k, num_changed, examine_all;
   int iter,max_iter;
+  PLATT_CONTEXT context, *ctx = &context;
   
-  /* initialize some file-scope variables */	
-  C = svm->C;
-  end_support_i = svm->training_count;
+  ctx->C = svm->C;
+  ctx->tolerance = 0.001;
+  ctx->b = 0.0;
+  ctx->eps = 0.001;
+  ctx->delta_b = 0.0;
+  ctx->end_support_i = svm->training_count;
+  ctx->rng[0] = (unsigned short)(svm->seed & 0xffff);
+  ctx->rng[1] = (unsigned short)((svm->seed >> 16) & 0xffff);
+  ctx->rng[2] = (unsigned short)(((unsigned long long)svm->seed >> 32) & 0xffff);
+  ctx->row1_buf = xmalloc(sizeof(double)*ctx->end_support_i);
+  ctx->row2_buf = xmalloc(sizeof(double)*ctx->end_support_i);
+  /* The error E_i = f(x_i) - y_i of every example is kept up to date in
+     takeStep(). With all alphas and b zero, f(x_i) = 0. */
+  for (k = 0; k < ctx->end_support_i; k++)
+    svm->error_cache[k] = -svm->data_class[k];
   
   examine_all = 1;
   iter = 0;
@@ -68,20 +88,20 @@ void train_model_platt(struct svm *svm)
     
     if (examine_all){
       for (k = 0; k < svm->training_count; k++)
-	num_changed += smo_examine_example(svm,k);
+	num_changed += smo_examine_example(svm,ctx,k);
       examine_all = 0;
     } else {
       for (k = 0; k < svm->training_count; k++){
-	if (svm->alpha[k] != 0 && svm->alpha[k] != C)
-	  num_changed += smo_examine_example(svm, k);
+	if (svm->alpha[k] != 0 && svm->alpha[k] != ctx->C)
+	  num_changed += smo_examine_example(svm,ctx,k);
       }
       if (num_changed == 0) examine_all = 1;
     }
     
 #if VERBOSE
-    if (iter % MIN(100,svm->training_count) == 0){
+    if (svm->verbosity>=1 && iter % MIN(100,svm->training_count) == 0){
       fprintf(stderr,"iter=%d; number changed=%d\n",iter,num_changed);
-      svm->b = b;
+      svm->b = ctx->b;
       calculate_diagnostics(svm);
       fprintf(stderr,"train_err: %d/%d (TP:%d, TN:%d, FP:%d,FN:%d) test_err: %d/%d (TP:%d, TN:%d, FP:%d,FN:%d)\n",
 	      svm->training_err_count,svm->training_count,svm->train_TP,svm->train_TN,svm->train_FP,svm->train_FN,
@@ -93,17 +113,21 @@ void train_model_platt(struct svm *svm)
     
     iter++;
   } while ((num_changed > 0 || examine_all) && (iter<max_iter));
-  fprintf(stderr,"\n ***\nDONEDONE SMO-Platt Training iter=%d; number changed=%d\n",iter,num_changed);
-  svm->b = b;
+  if (svm->verbosity>=1)
+    fprintf(stderr,"\n ***\nDONEDONE SMO-Platt Training iter=%d; number changed=%d\n",iter,num_changed);
+  svm->b = ctx->b;
+  free(ctx->row1_buf);
+  free(ctx->row2_buf);
 }
 
 /**
  * \brief Examine a single example.
  * TODO better documentaiton
  * @param svm the SVM model with the Gram matrix and other parameters
+ * @param ctx The state of the solver
  * @param i1 The index of the example to be examined (index in the Gram matrix)
  **/
-static int smo_examine_example(struct svm *svm, int i1)
+static int smo_examine_example(struct svm *svm, PLATT_CONTEXT *ctx, int i1)
 {
   double y1, alph1, E1, r1;
   double *alph = svm->alpha;
@@ -111,14 +135,10 @@ static int smo_examine_example(struct svm *svm, int i1)
   
   y1 = svm->data_class[i1];
   alph1 = alph[i1];
-  
-  if (alph1 > 0 && alph1 < C)
-    E1 = error_cache[i1];/* unbound SV */
-  else
-    E1 = learned_func_nonlinear(svm,i1,b) - y1;
+  E1 = error_cache[i1];
   
   r1 = y1 * E1;
-  if ((r1 < -tolerance && alph1 < C) || (r1 > tolerance && alph1 > 0))
+  if ((r1 < -ctx->tolerance && alph1 < ctx->C) || (r1 > ctx->tolerance && alph1 > 0))
   {
     /* Try i2 by three ways; if successful, then immediately return 1; */
     
@@ -127,9 +147,9 @@ static int smo_examine_example(struct svm *svm, int i1)
       int k, i2;
       double tmax;
       
-      for (i2 = (-1), tmax = 0, k = 0; k < end_support_i; k++)
+      for (i2 = (-1), tmax = 0, k = 0; k < ctx->end_support_i; k++)
       {
-	if (alph[k] > 0 && alph[k] < C)
+	if (alph[k] > 0 && alph[k] < ctx->C)
 	{
 	  double E2, temp;
 	  
@@ -145,7 +165,7 @@ static int smo_examine_example(struct svm *svm, int i1)
       
       if (i2 >= 0)
       {
-	if (takeStep(svm,i1, i2))
+	if (takeStep(svm,ctx,i1,i2))
 	  return 1;
       }
     }
@@ -155,13 +175,13 @@ static int smo_examine_example(struct svm *svm, int i1)
       int k, k0;
       int i2;
       
-      for (k0 = (int)(drand48() * end_support_i), k = k0;
-	   k < end_support_i + k0; k++)
+      for (k0 = (int)(erand48(ctx->rng) * ctx->end_support_i), k = k0;
+	   k < ctx->end_support_i + k0; k++)
       {
-	i2 = k % end_support_i;
-	if (alph[i2] > 0 && alph[i2] < C)
+	i2 = k % ctx->end_support_i;
+	if (alph[i2] > 0 && alph[i2] < ctx->C)
 	{
-	  if (takeStep(svm,i1, i2))
+	  if (takeStep(svm,ctx,i1,i2))
 	    return 1;
 	}
       }
@@ -173,11 +193,11 @@ static int smo_examine_example(struct svm *svm, int i1)
     {
       int k0, k, i2;
       
-      for (k0 = (int)(drand48() * end_support_i), k = k0;
-	   k < end_support_i + k0; k++)
+      for (k0 = (int)(erand48(ctx->rng) * ctx->end_support_i), k = k0;
+	   k < ctx->end_support_i + k0; k++)
       {
-	i2 = k % end_support_i;
-	if (takeStep(svm,i1, i2))
+	i2 = k % ctx->end_support_i;
+	if (takeStep(svm,ctx,i1,i2))
 	  return 1;
       }
     }
@@ -189,7 +209,7 @@ static int smo_examine_example(struct svm *svm, int i1)
 /**
  * \brief TODO.
  */
-static int takeStep(struct svm *svm, int i1, int i2)
+static int takeStep(struct svm *svm, PLATT_CONTEXT *ctx, int i1, int i2)
 {
   int y1, y2, s;
   double alph1, alph2;		/* old_values of alpha_1, alpha_2 */
@@ -204,27 +224,21 @@ static int takeStep(struct svm *svm, int i1, int i2)
   
   alph1 = alph[i1];
   y1 = svm->data_class[i1];
-  if (alph1 > 0 && alph1 < C)
-    E1 = error_cache[i1];
-  else
-    E1 = learned_func_nonlinear(svm, i1,b) - y1;
+  E1 = error_cache[i1];
   
   alph2 = alph[i2];
   y2 = svm->data_class[i2];
-  if (alph2 > 0 && alph2 < C)
-    E2 = error_cache[i2];
-  else
-    E2 = learned_func_nonlinear(svm, i2,b) - y2;
+  E2 = error_cache[i2];
   
   s = y1 * y2;
   
   if (y1 == y2)
     {
       double gamma = alph1 + alph2;
-      if (gamma > C)
+      if (gamma > ctx->C)
 	{
-	  L = gamma - C;
-	  H = C;
+	  L = gamma - ctx->C;
+	  H = ctx->C;
 	}
       else
 	{
@@ -238,12 +252,12 @@ static int takeStep(struct svm *svm, int i1, int i2)
       if (gamma > 0)
 	{
 	  L = 0;
-	  H = C - gamma;
+	  H = ctx->C - gamma;
 	}
       else
 	{
 	  L = -gamma;
-	  H = C;
+	  H = ctx->C;
 	}
     }
   
@@ -270,15 +284,15 @@ static int takeStep(struct svm *svm, int i1, int i2)
       Lobj = c1 * L * L + c2 * L;
       Hobj = c1 * H * H + c2 * H;
       
-      if (Lobj > Hobj + eps)
+      if (Lobj > Hobj + ctx->eps)
 	a2 = L;
-      else if (Lobj < Hobj - eps)
+      else if (Lobj < Hobj - ctx->eps)
 	a2 = H;
       else
 	a2 = alph2;
     }
   
-  if (fabs(a2 - alph2) < eps * (a2 + alph2 + eps))
+  if (fabs(a2 - alph2) < ctx->eps * (a2 + alph2 + ctx->eps))
     return 0;
   
   a1 = alph1 - s * (a2 - alph2);
@@ -287,52 +301,52 @@ static int takeStep(struct svm *svm, int i1, int i2)
       a2 += s * a1;
       a1 = 0;
     }
-  else if (a1 > C)
+  else if (a1 > ctx->C)
     {
-      double t = a1 - C;
+      double t = a1 - ctx->C;
       a2 += s * t;
-      a1 = C;
+      a1 = ctx->C;
     }
   
   {
     double b1, b2, bnew;
     
-    if (a1 > 0 && a1 < C)
-      bnew = b + E1 + y1 * (a1 - alph1) * k11 + y2 * (a2 - alph2) * k12;
+    if (a1 > 0 && a1 < ctx->C)
+      bnew = ctx->b + E1 + y1 * (a1 - alph1) * k11 + y2 * (a2 - alph2) * k12;
     else
       {
-	if (a2 > 0 && a2 < C)
+	if (a2 > 0 && a2 < ctx->C)
 	  bnew =
-	    b + E2 + y1 * (a1 - alph1) * k12 + y2 * (a2 -
+	    ctx->b + E2 + y1 * (a1 - alph1) * k12 + y2 * (a2 -
 						     alph2) * k22;
 	else
 	  {
-	    b1 = b + E1 + y1 * (a1 - alph1) * k11 + y2 * (a2 -
+	    b1 = ctx->b + E1 + y1 * (a1 - alph1) * k11 + y2 * (a2 -
 							  alph2) * k12;
-	    b2 = b + E2 + y1 * (a1 - alph1) * k12 + y2 * (a2 -
+	    b2 = ctx->b + E2 + y1 * (a1 - alph1) * k12 + y2 * (a2 -
 							  alph2) * k22;
 	    bnew = (b1 + b2) / 2;
 	  }
       }
     
-    delta_b = bnew - b;
-    b = bnew;
+    ctx->delta_b = bnew - ctx->b;
+    ctx->b = bnew;
   }
   
   {
-		/* Update error cache using new Lagrange multipliers */
+		/* Update the error cache of all examples using the new Lagrange
+		   multipliers, so that E_i never has to be calculated from scratch */
     int i;
     double t1 = y1 * (a1 - alph1);
     double t2 = y2 * (a2 - alph2);
+    const double *K1 = svm_kernel_row(svm,i1,0,ctx->end_support_i,ctx->row1_buf);
+    const double *K2 = svm_kernel_row(svm,i2,0,ctx->end_support_i,ctx->row2_buf);
     
-    for (i = 0; i < end_support_i; i++)
-      {
-				if (0 < alph[i] && alph[i] < C)
-					error_cache[i] +=   t1 * svm->kernel(i1, i, svm) + 
-						t2 * svm->kernel(i2, i, svm) - delta_b;
-      }
-    error_cache[i1] = 0.;
-    error_cache[i2] = 0.;
+    /* No entry is forced to zero: b makes the error of only one of the
+       examples zero (or neither, if b is the mean of b1 and b2), and the
+       cache is never recalculated, so each entry must stay f(x_i)-y_i. */
+    for (i = 0; i < ctx->end_support_i; i++)
+      error_cache[i] += t1 * K1[i] + t2 * K2[i] - ctx->delta_b;
   }
   
   alph[i1] = a1;				/* Store a1 in the alpha array. */
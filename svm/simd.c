@@ -0,0 +1,534 @@
+/************************************************************************/
+/*                                                                      */
+/*   simd.c                                                             */
+/*                                                                      */
+/*   Vectorized (AVX2/AVX-512) inner loops with scalar fallbacks.       */
+/*                                                                      */
+/*   Author: Peter N Robinson                                           */
+/*   Date: 12.04.15                                                     */
+/*                                                                      */
+/*   Copyright (c) 2015  Peter Robinson - All rights reserved           */
+/*                                                                      */
+/*   This software is available on a BSD2 license.                      */
+/*                                                                      */
+/************************************************************************/
+
+#include "simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+/* Constants of the vectorized exp(). The argument is reduced to
+ * x = n*ln(2) + r with |r| <= ln(2)/2, exp(r) is evaluated with the
+ * Taylor polynomial of degree 13 (truncation error < 1e-17) and the
+ * result is scaled by 2*2^(n-1), which keeps the exponent of the scale
+ * factor in range for all n. ln(2) is split into a high part with
+ * trailing zero bits and a low part, so that n*LN2_HI is exact. */
+#define EXP_LOG2E  1.4426950408889634074
+#define EXP_LN2_HI 6.93147180369123816490e-01
+#define EXP_LN2_LO 1.90821492927058770002e-10
+#define EXP_MAX    709.782712893384 /* ln(DBL_MAX), exp(x) overflows above this */
+#define EXP_MIN    (-707.7)     /* exp(x) < 5e-308 is set to 0 below this */
+#define EXP_SHIFT  6755399441055744.0 /* 1.5*2^52: adding it leaves n in the low mantissa bits */
+
+static const double exp_coef[14] = {
+  1.0, 1.0, 1.0/2, 1.0/6, 1.0/24, 1.0/120, 1.0/720, 1.0/5040, 1.0/40320,
+  1.0/362880, 1.0/3628800, 1.0/39916800, 1.0/479001600, 1.0/6227020800.0
+};
+
+/** Cached result of simd_get_level(), -1 if not determined yet */
+static int detected_level = -1;
+
+
+/** \brief Return the best instruction set supported by this CPU. */
+enum simd_level simd_get_level(void)
+{
+  int level = __atomic_load_n(&detected_level,__ATOMIC_RELAXED);
+  if (level < 0) {
+    level = SIMD_SCALAR;
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+      level = SIMD_AVX512;
+    else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+      level = SIMD_AVX2;
+    else if (__builtin_cpu_supports("sse4.2"))
+      level = SIMD_SSE42;
+#endif
+    __atomic_store_n(&detected_level,level,__ATOMIC_RELAXED);
+  }
+  return (enum simd_level)level;
+}
+
+const char *simd_level_name(enum simd_level level)
+{
+  switch (level) {
+  case SIMD_AVX512: return "AVX-512";
+  case SIMD_AVX2: return "AVX2";
+  case SIMD_SSE42: return "SSE4.2";
+  default: return "scalar";
+  }
+}
+
+
+#ifdef SIMD_X86
+
+__attribute__((target("avx2,fma")))
+static inline __m256d exp_avx2_4(__m256d x)
+{
+  __m256d n, r, p, scale;
+  __m256i bits;
+  __m256d over = _mm256_cmp_pd(x,_mm256_set1_pd(EXP_MAX),_CMP_GT_OQ);
+  __m256d under = _mm256_cmp_pd(x,_mm256_set1_pd(EXP_MIN),_CMP_LT_OQ);
+  x = _mm256_min_pd(_mm256_max_pd(x,_mm256_set1_pd(EXP_MIN)),_mm256_set1_pd(EXP_MAX));
+  n = _mm256_round_pd(_mm256_mul_pd(x,_mm256_set1_pd(EXP_LOG2E)),
+		      _MM_FROUND_TO_NEAREST_INT|_MM_FROUND_NO_EXC);
+  r = _mm256_fnmadd_pd(n,_mm256_set1_pd(EXP_LN2_HI),x);
+  r = _mm256_fnmadd_pd(n,_mm256_set1_pd(EXP_LN2_LO),r);
+  p = _mm256_set1_pd(exp_coef[13]);
+  for (int k=12; k>=0; --k)
+    p = _mm256_fmadd_pd(p,r,_mm256_set1_pd(exp_coef[k]));
+  bits = _mm256_castpd_si256(_mm256_add_pd(n,_mm256_set1_pd(EXP_SHIFT)));
+  bits = _mm256_add_epi64(_mm256_slli_epi64(bits,52),_mm256_set1_epi64x(1022LL << 52));
+  scale = _mm256_castsi256_pd(bits);
+  p = _mm256_mul_pd(_mm256_add_pd(p,p),scale);
+  p = _mm256_blendv_pd(p,_mm256_set1_pd(HUGE_VAL),over);
+  return _mm256_andnot_pd(under,p);
+}
+
+__attribute__((target("avx2,fma")))
+static void exp_avx2(double *x, unsigned int n)
+{
+  unsigned int i;
+  for (i=0; i+4<=n; i+=4)
+    _mm256_storeu_pd(x+i,exp_avx2_4(_mm256_loadu_pd(x+i)));
+  if (i < n) {
+    /* the tail goes through the same code, so results do not depend on the position */
+    double tmp[4] = {0.0,0.0,0.0,0.0};
+    memcpy(tmp,x+i,(n-i)*sizeof(double));
+    _mm256_storeu_pd(tmp,exp_avx2_4(_mm256_loadu_pd(tmp)));
+    memcpy(x+i,tmp,(n-i)*sizeof(double));
+  }
+}
+
+__attribute__((target("avx512f")))
+static void exp_avx512(double *x, unsigned int n)
+{
+  for (unsigned int i=0; i<n; i+=8) {
+    __mmask8 m = n-i >= 8 ? 0xff : (__mmask8)((1u << (n-i)) - 1);
+    __m512d v = _mm512_maskz_loadu_pd(m,x+i);
+    __m512d nn, r, p, scale;
+    __m512i bits;
+    __mmask8 over = _mm512_cmp_pd_mask(v,_mm512_set1_pd(EXP_MAX),_CMP_GT_OQ);
+    __mmask8 under = _mm512_cmp_pd_mask(v,_mm512_set1_pd(EXP_MIN),_CMP_LT_OQ);
+    v = _mm512_min_pd(_mm512_max_pd(v,_mm512_set1_pd(EXP_MIN)),_mm512_set1_pd(EXP_MAX));
+    nn = _mm512_roundscale_pd(_mm512_mul_pd(v,_mm512_set1_pd(EXP_LOG2E)),
+			      _MM_FROUND_TO_NEAREST_INT|_MM_FROUND_NO_EXC);
+    r = _mm512_fnmadd_pd(nn,_mm512_set1_pd(EXP_LN2_HI),v);
+    r = _mm512_fnmadd_pd(nn,_mm512_set1_pd(EXP_LN2_LO),r);
+    p = _mm512_set1_pd(exp_coef[13]);
+    for (int k=12; k>=0; --k)
+      p = _mm512_fmadd_pd(p,r,_mm512_set1_pd(exp_coef[k]));
+    bits = _mm512_castpd_si512(_mm512_add_pd(nn,_mm512_set1_pd(EXP_SHIFT)));
+    bits = _mm512_add_epi64(_mm512_slli_epi64(bits,52),_mm512_set1_epi64(1022LL << 52));
+    scale = _mm512_castsi512_pd(bits);
+    p = _mm512_mul_pd(_mm512_add_pd(p,p),scale);
+    p = _mm512_mask_mov_pd(p,over,_mm512_set1_pd(HUGE_VAL));
+    p = _mm512_mask_mov_pd(p,under,_mm512_setzero_pd());
+    _mm512_mask_storeu_pd(x+i,m,p);
+  }
+}
+
+#endif /* SIMD_X86 */
+
+
+/**
+ * \brief Replace x[i] by exp(x[i]) for i=0..n-1.
+ *
+ * With AVX2 or AVX-512, the vectorized code is accurate to about one
+ * unit in the last place; results below 5e-308 are flushed to zero.
+ * Both vector paths perform the same operations and give identical
+ * results. Otherwise, exp() of the C library is used.
+ */
+void simd_exp(double *x, unsigned int n)
+{
+  switch (simd_get_level()) {
+#ifdef SIMD_X86
+  case SIMD_AVX512: exp_avx512(x,n); return;
+  case SIMD_AVX2: exp_avx2(x,n); return;
+#endif
+  default:
+    for (unsigned int i=0; i<n; ++i)
+      x[i] = exp(x[i]);
+  }
+}
+
+
+/*
+ * Gradient update of the Fan solver.
+ *
+ * The AVX2 version is compiled without FMA, so that it rounds exactly
+ * like the scalar loop.
+ */
+
+#ifdef SIMD_X86
+/** \brief Load four labels (+1/-1) as doubles. */
+__attribute__((target("avx2")))
+static inline __m256d load_labels_avx2(const signed char *y)
+{
+  int32_t y4;
+  memcpy(&y4,y,sizeof(y4));
+  return _mm256_cvtepi32_pd(_mm_cvtepi8_epi32(_mm_cvtsi32_si128(y4)));
+}
+
+__attribute__((target("avx2")))
+static void update_gradient_avx2(double *G, const signed char *y, const double *Ki,
+				 const double *Kj, double ci, double cj, unsigned int n)
+{
+  __m256d vci = _mm256_set1_pd(ci), vcj = _mm256_set1_pd(cj);
+  unsigned int t;
+  for (t=0; t+4<=n; t+=4) {
+    __m256d yt = load_labels_avx2(y+t);
+    __m256d d = _mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(Ki+t),vci),
+			      _mm256_mul_pd(_mm256_loadu_pd(Kj+t),vcj));
+    _mm256_storeu_pd(G+t,_mm256_add_pd(_mm256_loadu_pd(G+t),_mm256_mul_pd(yt,d)));
+  }
+  for (; t<n; ++t)
+    G[t] += y[t]*(Ki[t]*ci + Kj[t]*cj);
+}
+#endif
+
+
+/**
+ * \brief G[t] += y[t]*(Ki[t]*ci + Kj[t]*cj) for t=0..n-1.
+ *
+ * With ci=y_i*delta_alpha_i and cj=y_j*delta_alpha_j this is the update
+ * of the gradient after alpha_i and alpha_j have changed. Since the y[t]
+ * are +1 or -1, the result is identical to the form
+ * y_i*y_t*K(i,t)*delta_alpha_i + y_j*y_t*K(j,t)*delta_alpha_j.
+ */
+void simd_update_gradient(double *G, const signed char *y, const double *Ki,
+			  const double *Kj, double ci, double cj, unsigned int n)
+{
+  unsigned int t;
+#ifdef SIMD_X86
+  if (simd_get_level() >= SIMD_AVX2) {
+    update_gradient_avx2(G,y,Ki,Kj,ci,cj,n);
+    return;
+  }
+#endif
+  for (t=0; t<n; ++t)
+    G[t] += y[t]*(Ki[t]*ci + Kj[t]*cj);
+}
+
+
+/*
+ * Working set selection of the Fan solver (see selectB() in fan.c).
+ *
+ * Both functions continue a scan that may have been started on earlier
+ * examples: the running maximum/minimum and its index are passed in and
+ * out. Ties go to the later example, as with the >= and <= comparisons
+ * of a sequential scan, so splitting a scan into chunks (or vector lanes)
+ * does not change the result. The examples are index[first..last-1], or
+ * first..last-1 if index is NULL; only the latter case is vectorized.
+ */
+
+#ifdef SIMD_X86
+/** \brief Reduce the lanes of a running argmax (sign=1) or argmin (sign=-1)
+ * into *best and *idx; ties go to the larger index. */
+__attribute__((target("avx2")))
+static void reduce_lanes_avx2(__m256d vbest, __m256d vidx, int sign, double *best, int *idx)
+{
+  double b[4], x[4];
+  _mm256_storeu_pd(b,vbest);
+  _mm256_storeu_pd(x,vidx);
+  for (int l=0; l<4; ++l) {
+    if (sign*b[l] > sign*(*best) || (b[l] == *best && (int)x[l] > *idx)) {
+      *best = b[l];
+      *idx = (int)x[l];
+    }
+  }
+}
+
+__attribute__((target("avx2")))
+static int select_up_avx2(const double *G, const signed char *y, const double *alpha,
+			  const double *C, int first, int last, double *G_max, int *i)
+{
+  const __m256d zero = _mm256_setzero_pd(), sign = _mm256_set1_pd(-0.0);
+  __m256d best = _mm256_set1_pd(*G_max), bidx = _mm256_set1_pd(*i);
+  __m256d idx = _mm256_setr_pd(first,first+1,first+2,first+3);
+  int t;
+  for (t=first; t+4<=last; t+=4) {
+    __m256d yv = load_labels_avx2(y+t), a = _mm256_loadu_pd(alpha+t);
+    __m256d up = _mm256_or_pd(
+      _mm256_and_pd(_mm256_cmp_pd(yv,zero,_CMP_GT_OQ),_mm256_cmp_pd(a,_mm256_loadu_pd(C+t),_CMP_LT_OQ)),
+      _mm256_and_pd(_mm256_cmp_pd(yv,zero,_CMP_LT_OQ),_mm256_cmp_pd(a,zero,_CMP_GT_OQ)));
+    __m256d v = _mm256_mul_pd(_mm256_xor_pd(yv,sign),_mm256_loadu_pd(G+t));
+    __m256d m = _mm256_and_pd(up,_mm256_cmp_pd(v,best,_CMP_GE_OQ));
+    best = _mm256_blendv_pd(best,v,m);
+    bidx = _mm256_blendv_pd(bidx,idx,m);
+    idx = _mm256_add_pd(idx,_mm256_set1_pd(4.0));
+  }
+  reduce_lanes_avx2(best,bidx,1,G_max,i);
+  return t;
+}
+
+__attribute__((target("avx2")))
+static int select_low_avx2(const double *G, const signed char *y, const double *alpha,
+			   const double *C, const double *QD, const double *Ki,
+			   double G_max, double k11, double tau, int first, int last,
+			   double *G_min, double *obj_min, int *j)
+{
+  const __m256d zero = _mm256_setzero_pd(), sign = _mm256_set1_pd(-0.0);
+  __m256d gmin = _mm256_set1_pd(*G_min), omin = _mm256_set1_pd(*obj_min);
+  __m256d jidx = _mm256_set1_pd(*j);
+  __m256d idx = _mm256_setr_pd(first,first+1,first+2,first+3);
+  int t, unused = -1;
+  for (t=first; t+4<=last; t+=4) {
+    __m256d yv = load_labels_avx2(y+t), a = _mm256_loadu_pd(alpha+t), g = _mm256_loadu_pd(G+t);
+    __m256d low = _mm256_or_pd(
+      _mm256_and_pd(_mm256_cmp_pd(yv,zero,_CMP_GT_OQ),_mm256_cmp_pd(a,zero,_CMP_GT_OQ)),
+      _mm256_and_pd(_mm256_cmp_pd(yv,zero,_CMP_LT_OQ),_mm256_cmp_pd(a,_mm256_loadu_pd(C+t),_CMP_LT_OQ)));
+    __m256d v = _mm256_mul_pd(_mm256_xor_pd(yv,sign),g);
+    gmin = _mm256_blendv_pd(gmin,v,_mm256_and_pd(low,_mm256_cmp_pd(v,gmin,_CMP_LE_OQ)));
+    __m256d b = _mm256_add_pd(_mm256_set1_pd(G_max),_mm256_mul_pd(yv,g));
+    __m256d q = _mm256_sub_pd(_mm256_add_pd(_mm256_set1_pd(k11),_mm256_loadu_pd(QD+t)),
+			      _mm256_mul_pd(_mm256_set1_pd(2.0),_mm256_loadu_pd(Ki+t)));
+    q = _mm256_blendv_pd(q,_mm256_set1_pd(tau),_mm256_cmp_pd(q,zero,_CMP_LE_OQ));
+    __m256d obj = _mm256_div_pd(_mm256_xor_pd(_mm256_mul_pd(b,b),sign),q);
+    __m256d m = _mm256_and_pd(_mm256_and_pd(low,_mm256_cmp_pd(b,zero,_CMP_GT_OQ)),
+			      _mm256_cmp_pd(obj,omin,_CMP_LE_OQ));
+    omin = _mm256_blendv_pd(omin,obj,m);
+    jidx = _mm256_blendv_pd(jidx,idx,m);
+    idx = _mm256_add_pd(idx,_mm256_set1_pd(4.0));
+  }
+  reduce_lanes_avx2(gmin,_mm256_set1_pd(-1.0),-1,G_min,&unused);
+  reduce_lanes_avx2(omin,jidx,-1,obj_min,j);
+  return t;
+}
+#endif
+
+
+/**
+ * \brief Continue the search for the example in I_up with the largest -y_t*G_t.
+ *
+ * I_up are the examples with y_t=1 and alpha_t<C_t or y_t=-1 and alpha_t>0.
+ */
+void simd_select_up(const double *G, const signed char *y, const double *alpha,
+		    const double *C, const int *index, int first, int last,
+		    double *G_max, int *i)
+{
+  int k,t;
+#ifdef SIMD_X86
+  if (!index && simd_get_level() >= SIMD_AVX2)
+    first = select_up_avx2(G,y,alpha,C,first,last,G_max,i);
+#endif
+  for (k=first; k<last; ++k) {
+    t = index ? index[k] : k;
+    if ( (y[t] == 1 && alpha[t] < C[t]) || (y[t] == -1 && alpha[t] > 0) ) {
+      if (-y[t] * G[t] >= *G_max) {
+	*G_max = -y[t] * G[t];
+	*i = t;
+      }
+    }
+  }
+}
+
+
+/**
+ * \brief Continue the second order search for the partner j of i in I_low.
+ *
+ * I_low are the examples with y_t=1 and alpha_t>0 or y_t=-1 and alpha_t<C_t.
+ * G_min is the minimum of -y_t*G_t over I_low, and j minimizes
+ * -b^2/a with b = G_max + y_t*G_t > 0 and a = K(i,i)+K(t,t)-2K(i,t).
+ * @param QD The diagonal K(t,t) of the kernel matrix
+ * @param Ki The row K(i,.) of the kernel matrix
+ * @param k11 K(i,i)
+ * @param tau Used instead of a if a <= 0
+ */
+void simd_select_low(const double *G, const signed char *y, const double *alpha,
+		     const double *C, const double *QD, const double *Ki,
+		     double G_max, double k11, double tau,
+		     const int *index, int first, int last,
+		     double *G_min, double *obj_min, int *j)
+{
+  int k,t;
+  double b,a;
+#ifdef SIMD_X86
+  if (!index && simd_get_level() >= SIMD_AVX2)
+    first = select_low_avx2(G,y,alpha,C,QD,Ki,G_max,k11,tau,first,last,G_min,obj_min,j);
+#endif
+  for (k=first; k<last; ++k) {
+    t = index ? index[k] : k;
+    if ( (y[t] == 1 && alpha[t] > 0) || (y[t] == -1 && alpha[t] < C[t]) ) {
+      b = G_max + y[t] * G[t];
+      if (-y[t] * G[t] <= *G_min)
+	*G_min = -y[t] * G[t];
+      if (b > 0) {
+	a = k11 + QD[t] - 2 * Ki[t];
+	if (a <= 0)
+	  a = tau;
+	if ( -(b*b)/a <= *obj_min ) {
+	  *j = t;
+	  *obj_min = -(b*b)/a;
+	}
+      }
+    }
+  }
+}
+
+
+/*
+ * Sparse dot products.
+ *
+ * All variants add the products of matching features in ascending order
+ * of the feature number and form each product in float, exactly as the
+ * scalar merge in sparse_dotproduct_scalar(), so they return the same bits.
+ */
+
+/** If one vector has this many times more features than the other,
+ * the features of the shorter one are searched in the longer one. */
+#define GALLOP_RATIO 32
+
+/** \brief Merge the features [i,na) of a and [j,nb) of b, adding the products
+ * of matching features to sum. */
+static inline double merge_dot(const uint32_t *ia, const float *va, unsigned long i, unsigned long na,
+			       const uint32_t *ib, const float *vb, unsigned long j, unsigned long nb,
+			       double sum)
+{
+  while (i < na && j < nb) {
+    if (ia[i] > ib[j])
+      j++;
+    else if (ia[i] < ib[j])
+      i++;
+    else {
+      sum += va[i] * vb[j];
+      i++;
+      j++;
+    }
+  }
+  return sum;
+}
+
+/** \brief Dot product by galloping (exponential) search of the features of
+ * the short vector s in the long vector l. */
+static double gallop_dot(const uint32_t *is, const float *vs, unsigned long ns,
+			 const uint32_t *il, const float *vl, unsigned long nl)
+{
+  double sum = 0.0;
+  unsigned long i, j = 0;
+  for (i=0; i<ns && j<nl; ++i) {
+    uint32_t key = is[i];
+    unsigned long lo, hi, bound = 1;
+    if (il[j] < key) {
+      while (j+bound < nl && il[j+bound] < key)
+	bound <<= 1;
+      lo = j + bound/2 + 1;
+      hi = j+bound < nl ? j+bound : nl;
+      while (lo < hi) { /* first position with fnum >= key */
+	unsigned long mid = lo + (hi-lo)/2;
+	if (il[mid] < key)
+	  lo = mid+1;
+	else
+	  hi = mid;
+      }
+      j = lo;
+    }
+    if (j < nl && il[j] == key) {
+      sum += vs[i] * vl[j];
+      j++;
+    }
+  }
+  return sum;
+}
+
+#ifdef SIMD_X86
+/* The block intersections load blocks of consecutive feature numbers
+ * (4 with SSE4.2, 8 with AVX2) and compare them all-against-all; only
+ * blocks that contain a match are merged with scalar code. Afterwards
+ * the block with the smaller last feature number is advanced (or both if
+ * they are equal). */
+
+__attribute__((target("sse4.2")))
+static double block_dot_sse42(const uint32_t *ia, const float *va, unsigned long na,
+			      const uint32_t *ib, const float *vb, unsigned long nb)
+{
+  unsigned long i = 0, j = 0;
+  double sum = 0.0;
+  while (i+4 <= na && j+4 <= nb) {
+    __m128i xa = _mm_loadu_si128((const __m128i*)(ia+i));
+    __m128i xb = _mm_loadu_si128((const __m128i*)(ib+j));
+    __m128i m = _mm_or_si128(_mm_cmpeq_epi32(xa,xb),
+			     _mm_cmpeq_epi32(xa,_mm_shuffle_epi32(xb,0x39)));
+    m = _mm_or_si128(m,_mm_cmpeq_epi32(xa,_mm_shuffle_epi32(xb,0x4e)));
+    m = _mm_or_si128(m,_mm_cmpeq_epi32(xa,_mm_shuffle_epi32(xb,0x93)));
+    uint32_t amax = ia[i+3], bmax = ib[j+3];
+    if (!_mm_testz_si128(m,m))
+      sum = merge_dot(ia,va,i,i+4,ib,vb,j,j+4,sum);
+    if (amax <= bmax) i += 4;
+    if (bmax <= amax) j += 4;
+  }
+  return merge_dot(ia,va,i,na,ib,vb,j,nb,sum);
+}
+
+__attribute__((target("avx2")))
+static double block_dot_avx2(const uint32_t *ia, const float *va, unsigned long na,
+			     const uint32_t *ib, const float *vb, unsigned long nb)
+{
+  unsigned long i = 0, j = 0;
+  double sum = 0.0;
+  while (i+8 <= na && j+8 <= nb) {
+    __m256i xa = _mm256_loadu_si256((const __m256i*)(ia+i));
+    __m256i xb = _mm256_loadu_si256((const __m256i*)(ib+j));
+    /* the rotations within the 128 bit lanes of xb and of xb with its lanes swapped */
+    __m256i xs = _mm256_permute2x128_si256(xb,xb,0x01);
+    __m256i m = _mm256_or_si256(_mm256_cmpeq_epi32(xa,xb),_mm256_cmpeq_epi32(xa,xs));
+    m = _mm256_or_si256(m,_mm256_cmpeq_epi32(xa,_mm256_shuffle_epi32(xb,0x39)));
+    m = _mm256_or_si256(m,_mm256_cmpeq_epi32(xa,_mm256_shuffle_epi32(xb,0x4e)));
+    m = _mm256_or_si256(m,_mm256_cmpeq_epi32(xa,_mm256_shuffle_epi32(xb,0x93)));
+    m = _mm256_or_si256(m,_mm256_cmpeq_epi32(xa,_mm256_shuffle_epi32(xs,0x39)));
+    m = _mm256_or_si256(m,_mm256_cmpeq_epi32(xa,_mm256_shuffle_epi32(xs,0x4e)));
+    m = _mm256_or_si256(m,_mm256_cmpeq_epi32(xa,_mm256_shuffle_epi32(xs,0x93)));
+    uint32_t amax = ia[i+7], bmax = ib[j+7];
+    if (!_mm256_testz_si256(m,m))
+      sum = merge_dot(ia,va,i,i+8,ib,vb,j,j+8,sum);
+    if (amax <= bmax) i += 8;
+    if (bmax <= amax) j += 8;
+  }
+  return merge_dot(ia,va,i,na,ib,vb,j,nb,sum);
+}
+#endif
+
+
+/**
+ * \brief Dot product of two sparse vectors with na and nb features.
+ *
+ * The feature numbers (ia, ib) must be in ascending order; va and vb are
+ * the values. Uses galloping search if the lengths are very different and
+ * otherwise a block intersection with SSE4.2 or AVX2 if the CPU supports it.
+ */
+double simd_sparse_dotproduct(const uint32_t *ia, const float *va, unsigned long na,
+			      const uint32_t *ib, const float *vb, unsigned long nb)
+{
+  if (na > GALLOP_RATIO*nb)
+    return gallop_dot(ib,vb,nb,ia,va,na);
+  if (nb > GALLOP_RATIO*na)
+    return gallop_dot(ia,va,na,ib,vb,nb);
+#ifdef SIMD_X86
+  switch (simd_get_level()) {
+  case SIMD_AVX512:
+  case SIMD_AVX2:
+    return block_dot_avx2(ia,va,na,ib,vb,nb);
+  case SIMD_SSE42:
+    return block_dot_sse42(ia,va,na,ib,vb,nb);
+  default:
+    break;
+  }
+#endif
+  return merge_dot(ia,va,0,na,ib,vb,0,nb,0.0);
+}
+
+
+/* eof */
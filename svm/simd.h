@@ -0,0 +1,44 @@
+/************************************************************************/
+/*                                                                      */
+/*   simd.h                                                             */
+/*                                                                      */
+/*   Vectorized (AVX2/AVX-512) inner loops with scalar fallbacks.       */
+/*                                                                      */
+/*   Author: Peter N Robinson                                           */
+/*   Date: 12.04.15                                                     */
+/*                                                                      */
+/*   Copyright (c) 2015  Peter Robinson - All rights reserved           */
+/*                                                                      */
+/*   This software is available on a BSD2 license.                      */
+/*                                                                      */
+/************************************************************************/
+
+#ifndef SIMD_H_
+#define SIMD_H_
+
+#include "svm_util.h"
+
+/** \brief Instruction set used by the vectorized functions.
+ *
+ * The level is determined once at runtime from the CPU, so the same
+ * executable runs on machines without AVX2.
+ */
+enum simd_level { SIMD_SCALAR, SIMD_SSE42, SIMD_AVX2, SIMD_AVX512 };
+
+enum simd_level simd_get_level(void);
+const char *simd_level_name(enum simd_level level);
+void simd_exp(double *x, unsigned int n);
+void simd_update_gradient(double *G, const signed char *y, const double *Ki,
+			  const double *Kj, double ci, double cj, unsigned int n);
+void simd_select_up(const double *G, const signed char *y, const double *alpha,
+		    const double *C, const int *index, int first, int last,
+		    double *G_max, int *i);
+void simd_select_low(const double *G, const signed char *y, const double *alpha,
+		     const double *C, const double *QD, const double *Ki,
+		     double G_max, double k11, double tau,
+		     const int *index, int first, int last,
+		     double *G_min, double *obj_min, int *j);
+double simd_sparse_dotproduct(const uint32_t *ia, const float *va, unsigned long na,
+			      const uint32_t *ib, const float *vb, unsigned long nb);
+
+#endif /* SIMD_H_ */
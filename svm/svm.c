@@ -17,77 +17,587 @@
 #include "svm_util.h"
 #include "platt.h"
 #include "fan.h"
+#include "threadpool.h"
+#include "simd.h"
 
 
+/** \brief Size in bytes of one element of the Gram matrix. */
+static size_t gram_element_size(enum gram_precision precision)
+{
+  switch (precision) {
+  case GRAM_FLOAT: return sizeof(float);
+  case GRAM_HALF:  return sizeof(uint16_t);
+  case GRAM_INT32: return sizeof(int32_t);
+  default:         return sizeof(double);
+  }
+}
+
 /**
- * \brief allocate memory for an initiaze the gram matrix
+ * \brief allocate memory for the gram matrix
+ *
+ * The matrix is stored in a single block. In the GRAM_FULL layout, each
+ * row starts on a 64 byte boundary; in the GRAM_PACKED layout only the
+ * lower triangle is stored, which halves the memory. The entries are
+ * not initialized.
  * @param n The number of examples in the Gram matrix.
+ * @param layout The storage layout.
+ * @param precision The data type used to store the kernel values.
  */
-GRAM_MATRIX * initialize_gram_matrix(unsigned int n){
+GRAM_MATRIX * initialize_gram_matrix(unsigned int n, enum gram_layout layout,
+				     enum gram_precision precision){
   GRAM_MATRIX *gm = (GRAM_MATRIX*)xmalloc(sizeof(GRAM_MATRIX));
+  size_t esize = gram_element_size(precision);
+  size_t per_line = 64/esize; /* elements per cache line */
+  size_t size;
   gm->n = n;
-  gm->matrix = (double**) xmalloc(n*sizeof(double*));
-  for (unsigned i=0;i<n;++i) {
-    gm->matrix[i] = (double*)xmalloc(n*sizeof(double));
+  gm->layout = layout;
+  gm->precision = precision;
+  if (layout == GRAM_PACKED) {
+    gm->stride = 0;
+    size = (size_t)n*(n+1)/2;
+  } else {
+    gm->stride = ((size_t)n+per_line-1) / per_line * per_line;
+    size = (size_t)n*gm->stride;
   }
-  for (unsigned i=0;i<n;++i)
-    for (unsigned j=0;j<n;++j)
-      gm->matrix[i][j]=0.0;
+  gm->matrix = xmalloc_aligned(size*esize,64);
   return gm;
 }
 
+/** \brief Deallocate memory */
+void free_gram_matrix(GRAM_MATRIX *gm){
+  free(gm->matrix);
+  free(gm);
+}
+
+/** \brief Store d at position k of the Gram matrix, converting it to the storage precision. */
+static void gram_store(GRAM_MATRIX *gm, size_t k, double d)
+{
+  switch (gm->precision) {
+  case GRAM_FLOAT: ((float*)gm->matrix)[k] = (float)d; break;
+  case GRAM_HALF:  ((uint16_t*)gm->matrix)[k] = float_to_half((float)d); break;
+  case GRAM_INT32: ((int32_t*)gm->matrix)[k] = (int32_t)lrint(d); break;
+  default:         ((double*)gm->matrix)[k] = d; break;
+  }
+}
+
+/** Number of rows and columns of the tiles of the Gram matrix */
+#define GRAM_TILE 64
+
+/** \brief Shared state of the threads that calculate the Gram matrix. */
+typedef struct gram_work {
+  GRAM_MATRIX *gm;
+  FVECTOR **feature_vector_list;
+  KERNEL_PARAM *kernel_parameters;
+  double *norms;            /**< Squared norms of the examples */
+  unsigned int n_tiles;     /**< Number of tiles in the lower triangle */
+  unsigned int *tile_row;   /**< Row of tile k (in units of GRAM_TILE) */
+  unsigned int *tile_col;   /**< Column of tile k */
+  unsigned int next_tile;   /**< Next tile to be processed (atomic) */
+  int *non_integral;        /**< Per-thread count of values not representable as int32 */
+} GRAM_WORK;
+
+/**
+ * \brief Worker function for the Gram matrix calculation.
+ *
+ * Each thread repeatedly takes the next unprocessed tile of the lower
+ * triangle. Every entry is calculated exactly as in the serial code, so the
+ * result does not depend on the number of threads.
+ */
+static void gram_tile_worker(void *arg, int thread_id)
+{
+  GRAM_WORK *w = (GRAM_WORK*)arg;
+  GRAM_MATRIX *gm = w->gm;
+  unsigned int n = gm->n;
+  unsigned int k;
+  int non_integral = 0;
+  double dots[GRAM_TILE];
+
+  while ((k = __atomic_fetch_add(&w->next_tile,1,__ATOMIC_RELAXED)) < w->n_tiles) {
+    unsigned int i0 = w->tile_row[k]*GRAM_TILE, j0 = w->tile_col[k]*GRAM_TILE;
+    unsigned int i1 = i0+GRAM_TILE < n ? i0+GRAM_TILE : n;
+    unsigned int j1 = j0+GRAM_TILE < n ? j0+GRAM_TILE : n;
+    for (unsigned int i=i0;i<i1;++i) {
+      FVECTOR *a=w->feature_vector_list[i];
+      unsigned int jmax = i+1 < j1 ? i+1 : j1;
+      for (unsigned int j=j0;j<jmax;++j)
+	dots[j-j0] = sparse_dotproduct(a,w->feature_vector_list[j]);
+      kernel_transform_row(w->kernel_parameters,dots,jmax-j0,w->norms[i],w->norms+j0);
+      for (unsigned int j=j0;j<jmax;++j) {
+	double d = dots[j-j0];
+	if (gm->precision == GRAM_INT32 && (d != rint(d) || fabs(d) > INT32_MAX))
+	  non_integral++;
+	gram_store(gm,gram_offset(gm,i,j),d);
+	if (gm->layout == GRAM_FULL && j < i)
+	  gram_store(gm,gram_offset(gm,j,i),d);
+      }
+    }
+  }
+  w->non_integral[thread_id] = non_integral;
+}
+
+/** Number of rows that a thread takes at a time in the inverted index builder */
+#define INDEX_ROW_CHUNK 16
+
+/** \brief Feature-major (transposed) copy of the data.
+ *
+ * The d distinct feature numbers that occur in the data are replaced by
+ * their ranks 0..d-1, so that the size of the index depends only on the
+ * number of nonzeros and not on the largest feature number. For each rank
+ * f, the examples with a nonzero value of the feature are listed in
+ * ascending order in example[start[f]..start[f+1]-1] together with the values.
+ */
+typedef struct inverted_index {
+  unsigned long n_distinct; /**< Number of distinct feature numbers d */
+  size_t nnz;               /**< Number of nonzeros of all examples */
+  size_t *row;              /**< Position of the first nonzero of each example (n+1) */
+  uint32_t *rank;           /**< Rank of the feature number of each nonzero (nnz) */
+  size_t *start;            /**< Start of the list of each rank (d+1) */
+  unsigned int *example;    /**< The postings (NULL until fill_inverted_index()) */
+  float *value;
+  double cost; /**< Number of multiply-adds needed for all dot products (sum of df^2/2) */
+} INVERTED_INDEX;
+
+/** \brief One pass of a stable radix sort: move the pairs (key,pos) to
+ * (key_out,pos_out), ordered by the 16 bits of the key at shift. */
+static void radix_pass(const uint32_t *key, const uint32_t *pos, uint32_t *key_out,
+		       uint32_t *pos_out, size_t nnz, int shift, size_t *count)
+{
+  size_t sum = 0;
+  memset(count,0,(1<<16)*sizeof(size_t));
+  for (size_t k=0;k<nnz;++k)
+    count[(key[k] >> shift) & 0xffff]++;
+  for (size_t b=0;b<(1<<16);++b) {
+    size_t c = count[b];
+    count[b] = sum;
+    sum += c;
+  }
+  for (size_t k=0;k<nnz;++k) {
+    size_t d = count[(key[k] >> shift) & 0xffff]++;
+    key_out[d] = key[k];
+    pos_out[d] = pos[k];
+  }
+}
+
+/** \brief Stable sort of the pairs (key[k],pos[k]) by key, in place. */
+static void radix_sort_pairs(uint32_t *key, uint32_t *pos, size_t nnz, uint32_t max_key)
+{
+  uint32_t *key2 = (uint32_t*)xmalloc(nnz*sizeof(uint32_t)+1);
+  uint32_t *pos2 = (uint32_t*)xmalloc(nnz*sizeof(uint32_t)+1);
+  size_t *count = (size_t*)xmalloc((1<<16)*sizeof(size_t));
+  radix_pass(key,pos,key2,pos2,nnz,0,count);
+  if (max_key >> 16) {
+    radix_pass(key2,pos2,key,pos,nnz,16,count);
+  } else {
+    memcpy(key,key2,nnz*sizeof(uint32_t));
+    memcpy(pos,pos2,nnz*sizeof(uint32_t));
+  }
+  free(count);
+  free(key2);
+  free(pos2);
+}
+
+/**
+ * \brief Rank the feature numbers of the data and count the postings.
+ *
+ * This costs time and memory proportional to the number of nonzeros. The
+ * postings themselves are only allocated by fill_inverted_index(), so that
+ * GRAM_BUILD_AUTO can compare the costs of the builders first.
+ */
+static INVERTED_INDEX *build_inverted_index(unsigned int n, FVECTOR **feature_vector_list)
+{
+  INVERTED_INDEX *ix = (INVERTED_INDEX*)xmalloc(sizeof(INVERTED_INDEX));
+  uint32_t *key, *pos, max_key = 0;
+  size_t nnz = 0, p = 0, k;
+  unsigned long d;
+
+  ix->row = (size_t*)xmalloc((n+1)*sizeof(size_t));
+  for (unsigned int i=0;i<n;++i) {
+    ix->row[i] = nnz;
+    nnz += feature_vector_list[i]->n_features;
+  }
+  ix->row[n] = nnz;
+  ix->nnz = nnz;
+  key = (uint32_t*)xmalloc(nnz*sizeof(uint32_t)+1);
+  pos = (uint32_t*)xmalloc(nnz*sizeof(uint32_t)+1);
+  for (unsigned int i=0;i<n;++i) {
+    FVECTOR *x = feature_vector_list[i];
+    for (unsigned long t=0;t<x->n_features;++t,++p) {
+      key[p] = x->fnum[t];
+      pos[p] = p;
+      if (key[p] > max_key) max_key = key[p];
+    }
+  }
+  radix_sort_pairs(key,pos,nnz,max_key);
+  /* one list per run of equal feature numbers */
+  ix->rank = (uint32_t*)xmalloc(nnz*sizeof(uint32_t)+1);
+  for (k=0,d=0;k<nnz;++k) {
+    if (k > 0 && key[k] != key[k-1])
+      d++;
+    ix->rank[pos[k]] = d;
+  }
+  ix->n_distinct = nnz ? d+1 : 0;
+  ix->start = (size_t*)xmalloc((ix->n_distinct+1)*sizeof(size_t));
+  ix->start[0] = 0;
+  for (k=0,d=0;k<nnz;++k)
+    if (k+1 == nnz || key[k+1] != key[k])
+      ix->start[++d] = k+1;
+  ix->cost = 0.0;
+  for (d=0;d<ix->n_distinct;++d) {
+    double df = (double)(ix->start[d+1]-ix->start[d]);
+    ix->cost += 0.5*df*df;
+  }
+  ix->example = NULL;
+  ix->value = NULL;
+  free(key);
+  free(pos);
+  return ix;
+}
+
+/** \brief Allocate and fill the postings of the index. */
+static void fill_inverted_index(INVERTED_INDEX *ix, unsigned int n, FVECTOR **feature_vector_list)
+{
+  size_t *fill = (size_t*)xmalloc((ix->n_distinct+1)*sizeof(size_t));
+  ix->example = (unsigned int*)xmalloc(ix->nnz*sizeof(unsigned int)+1);
+  ix->value = (float*)xmalloc(ix->nnz*sizeof(float)+1);
+  memcpy(fill,ix->start,(ix->n_distinct+1)*sizeof(size_t));
+  for (unsigned int i=0;i<n;++i) {
+    FVECTOR *x = feature_vector_list[i];
+    const uint32_t *rank = ix->rank+ix->row[i];
+    for (unsigned long t=0;t<x->n_features;++t) {
+      size_t k = fill[rank[t]]++;
+      ix->example[k] = i;
+      ix->value[k] = x->fval[t];
+    }
+  }
+  free(fill);
+}
+
+static void free_inverted_index(INVERTED_INDEX *ix)
+{
+  free(ix->row);
+  free(ix->rank);
+  free(ix->start);
+  free(ix->example);
+  free(ix->value);
+  free(ix);
+}
+
+/** \brief Shared state of the threads of the inverted index builder. */
+typedef struct index_work {
+  GRAM_MATRIX *gm;
+  FVECTOR **feature_vector_list;
+  KERNEL_PARAM *kernel_parameters;
+  double *norms;            /**< Squared norms of the examples */
+  INVERTED_INDEX *ix;
+  unsigned int next_row;    /**< Next block of rows to be processed (atomic) */
+  int *non_integral;        /**< Per-thread count of values not representable as int32 */
+} INDEX_WORK;
+
+/**
+ * \brief Worker function for the inverted index builder.
+ *
+ * For row i, the dot products with all examples j<=i are accumulated at
+ * once by walking the posting lists of the features of example i. The
+ * features of i are visited in ascending order and the products are formed
+ * in float as in sparse_dotproduct(), so each dot product is bit-identical
+ * to the one of the merge-based code.
+ */
+static void index_row_worker(void *arg, int thread_id)
+{
+  INDEX_WORK *w = (INDEX_WORK*)arg;
+  GRAM_MATRIX *gm = w->gm;
+  INVERTED_INDEX *ix = w->ix;
+  unsigned int n = gm->n;
+  unsigned int r;
+  int non_integral = 0;
+  double *acc = (double*)xmalloc(n*sizeof(double));
+
+  while ((r = __atomic_fetch_add(&w->next_row,INDEX_ROW_CHUNK,__ATOMIC_RELAXED)) < n) {
+    unsigned int rmax = r+INDEX_ROW_CHUNK < n ? r+INDEX_ROW_CHUNK : n;
+    for (unsigned int i=r;i<rmax;++i) {
+      FVECTOR *a = w->feature_vector_list[i];
+      const uint32_t *rank = ix->rank+ix->row[i];
+      for (unsigned int j=0;j<=i;++j)
+	acc[j] = 0.0;
+      for (unsigned long t=0;t<a->n_features;++t) {
+	float av = a->fval[t];
+	size_t end = ix->start[rank[t]+1];
+	for (size_t k=ix->start[rank[t]]; k<end && ix->example[k]<=i; ++k)
+	  acc[ix->example[k]] += av * ix->value[k];
+      }
+      kernel_transform_row(w->kernel_parameters,acc,i+1,w->norms[i],w->norms);
+      for (unsigned int j=0;j<=i;++j) {
+	double d = acc[j];
+	if (gm->precision == GRAM_INT32 && (d != rint(d) || fabs(d) > INT32_MAX))
+	  non_integral++;
+	gram_store(gm,gram_offset(gm,i,j),d);
+	if (gm->layout == GRAM_FULL && j < i)
+	  gram_store(gm,gram_offset(gm,j,i),d);
+      }
+    }
+  }
+  free(acc);
+  w->non_integral[thread_id] = non_integral;
+}
+
+/** \brief Calculate the Gram matrix with sparse_dotproduct() in tiles (see gram_tile_worker()).
+ * @return the number of values not representable as int32
+ */
+static int calculate_gram_tiled(GRAM_MATRIX *gm, FVECTOR **feature_vector_list,
+				KERNEL_PARAM *kernel_parameters, double *norms, int n_threads)
+{
+  GRAM_WORK work;
+  unsigned int nb = (gm->n+GRAM_TILE-1)/GRAM_TILE;
+  unsigned int k;
+  int non_integral = 0;
+  work.gm = gm;
+  work.feature_vector_list = feature_vector_list;
+  work.kernel_parameters = kernel_parameters;
+  work.norms = norms;
+  work.n_tiles = nb*(nb+1)/2;
+  work.tile_row = (unsigned int*)xmalloc(work.n_tiles*sizeof(unsigned int));
+  work.tile_col = (unsigned int*)xmalloc(work.n_tiles*sizeof(unsigned int));
+  work.next_tile = 0;
+  work.non_integral = (int*)xmalloc(n_threads*sizeof(int));
+  k = 0;
+  for (unsigned int bi=0;bi<nb;++bi)
+    for (unsigned int bj=0;bj<=bi;++bj) {
+      work.tile_row[k] = bi;
+      work.tile_col[k] = bj;
+      k++;
+    }
+  if (n_threads > 1) {
+    THREAD_POOL *pool = threadpool_create(n_threads);
+    threadpool_run(pool,gram_tile_worker,&work);
+    threadpool_free(pool);
+  } else {
+    gram_tile_worker(&work,0);
+  }
+  for (int t=0;t<n_threads;++t)
+    non_integral += work.non_integral[t];
+  free(work.tile_row);
+  free(work.tile_col);
+  free(work.non_integral);
+  return non_integral;
+}
+
+/** \brief Calculate the Gram matrix row by row through the inverted index (see index_row_worker()).
+ * @return the number of values not representable as int32
+ */
+static int calculate_gram_indexed(GRAM_MATRIX *gm, FVECTOR **feature_vector_list,
+				  KERNEL_PARAM *kernel_parameters, double *norms,
+				  INVERTED_INDEX *ix, int n_threads)
+{
+  INDEX_WORK work;
+  int non_integral = 0;
+  work.gm = gm;
+  work.feature_vector_list = feature_vector_list;
+  work.kernel_parameters = kernel_parameters;
+  work.norms = norms;
+  work.ix = ix;
+  work.next_row = 0;
+  work.non_integral = (int*)xmalloc(n_threads*sizeof(int));
+  if (n_threads > 1) {
+    THREAD_POOL *pool = threadpool_create(n_threads);
+    threadpool_run(pool,index_row_worker,&work);
+    threadpool_free(pool);
+  } else {
+    index_row_worker(&work,0);
+  }
+  for (int t=0;t<n_threads;++t)
+    non_integral += work.non_integral[t];
+  free(work.non_integral);
+  return non_integral;
+}
+
+/**
+ * \brief Calculate the Gram matrix of the feature vectors.
+ *
+ * Only the lower triangle is calculated; in the GRAM_FULL layout it
+ * is mirrored into the upper triangle. The triangle is divided into
+ * square tiles of GRAM_TILE x GRAM_TILE entries, so that both sets of
+ * feature vectors of a tile stay in the cache, and the tiles are
+ * distributed dynamically over gram_parameters->n_threads threads.
+ * <p>
+ * For sparse data, the dot products can instead be accumulated through an
+ * inverted index of the features (GRAM_BUILD_INDEX), which costs time
+ * proportional to the number of co-occurring nonzero features rather than
+ * to n^2 merges. GRAM_BUILD_AUTO chooses whichever needs fewer operations.
+ * Both builders give bit-identical results.
+ * @param gram_parameters Storage options, NULL for the defaults (GRAM_FULL, GRAM_DOUBLE, 1 thread, GRAM_BUILD_AUTO, quiet)
+ */
 GRAM_MATRIX * calculate_gram_matrix(unsigned int n,
 				    FVECTOR **feature_vector_list,
-				    KERNEL_PARAM *kernel_parameters) {
-  GRAM_MATRIX *gm =initialize_gram_matrix(n);
-  if(verbosity>=1) {
-    switch (kernel_parameters->kernel_type) {
-    case LINEAR:
-      printf("Calculating gram matrix [size=%u, kernel type=LINEAR]...",n); break;
-    default:
-      printf("Calculating gram matrix [size=%u, kernel type=??]...",n); break;
+				    KERNEL_PARAM *kernel_parameters,
+				    GRAM_PARAM *gram_parameters) {
+  static const char *precision_names[] = {"double","float","half","int32"};
+  static const char *kernel_names[] = {"LINEAR","POLY","RBF","SIGMOID"};
+  enum gram_layout layout = gram_parameters ? gram_parameters->layout : GRAM_FULL;
+  enum gram_precision precision = gram_parameters ? gram_parameters->precision : GRAM_DOUBLE;
+  int n_threads = gram_parameters && gram_parameters->n_threads > 1 ? gram_parameters->n_threads : 1;
+  enum gram_builder builder = gram_parameters ? gram_parameters->builder : GRAM_BUILD_AUTO;
+  int verbosity = gram_parameters ? gram_parameters->verbosity : 0;
+  GRAM_MATRIX *gm =initialize_gram_matrix(n,layout,precision);
+  INVERTED_INDEX *ix = NULL;
+  double *norms = (double*)xmalloc(n*sizeof(double));
+  int non_integral;
+  for (unsigned int i=0;i<n;++i)
+    norms[i] = feature_vector_list[i]->twonorm_sq;
+  if (builder != GRAM_BUILD_MERGE) {
+    ix = build_inverted_index(n,feature_vector_list);
+    if (builder == GRAM_BUILD_AUTO) {
+      /* a merge costs about nnz(a)+nnz(b) steps for each of the n^2/2 pairs */
+      double merge_cost = (double)n*ix->nnz;
+      if (ix->cost >= merge_cost) {
+	free_inverted_index(ix);
+	ix = NULL;
+      }
     }
+    if (ix)
+      fill_inverted_index(ix,n,feature_vector_list);
+  }
+  if(verbosity>=1) {
+    const char *lname = layout==GRAM_PACKED ? "packed" : "full";
+    const char *bname = ix ? "index" : "merge";
+    long kt = kernel_parameters->kernel_type;
+    printf("Calculating gram matrix [size=%u, kernel type=%s, layout=%s, precision=%s, threads=%d, builder=%s, simd=%s]...",
+	   n,kt>=LINEAR && kt<=SIGMOID ? kernel_names[kt] : "??",lname,precision_names[precision],
+	   n_threads,bname,simd_level_name(simd_get_level()));
     fflush(stdout);
   }
-  for (unsigned int i=0;i<n;++i) {
-    FVECTOR *a=feature_vector_list[i];
-    for (unsigned int j=0;j<i;++j) {
-      FVECTOR *b=feature_vector_list[j];
-      double d = kernel_function(kernel_parameters,a,b);
-      gm->matrix[i][j]=d;
-      gm->matrix[j][i]=d;
-    }
-    double d = kernel_function(kernel_parameters,a,a);
-    gm->matrix[i][i]=d;
+  if (ix) {
+    non_integral = calculate_gram_indexed(gm,feature_vector_list,kernel_parameters,norms,ix,n_threads);
+    free_inverted_index(ix);
+  } else {
+    non_integral = calculate_gram_tiled(gm,feature_vector_list,kernel_parameters,norms,n_threads);
   }
+  free(norms);
   if(verbosity>=1) {
     printf("done\n"); fflush(stdout);
   }
+  if (non_integral) {
+    fprintf(stderr,"Warning: %d kernel values are not representable as int32 "
+	    "(use a floating point precision for this kernel)\n",non_integral);
+  }
   return gm;
 }
 
+/** \brief Largest absolute difference between the stored Gram matrix and
+ * the kernel values calculated in double precision. This is used to check
+ * the accuracy of the reduced precision storage modes.
+ */
+double gram_max_deviation(GRAM_MATRIX *gm, FVECTOR **feature_vector_list,
+			  KERNEL_PARAM *kernel_parameters)
+{
+  double maxdev = 0.0;
+  for (unsigned int i=0;i<gm->n;++i) {
+    for (unsigned int j=0;j<=i;++j) {
+      double d = kernel_function(kernel_parameters,feature_vector_list[i],feature_vector_list[j]);
+      double dev = fabs(gram_entry(gm,i,j) - d);
+      if (dev > maxdev) maxdev = dev;
+    }
+  }
+  return maxdev;
+}
+
 
 /** \brief Calculate the kernel function between two feature vectors.
  * This function is used to calculate the kernel function between
  * two vectors. It implements linear, polynomial, RBF, and sigmoid
  * kernels.*/
 double kernel_function(KERNEL_PARAM *k_params, FVECTOR *a, FVECTOR *b)  
+{
+  return kernel_from_dotproduct(k_params,sparse_dotproduct(a,b),a->twonorm_sq,b->twonorm_sq);
+}
+
+/** \brief Apply the kernel to the dot product of two feature vectors.
+ * @param dot The dot product of the two vectors
+ * @param a_norm_sq,b_norm_sq The squared norms of the two vectors (used by RBF only)
+ */
+double kernel_from_dotproduct(KERNEL_PARAM *k_params, double dot, double a_norm_sq, double b_norm_sq)
 {
   switch(k_params->kernel_type) {
     case 0: /* linear */ 
-      return(sparse_dotproduct(a,b)); 
+      return(dot); 
     case 1: /* polynomial */
-      return(pow(k_params->coef_lin*sparse_dotproduct(a,b)+k_params->coef_const,
+      return(pow(k_params->coef_lin*dot+k_params->coef_const,
 		 (double)k_params->poly_degree)); 
     case 2: /* radial basis function */
-      return(exp(-k_params->rbf_gamma*(a->twonorm_sq-2*sparse_dotproduct(a,b)+b->twonorm_sq)));
+      return(exp(-k_params->rbf_gamma*(a_norm_sq-2*dot+b_norm_sq)));
     case 3: /* sigmoid neural net */
-            return(tanh(k_params->coef_lin*sparse_dotproduct(a,b)+k_params->coef_const)); 
+            return(tanh(k_params->coef_lin*dot+k_params->coef_const)); 
     default: printf("Error: Unknown kernel function\n"); exit(1);
   }
 }
 
 
+/** Block size of the temporary arrays of kernel_transform_row() */
+#define TRANSFORM_BLOCK 256
+
+/** \brief Apply the kernel to a row of dot products.
+ *
+ * This is the batched version of kernel_from_dotproduct(): values[j] holds
+ * the dot product of example a with example b_j and is replaced by
+ * K(a,b_j). The exponentials of the RBF and sigmoid kernels are calculated
+ * with simd_exp(), and the polynomial kernel uses repeated squaring
+ * instead of pow(), so that all loops can be vectorized. The results
+ * agree with kernel_function() to about one unit in the last place, and
+ * each result depends only on its own dot product and norms.
+ * @param values The dot products (input) and kernel values (output)
+ * @param n Number of values
+ * @param a_norm_sq Squared norm of a (used by RBF only)
+ * @param b_norm_sq Squared norms of the b_j (used by RBF only)
+ */
+void kernel_transform_row(KERNEL_PARAM *k_params, double *values, unsigned int n,
+			  double a_norm_sq, const double *b_norm_sq)
+{
+  double tmp[TRANSFORM_BLOCK];
+  unsigned int j,k,m;
+  switch(k_params->kernel_type) {
+  case LINEAR:
+    return;
+  case POLY:
+    for (k=0;k<n;k+=TRANSFORM_BLOCK) {
+      double *v = values+k;
+      long d = k_params->poly_degree < 0 ? -k_params->poly_degree : k_params->poly_degree;
+      m = n-k < TRANSFORM_BLOCK ? n-k : TRANSFORM_BLOCK;
+      for (j=0;j<m;++j) {
+	tmp[j] = k_params->coef_lin*v[j]+k_params->coef_const;
+	v[j] = 1.0;
+      }
+      for (; d; d >>= 1) {
+	if (d & 1)
+	  for (j=0;j<m;++j) v[j] *= tmp[j];
+	for (j=0;j<m;++j) tmp[j] *= tmp[j];
+      }
+      if (k_params->poly_degree < 0)
+	for (j=0;j<m;++j) v[j] = 1.0/v[j];
+    }
+    return;
+  case RBF:
+    for (j=0;j<n;++j)
+      values[j] = -k_params->rbf_gamma*(a_norm_sq-2*values[j]+b_norm_sq[j]);
+    simd_exp(values,n);
+    return;
+  case SIGMOID:
+    /* tanh(y) = sign(y) (1-exp(-2|y|))/(1+exp(-2|y|)) */
+    for (k=0;k<n;k+=TRANSFORM_BLOCK) {
+      double *v = values+k;
+      m = n-k < TRANSFORM_BLOCK ? n-k : TRANSFORM_BLOCK;
+      for (j=0;j<m;++j) {
+	v[j] = k_params->coef_lin*v[j]+k_params->coef_const;
+	tmp[j] = -2.0*fabs(v[j]);
+      }
+      simd_exp(tmp,m);
+      for (j=0;j<m;++j)
+	v[j] = copysign((1.0-tmp[j])/(1.0+tmp[j]),v[j]);
+    }
+    return;
+  default: printf("Error: Unknown kernel function\n"); exit(1);
+  }
+}
+
+
 /**
  * This function calculates the kernel evaluation for
  * example k.In this code, we assume that the training
@@ -113,9 +623,10 @@ double learned_func_nonlinear(struct svm *svm, int k, double b)
   alph = svm->alpha;
   N = svm->training_count;
 
+  const double *K = svm_kernel_row(svm,k,0,N,svm->row_buffer);
   for (i = 0; i < N; i++){
     if (alph[i] > 0){
-      s += alph[i] * svm->data_class[i] * svm->kernel(i, k, svm);
+      s += alph[i] * svm->data_class[i] * K[i];
     }
   }
   s -= b;
@@ -123,13 +634,191 @@ double learned_func_nonlinear(struct svm *svm, int k, double b)
 }
 
 
+/** A dense weight vector is always used up to this length */
+#define WEIGHT_DENSE_MIN 65536
+
+/**
+ * \brief Build w from the nonzero components for the distinct feature
+ * numbers of the support vectors (svm->w_fnum, svm->w_fval).
+ *
+ * The features of all support vectors are sorted stably by feature number,
+ * so that the terms of each component are added in the order of the
+ * training examples, as for the dense w.
+ */
+static void sparse_weight_vector(struct svm *svm)
+{
+  uint32_t *key, *pos, max_key = 0;
+  double *term, sum;
+  size_t nnz = 0, p = 0, k, d = 0;
+  int i;
+
+  for (i=0;i<svm->training_count;i++)
+    if (svm->alpha[i] > 0)
+      nnz += svm->fvecs[i]->n_features;
+  key = (uint32_t*)xmalloc(nnz*sizeof(uint32_t)+1);
+  pos = (uint32_t*)xmalloc(nnz*sizeof(uint32_t)+1);
+  term = (double*)xmalloc(nnz*sizeof(double)+1);
+  for (i=0;i<svm->training_count;i++) {
+    if (svm->alpha[i] > 0) {
+      FVECTOR *x = svm->fvecs[i];
+      double c = svm->alpha[i] * svm->data_class[i];
+      for (unsigned long t=0;t<x->n_features;t++,p++) {
+	key[p] = x->fnum[t];
+	pos[p] = p;
+	term[p] = c * x->fval[t];
+	if (key[p] > max_key) max_key = key[p];
+      }
+    }
+  }
+  radix_sort_pairs(key,pos,nnz,max_key);
+  svm->w_fnum = (uint32_t*)xmalloc(nnz*sizeof(uint32_t)+1);
+  svm->w_fval = (double*)xmalloc(nnz*sizeof(double)+1);
+  for (k=0;k<nnz;k=p) {
+    sum = 0.0;
+    for (p=k;p<nnz && key[p]==key[k];p++)
+      sum += term[pos[p]];
+    if (sum != 0) {
+      svm->w_fnum[d] = key[k];
+      svm->w_fval[d] = sum;
+      d++;
+    }
+  }
+  svm->w_nnz = d;
+  free(key);
+  free(pos);
+  free(term);
+}
+
+/**
+ * \brief Collapse the model of a linear kernel into w = sum_i alpha_i y_i x_i.
+ *
+ * This requires svm->fvecs and svm->kernel_parameters. w is stored
+ * densely in svm->w, indexed by the feature number, if its length is at
+ * most WEIGHT_DENSE_MIN or four times the number of nonzero features of
+ * the training data. Otherwise only its nonzero components are stored,
+ * in svm->w_fnum and svm->w_fval, with the same double values.
+ */
+void svm_calculate_weight_vector(struct svm *svm)
+{
+  unsigned long n_w = 1, nnz = 0, t;
+  int i;
+
+  free(svm->w);
+  free(svm->w_fnum);
+  free(svm->w_fval);
+  svm->w = NULL;
+  svm->w_fnum = NULL;
+  svm->w_fval = NULL;
+  svm->n_w = svm->w_nnz = 0;
+  if (!svm->fvecs || !svm->kernel_parameters || svm->kernel_parameters->kernel_type != LINEAR)
+    return;
+  for (i=0;i<svm->training_count;i++) {
+    FVECTOR *x = svm->fvecs[i];
+    nnz += x->n_features;
+    if (x->n_features && x->fnum[x->n_features-1] >= n_w)
+      n_w = x->fnum[x->n_features-1]+1;
+  }
+  if (n_w > WEIGHT_DENSE_MIN && n_w > 4*nnz) {
+    sparse_weight_vector(svm);
+    return;
+  }
+  if (!(svm->w = calloc(n_w,sizeof(svm->w[0])))) {
+    fprintf(stderr,"Could not allocate memory for svm->w (%s, %d)\n",
+	    __FILE__,__LINE__);
+    exit(1);
+  }
+  svm->n_w = n_w;
+  for (i=0;i<svm->training_count;i++) {
+    if (svm->alpha[i] > 0) {
+      FVECTOR *x = svm->fvecs[i];
+      double c = svm->alpha[i] * svm->data_class[i];
+      for (t=0;t<x->n_features;t++)
+	svm->w[x->fnum[t]] += c * x->fval[t];
+    }
+  }
+}
+
+/** \brief The norm |w| of the weight vector in feature space.
+ *
+ * Without a collapsed weight vector, |w|^2 = sum_i alpha_i y_i (f(x_i)+b)
+ * is obtained from the cached decision values.
+ */
+double svm_weight_norm(struct svm *svm)
+{
+  double s = 0.0;
+  unsigned long k;
+  int i;
+  if (svm->w) {
+    for (k=0;k<svm->n_w;k++)
+      s += svm->w[k] * svm->w[k];
+  } else if (svm->w_fnum) {
+    for (k=0;k<svm->w_nnz;k++)
+      s += svm->w_fval[k] * svm->w_fval[k];
+  } else {
+    for (i=0;i<svm->training_count;i++)
+      if (svm->alpha[i] > 0)
+	s += svm->alpha[i] * svm->data_class[i] * (svm->decision_values[i] + svm->b);
+  }
+  return sqrt(s);
+}
+
+
+/**
+ * \brief Calculate the decision values f(x_k) = sum_i alpha_i y_i K(i,k) - b
+ * of all training and test examples into svm->decision_values.
+ *
+ * The kernel row of each support vector is visited once, instead of one
+ * row per example as with learned_func_nonlinear(). The terms of each
+ * sum are added in the same order, so the values are identical.
+ * If the model was collapsed into svm->w (or svm->w_fnum), f(x_k) =
+ * w*x_k - b is calculated from the features of x_k alone.
+ */
+void svm_calculate_decision_values(struct svm *svm)
+{
+  int N = svm->training_count;
+  int NN = svm->training_count + svm->test_count;
+  double *f = svm->decision_values;
+  double *alph = svm->alpha;
+  int i,k;
+
+  if (svm->w) {
+    for (k=0;k<NN;k++) {
+      FVECTOR *x = svm->fvecs[k];
+      double s = 0.0;
+      for (unsigned long t=0;t<x->n_features;t++)
+	if (x->fnum[t] < svm->n_w)
+	  s += svm->w[x->fnum[t]] * x->fval[t];
+      f[k] = s - svm->b;
+    }
+    return;
+  }
+  if (svm->w_fnum) {
+    for (k=0;k<NN;k++)
+      f[k] = sparse_weight_dotproduct(svm->w_fnum,svm->w_fval,svm->w_nnz,svm->fvecs[k]) - svm->b;
+    return;
+  }
+  for (k=0;k<NN;k++)
+    f[k] = 0.0;
+  for (i=0;i<N;i++) {
+    if (alph[i] > 0) {
+      double c = alph[i] * svm->data_class[i];
+      const double *K = svm_kernel_row(svm,i,0,NN,svm->row_buffer);
+      for (k=0;k<NN;k++)
+	f[k] += c * K[k];
+    }
+  }
+  for (k=0;k<NN;k++)
+    f[k] -= svm->b;
+}
+
+
 /** \brief This function calculates the objective of the dual. */
 double objective_function(struct svm *svm)
 {
   int i,j;
   double obj = 0.0;
   int end_support_i;
-  unsigned char y1,y2;
+  signed char y1,y2;
   double a1,a2;
   double *alph;
 
@@ -137,12 +826,15 @@ double objective_function(struct svm *svm)
   alph = svm->alpha;
 
   for (i = 0; i < end_support_i; ++i) {
+    if (alph[i] == 0)
+      continue; /* all terms of this row are zero */
+    const double *K = svm_kernel_row(svm,i,0,end_support_i,svm->row_buffer);
     for (j=0;j<end_support_i; ++j) {
       y1 = svm->data_class[i];
       y2 = svm->data_class[j];
       a1 = alph[i];
       a2 = alph[j];
-      obj += y1 * y2 * a1 * a2 * svm->kernel(i, j, svm);
+      obj += y1 * y2 * a1 * a2 * K[j];
     }
   }
   obj = (-1.0 * obj )/ 2.0;
@@ -288,7 +980,7 @@ static double training_errors(struct svm *svm)
   N = svm->training_count;
   
   for (i=0; i<svm->training_count; i++){
-    if (SIGNT(learned_func_nonlinear(svm,i,svm->b) ) != SIGNT(svm->data_class[i]) )
+    if (SIGNT(svm->decision_values[i]) != SIGNT(svm->data_class[i]) )
       n_error++;
   }
   return n_error;
@@ -310,7 +1002,7 @@ static double test_errors(struct svm *svm)
   
   for (i = svm->training_count; i < max; i++)
   {
-    if (SIGNT(learned_func_nonlinear(svm,i,svm->b) ) != SIGNT(svm->data_class[i]) )
+    if (SIGNT(svm->decision_values[i]) != SIGNT(svm->data_class[i]) )
     n_error++;
   }
   return n_error;
@@ -334,11 +1026,12 @@ void calculate_diagnostics(struct svm *svm)
   
   ntrain_err = ntrain_FP = ntrain_TP =ntrain_FN = ntrain_TN = 0;
   ntest_err = ntest_FP = ntest_TP = ntest_FN = ntest_TN = 0;
+  svm_calculate_decision_values(svm);
   
   /* CALCULATE TRAINING ERROR */
   for (i=0; i<svm->training_count; i++)
   {
-    if (SIGNT(learned_func_nonlinear(svm,i,b)) != SIGNT(svm->data_class[i])) {
+    if (SIGNT(svm->decision_values[i]) != SIGNT(svm->data_class[i])) {
       ntrain_err++;
       if (SIGNT(svm->data_class[i]) == 1)
       ntrain_FN++;
@@ -356,7 +1049,7 @@ void calculate_diagnostics(struct svm *svm)
   
   for (i = svm->training_count; i < max; i++)
   {
-    if ((learned_func_nonlinear(svm,i,b) > 0) != (svm->data_class[i] > 0)) {
+    if ((svm->decision_values[i] > 0) != (svm->data_class[i] > 0)) {
       ntest_err++;
       if (SIGNT(svm->data_class[i]) == 1)
       ntest_FN++;
@@ -439,6 +1132,49 @@ void debug_svm_struct(struct svm *svm)
 void free_svm(struct svm *svm){
   free(svm->alpha);
   free(svm->error_cache);
+  free(svm->row_buffer);
+  free(svm->decision_values);
+  free(svm->w);
+  free(svm->w_fnum);
+  free(svm->w_fval);
+}
+
+
+/**
+ * \brief Return the kernel values K(i,first), ..., K(i,last-1).
+ *
+ * Uses the kernel_row callback of the backend if there is one and
+ * otherwise calls svm->kernel() for each element. The returned pointer
+ * points to K(i,first). It is either out (which must have room for
+ * last-first values) or a pointer into the storage of the backend; in
+ * both cases it must not be written to.
+ */
+const double *svm_kernel_row(struct svm *svm, int i, int first, int last, double *out)
+{
+  int t;
+  if (svm->kernel_row)
+    return svm->kernel_row(i,first,last,out,svm);
+  for (t=first;t<last;++t)
+    out[t-first] = svm->kernel(i,t,svm);
+  return out;
+}
+
+
+/**
+ * \brief kernel_row callback for struct svm when svm->data is a GRAM_MATRIX.
+ *
+ * Rows of a full matrix of doubles are returned directly, all other
+ * layouts and precisions are converted into out.
+ */
+const double *gram_kernel_row(int i, int first, int last, double *out, struct svm *svm)
+{
+  GRAM_MATRIX *gm = (GRAM_MATRIX*)svm->data;
+  int t;
+  if (gm->layout == GRAM_FULL && gm->precision == GRAM_DOUBLE)
+    return (const double*)gm->matrix + (size_t)i*gm->stride + first;
+  for (t=first;t<last;++t)
+    out[t-first] = gram_entry(gm,(unsigned int)i,(unsigned int)t);
+  return out;
 }
 
 
@@ -449,8 +1185,7 @@ void free_svm(struct svm *svm){
 void svm_train(struct svm *svm, enum optimization opt)
 {
   int k;
-  int verbose=2;
-  if (verbose>=1) {
+  if (svm->verbosity>=1) {
     printf("Training SVM...[kernel:%s]\n",opt==PLATT?"platt":"fan");
   }
   
@@ -462,12 +1197,28 @@ void svm_train(struct svm *svm, enum optimization opt)
   }
   for (k=0;k<svm->training_count;k++)
     svm->alpha[k] = 0.0;
+  svm->w = NULL;
+  svm->w_fnum = NULL;
+  svm->w_fval = NULL;
+  svm->n_w = svm->w_nnz = 0;
   
   if (!(svm->error_cache = malloc(sizeof(svm->error_cache[0])*svm->training_count))){
     fprintf(stderr,"Could not allocate memory for svm->error_cache (%s, %d)\n",
 	    __FILE__,__LINE__);
     exit(1);
   }
+  if (!(svm->decision_values = malloc(sizeof(svm->decision_values[0])*
+				      (svm->training_count+svm->test_count)))){
+    fprintf(stderr,"Could not allocate memory for svm->decision_values (%s, %d)\n",
+	    __FILE__,__LINE__);
+    exit(1);
+  }
+  if (!(svm->row_buffer = malloc(sizeof(svm->row_buffer[0])*
+				 (svm->training_count+svm->test_count)))){
+    fprintf(stderr,"Could not allocate memory for svm->row_buffer (%s, %d)\n",
+	    __FILE__,__LINE__);
+    exit(1);
+  }
   
   /*	debug_svm_struct(svm); */
   
@@ -485,6 +1236,8 @@ void svm_train(struct svm *svm, enum optimization opt)
     exit(1);
   }
   
+  svm_calculate_weight_vector(svm);
+  /* this also fills svm->decision_values, which are used from here on */
   calculate_diagnostics(svm);
   
   svm->training_err_count = training_errors(svm);
@@ -507,7 +1260,7 @@ void svm_train(struct svm *svm, enum optimization opt)
     NN = svm->training_count + svm->test_count;
     for (i=0; i<NN; i++)
     {
-      double prediction = learned_func_nonlinear(svm,i, svm->b);
+      double prediction = svm->decision_values[i];
       fprintf(out,"%e\t%e\n",prediction,(double)svm->data_class[i]);
     }
     
@@ -519,12 +1272,16 @@ void svm_train(struct svm *svm, enum optimization opt)
 
 
 void svm_output_message(struct svm *svm){
-  unsigned misclassified, correctly_classified,tot;
+  unsigned misclassified = 0, correctly_classified = 0;
   unsigned int i;
+  double max_norm_sq = 0.0; /* the largest K(x,x) */
   calculate_bound_vs_unbound_supports(svm);
   for (i=0; i<svm->training_count; i++)
   {
-    if (SIGNT(learned_func_nonlinear(svm,i,svm->b)) != SIGNT(svm->data_class[i])) {
+    double norm_sq = svm->kernel(i,i,svm);
+    if (norm_sq > max_norm_sq)
+      max_norm_sq = norm_sq;
+    if (SIGNT(svm->decision_values[i]) != SIGNT(svm->data_class[i])) {
       misclassified++;
     } else {
       correctly_classified++;
@@ -538,8 +1295,8 @@ void svm_output_message(struct svm *svm){
 	 svm->bound_sv+svm->unbound_sv,svm->bound_sv,svm->non_sv);
   printf("L1 loss TODO\n");
   printf("L1 loss TODO\n");
-  printf("Norm of weight vector: |w|=TODO\n");
-  printf("Norm of longest example vector: |x|=TODO\n");
+  printf("Norm of weight vector: |w|=%.5f\n",svm_weight_norm(svm));
+  printf("Norm of longest example vector: |x|=%.5f\n",sqrt(max_norm_sq));
 
 
 
@@ -12,12 +12,79 @@
 
 #include "stdio.h"
 #include "svm_util.h"
+#include "threadpool.h"
 
+/** \brief Storage layout of the Gram matrix. */
+enum gram_layout {
+  GRAM_FULL,   /**< n x n, rows padded to a multiple of 64 bytes */
+  GRAM_PACKED  /**< lower triangle only, row i holds K(i,0..i) */
+};
+
+/** \brief Precision with which the kernel values are stored.
+ *
+ * The values are widened to double when they are read, so that the
+ * solvers always work in double precision. GRAM_INT32 is intended for
+ * kernels with integer scores such as the spectrum and mismatch kernels.
+ */
+enum gram_precision {
+  GRAM_DOUBLE,
+  GRAM_FLOAT,
+  GRAM_HALF,   /**< IEEE 754 binary16 */
+  GRAM_INT32
+};
+
+/** \brief Algorithm used to calculate the dot products of the Gram matrix. */
+enum gram_builder {
+  GRAM_BUILD_AUTO,  /**< choose by the estimated number of operations */
+  GRAM_BUILD_MERGE, /**< sparse_dotproduct() for each pair of examples */
+  GRAM_BUILD_INDEX  /**< accumulate a whole row at once via an inverted feature index */
+};
+
+/** \brief Parameters for the calculation of the Gram matrix. */
+typedef struct gram_parameters {
+  enum gram_layout layout;
+  enum gram_precision precision;
+  int n_threads; /**< Number of threads used to calculate the matrix */
+  enum gram_builder builder;
+  int verbosity; /**< 0: quiet, >=1: report progress on stdout */
+} GRAM_PARAM;
+
+/** \brief The Gram matrix, stored in a single allocation.
+ *
+ * Use gram_entry() to access the elements, which works for all layouts
+ * and precisions.
+ */
 typedef struct gram_mat {
   unsigned int n; /**< Number of data points */
-  double **matrix;
+  enum gram_layout layout;
+  enum gram_precision precision;
+  size_t stride; /**< Distance between rows (in elements) in the GRAM_FULL layout */
+  void *matrix;
 } GRAM_MATRIX;
 
+/** \brief Position of K(i,j) in the Gram matrix storage. */
+static inline size_t gram_offset(const GRAM_MATRIX *gm, unsigned int i, unsigned int j)
+{
+  if (gm->layout == GRAM_FULL)
+    return (size_t)i*gm->stride+j;
+  if (j > i) {
+    unsigned int t = i; i = j; j = t;
+  }
+  return (size_t)i*(i+1)/2+j;
+}
+
+/** \brief Return K(i,j) from the Gram matrix. */
+static inline double gram_entry(const GRAM_MATRIX *gm, unsigned int i, unsigned int j)
+{
+  size_t k = gram_offset(gm,i,j);
+  switch (gm->precision) {
+  case GRAM_FLOAT: return ((const float*)gm->matrix)[k];
+  case GRAM_HALF:  return half_to_float(((const uint16_t*)gm->matrix)[k]);
+  case GRAM_INT32: return ((const int32_t*)gm->matrix)[k];
+  default:         return ((const double*)gm->matrix)[k];
+  }
+}
+
 typedef struct svm
 {
   /* In general, data represents an nxn matrix of scores of kernel evalutions for the
@@ -54,16 +121,49 @@ typedef struct svm
 
 
   int max_iter;
+  /* 0: quiet, >=1: report progress on stdout */
+  int verbosity;
+  /* Initial 48 bit state of the random number generator (erand48) of the
+   * Platt solver; 0 gives the sequence of the unseeded drand48() */
+  unsigned long seed;
+  /* If nonzero, the Fan solver removes examples whose alpha is at a bound
+   * and is unlikely to change from the working set (shrinking). */
+  int shrinking;
+  /* Optional threads for the inner loops of the solvers (NULL: serial) */
+  THREAD_POOL *pool;
+  /* Smallest active set for which the Fan solver uses the pool
+   * (0: PARALLEL_MIN of fan.c) */
+  int parallel_min;
+  /* Optional: the training and test examples and the kernel. If both are
+   * set and the kernel is linear, the model is collapsed into the weight
+   * vector w after training (see svm_calculate_weight_vector()). */
+  FVECTOR **fvecs;
+  KERNEL_PARAM *kernel_parameters;
 
   void *userdata;
 
   /* The kernel function */
   double (*kernel)(int i1, int i2, struct svm *svm);
+  /* Optional: the kernel values K(i,first..last-1) in one call. Returns
+   * either out or a pointer into the storage of the backend. If NULL,
+   * svm_kernel_row() calls kernel() for each element. */
+  const double *(*kernel_row)(int i, int first, int last, double *out, struct svm *svm);
+  double *row_buffer; /* training_count values of scratch space for kernel rows */
 
   /* Learned Model Parameters */
   double *alpha; /* Lagrange multipliers */
   double b;  /* the bias */
   double *error_cache; /* E_i or F_i depending on optimization method */
+  /* f(x_k) for all training and test examples; see svm_calculate_decision_values() */
+  double *decision_values;
+  /* w[fnum] = sum_i alpha_i y_i x_i[fnum] for a linear kernel (NULL if not collapsed) */
+  double *w;
+  unsigned long n_w; /* length of w (largest feature number + 1) */
+  /* The nonzero components of w, by ascending feature number, if w is too
+   * long to be stored densely (then w is NULL) */
+  uint32_t *w_fnum;
+  double *w_fval;
+  unsigned long w_nnz; /* length of w_fnum and w_fval */
 
   char *output_file;
 
@@ -104,14 +204,28 @@ void output_bound_vs_unbound_supports(struct svm *svm, FILE* fp);
 void calculate_diagnostics(struct svm *svm);
 
 
+GRAM_MATRIX * initialize_gram_matrix(unsigned int n, enum gram_layout layout,
+				     enum gram_precision precision);
 GRAM_MATRIX * calculate_gram_matrix(unsigned int n,
 				    FVECTOR **feature_vector_list,
-				    KERNEL_PARAM *kernel_parameters);
+				    KERNEL_PARAM *kernel_parameters,
+				    GRAM_PARAM *gram_parameters);
+void free_gram_matrix(GRAM_MATRIX *gm);
+double gram_max_deviation(GRAM_MATRIX *gm, FVECTOR **feature_vector_list,
+			  KERNEL_PARAM *kernel_parameters);
 double kernel_function(KERNEL_PARAM *k_params, FVECTOR *a, FVECTOR *b);
+double kernel_from_dotproduct(KERNEL_PARAM *k_params, double dot, double a_norm_sq, double b_norm_sq);
+void kernel_transform_row(KERNEL_PARAM *k_params, double *values, unsigned int n,
+			  double a_norm_sq, const double *b_norm_sq);
 
 
 
 void svm_train(struct svm *svm, enum optimization opt);
+void svm_calculate_decision_values(struct svm *svm);
+void svm_calculate_weight_vector(struct svm *svm);
+double svm_weight_norm(struct svm *svm);
+const double *svm_kernel_row(struct svm *svm, int i, int first, int last, double *out);
+const double *gram_kernel_row(int i, int first, int last, double *out, struct svm *svm);
 
 double learned_func_nonlinear(struct svm *svm, int k, double b);
 double objective_function(struct svm *svm);
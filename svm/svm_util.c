@@ -14,69 +14,165 @@
 /************************************************************************/
 
 
+#define _GNU_SOURCE /* strtod_l() */
+#include <locale.h>
+#include <limits.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "svm_util.h"
+#include "simd.h"
 
-/** Verbosity level for output */
-int verbosity;
 
+/** Size of the blocks in which input_open() reads streams */
+#define INPUT_BLOCK (1<<20)
 
-/** \brief Scan file to prepare for data input.
+/**
+ * \brief Make the contents of an input file available in memory.
  *
- * Grep through file and count number of lines, maximum number of
- * spaces per line, and longest line. 
- * @param file name (full path) to file with training data
- * @param n_lines Pointer to variable that will receive the total number of lines of training data
- * @param wol ?
- * @param ll pointer to var that will get the longest line length (ll)
+ * A regular file is mapped read-only with a hint for sequential access,
+ * so that it can be parsed without copying it into line buffers first.
+ * Pipes, terminals and other files that cannot be mapped are read into a
+ * buffer that grows geometrically.
+ * @param path The file, or "-" for stdin
+ * @param in Receives the contents
+ * @return 0 on success, -1 if the file could not be read
  */
-void scan_n_lines_and_features(char *file, 
-			       unsigned *n_lines, 
-			       unsigned *wol, 
-			       unsigned *ll) 
+int input_open(const char *path, INPUT_BUFFER *in)
 {
-  FILE *fl;
-  int ic; /* int value returned from getc representing one char */
-  char c; /* current char value derived from 'ic' */
-  long current_length; /* length of the current line */
-  long current_wol; /* one more than the number of word on the line */
-  
-  if ((fl = fopen (file, "r")) == NULL) { 
-    perror (file); 
-    exit (1); 
+  struct stat st;
+  size_t allocated = 0;
+  ssize_t n;
+  int fd;
+
+  memset(in,0,sizeof(INPUT_BUFFER));
+  if (!strcmp(path,"-")) {
+    fd = STDIN_FILENO;
+  } else if ((fd = open(path,O_RDONLY)) < 0) {
+    perror(path);
+    return -1;
   }
-  current_length=0;
-  current_wol=0;
-  (*ll)=0;
-  (*n_lines)=1;
-  (*wol)=0;
-  /* Get char's one by one. If the char is
-     a '\n', check if the number of white-spaces or the total
-     length of the czurrent line is longer than wol or ll,
-     and reset. */
-  while((ic=getc(fl)) != EOF) {
-    c=(char)ic;
-    current_length++;
-    if(space_or_null((int)c)) {
-      current_wol++;
+  if (fstat(fd,&st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *mapping = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    if (mapping != MAP_FAILED) {
+      madvise(mapping,st.st_size,MADV_SEQUENTIAL);
+      in->mapping = mapping;
+      in->data = (const char*)mapping;
+      in->size = st.st_size;
+      if (fd != STDIN_FILENO)
+	close(fd);
+      return 0;
     }
-    putc(ic,stdout);
-    if(c == '\n') {
-      (*n_lines)++;
-      if(current_length>(*ll)) {
-	(*ll)=current_length;
-      }
-      if(current_wol>(*wol)) {
-	(*wol)=current_wol;
+  }
+  /* not a regular file (or mmap failed): read it */
+  for (;;) {
+    if (in->size+INPUT_BLOCK > allocated) {
+      allocated = allocated ? 2*allocated : 4*INPUT_BLOCK;
+      if (!(in->buffer = (char*)realloc(in->buffer,allocated))) {
+	perror("Out of memory!\n");
+	exit(1);
       }
-      //printf("currentlen=%lu, currentWOL=%lu\n",current_length,current_wol);
-      current_length=0;
-      current_wol=0;
-      
     }
+    n = read(fd,in->buffer+in->size,INPUT_BLOCK);
+    if (n == 0)
+      break;
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      perror(path);
+      free(in->buffer);
+      in->buffer = NULL;
+      if (fd != STDIN_FILENO)
+	close(fd);
+      return -1;
+    }
+    in->size += n;
+  }
+  in->data = in->buffer;
+  if (fd != STDIN_FILENO)
+    close(fd);
+  return 0;
+}
+
+/** \brief Release the contents of an input file. */
+void input_close(INPUT_BUFFER *in)
+{
+  if (in->mapping)
+    munmap(in->mapping,in->size);
+  free(in->buffer);
+  memset(in,0,sizeof(INPUT_BUFFER));
+}
+
+
+/**
+ * \brief Open a temporary file in the directory of path, to be renamed to path.
+ *
+ * Files that are mapped by other processes (models, dataset caches) must
+ * not be truncated or rewritten in place, since the readers would get
+ * SIGBUS. The new contents are written to a temporary file, which
+ * replace_close() renames over path, so that existing mappings keep the
+ * old file.
+ * @param path The file to be replaced
+ * @param tmp_path Receives the name of the temporary file (free() it)
+ * @return The temporary file, or NULL if it could not be created
+ */
+FILE *replace_open(const char *path, char **tmp_path)
+{
+  mode_t mask;
+  FILE *fp;
+  int fd;
+
+  *tmp_path = (char*)xmalloc(strlen(path)+8);
+  sprintf(*tmp_path,"%s.XXXXXX",path);
+  if ((fd = mkstemp(*tmp_path)) < 0) {
+    perror(path);
+    free(*tmp_path);
+    *tmp_path = NULL;
+    return NULL;
+  }
+  /* mkstemp() creates the file with mode 0600 */
+  mask = umask(0);
+  umask(mask);
+  fchmod(fd,0666 & ~mask);
+  if ((fp = fdopen(fd,"wb")) == NULL) {
+    perror(*tmp_path);
+    close(fd);
+    unlink(*tmp_path);
+    free(*tmp_path);
+    *tmp_path = NULL;
+  }
+  return fp;
+}
+
+/**
+ * \brief Close a file opened with replace_open() and move it to path.
+ *
+ * The data are flushed to disk before the rename, so that path always
+ * contains either the old or the complete new file.
+ * @param ok If 0, the writing failed and the temporary file is removed
+ * @return 0 on success, -1 if path was not replaced
+ */
+int replace_close(FILE *fp, char *tmp_path, const char *path, int ok)
+{
+  if (fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+    ok = 0;
+  if (fclose(fp) != 0)
+    ok = 0;
+  if (ok && rename(tmp_path,path) != 0) {
+    perror(path);
+    ok = 0;
   }
-  fclose(fl);
+  if (!ok)
+    unlink(tmp_path);
+  free(tmp_path);
+  return ok ? 0 : -1;
 }
 
+
 /** \brief malloc wrapper. */
 void *xmalloc(size_t size)
 {
@@ -90,6 +186,31 @@ void *xmalloc(size_t size)
   return(ptr);
 }
 
+/** \brief realloc wrapper. */
+void *xrealloc(void *ptr, size_t size)
+{
+  if(size<=0) size=1;
+  ptr=realloc(ptr,size);
+  if(!ptr) {
+    perror ("Out of memory!\n");
+    exit (1);
+  }
+  return(ptr);
+}
+
+/** \brief malloc wrapper for memory aligned to 'alignment' bytes
+ * (a power of two and multiple of sizeof(void*)). Free with free(). */
+void *xmalloc_aligned(size_t size, size_t alignment)
+{
+  void *ptr;
+  if(size<=0) size=1;
+  if(posix_memalign(&ptr,alignment,size)) {
+    perror ("Out of memory!\n");
+    exit (1);
+  }
+  return(ptr);
+}
+
 
 /** \brief Return true (1) if character is a whitespace or NULL.
  * @param c Character to be checked
@@ -103,11 +224,15 @@ int space_or_null(int c) {
 
 
 
-/** \brief Initialize a feature vector during parsing of input file.
+/** \brief Initialize a feature vector.
  * 
- * This function is called during parsing of training file lines and is parsed a vector
- * of features, a label, and a factor. Note that the end of the feature vector is
- * signaled by FEATURE.fnum==0, which otherwise should never occur.
+ * The feature vector is passed a vector of features, a label, and a factor.
+ * Note that the end of the feature vector is signaled by FEATURE.fnum==0,
+ * which otherwise should never occur. The FVECTOR and a copy of its features
+ * are allocated in one block, which is released with free(). The squared
+ * norm needed by the RBF kernel is calculated here once for each vector.
+ * dataset_parse() does not use this function, but stores all
+ * examples in a single block.
  */
 FVECTOR *create_feature_vector(FEATURE *features,double label,double factor)
 {
@@ -119,12 +244,15 @@ FVECTOR *create_feature_vector(FEATURE *features,double label,double factor)
     fnum++;
   }
   fnum++;
-  vec = (FVECTOR *)xmalloc(sizeof(FVECTOR));
-  vec->features = (FEATURE *)xmalloc(sizeof(FEATURE)*(fnum));
-  for(i=0;i<fnum;i++) { 
-      vec->features[i]=features[i];
+  vec = (FVECTOR *)xmalloc(sizeof(FVECTOR)+(sizeof(uint32_t)+sizeof(float))*(fnum));
+  vec->fnum = (uint32_t *)(vec+1);
+  vec->fval = (float *)(vec->fnum+fnum);
+  for(i=0;i<fnum;i++) {
+    vec->fnum[i]=features[i].fnum;
+    vec->fval[i]=features[i].fnum ? features[i].fval : 0.0f;
   }
-  //vec->twonorm_sq=sprod_ss(vec,vec);
+  vec->n_features=fnum-1;
+  vec->twonorm_sq=sparse_dotproduct(vec,vec);
   vec->data_class=label;
   vec->factor=factor;
   return(vec);
@@ -132,38 +260,281 @@ FVECTOR *create_feature_vector(FEATURE *features,double label,double factor)
 
 
 /** \brief Compute the inner product of two sparse vectors.
+ * Compute the dot product of two sparse vectors. Note that
+ * the indices of the vectors must be in ascending order.
+ * This uses the vectorized intersection of simd.c (or a galloping
+ * search for vectors of very different length); the result is
+ * identical to that of sparse_dotproduct_scalar().
+ */
+double sparse_dotproduct(FVECTOR *a, FVECTOR *b)
+{
+  return simd_sparse_dotproduct(a->fnum,a->fval,a->n_features,b->fnum,b->fval,b->n_features);
+}
+
+
+/** \brief Reference implementation of sparse_dotproduct().
  * Compute the dot product of two sparse vectors. Note that 
  * the indices of the vectors must be in ascending order. This
  * allows us to increment the features of a or b until we get to features
  * that match.
  */
-double sparse_dotproduct(FVECTOR *a, FVECTOR *b) 
+double sparse_dotproduct_scalar(FVECTOR *a, FVECTOR *b) 
 {
     register double sum=0;
-    register FEATURE *ai,*bj;
-    ai=a->features;
-    bj=b->features;
-    while (ai->fnum && bj->fnum) {
-      if(ai->fnum > bj->fnum) {
-	bj++;
+    register unsigned long i=0,j=0;
+    while (a->fnum[i] && b->fnum[j]) {
+      if(a->fnum[i] > b->fnum[j]) {
+	j++;
       }
-      else if (ai->fnum < bj->fnum) {
-	ai++;
+      else if (a->fnum[i] < b->fnum[j]) {
+	i++;
       }
       else {
-	sum+=(ai->fval) * (bj->fval);
-	ai++;
-	bj++;
+	sum+=(a->fval[i]) * (b->fval[j]);
+	i++;
+	j++;
       }
     }
     return((double)sum);
 }
 
 
+/** \brief The dot product of a sparse weight vector and a feature vector.
+ *
+ * The components of w are doubles, given by ascending feature number in
+ * w_fnum. The component of each feature of x is found by binary search in
+ * the rest of w, and the terms are added in the order of the features of
+ * x, so that the result is the same as with the dense weight vector.
+ */
+double sparse_weight_dotproduct(const uint32_t *w_fnum, const double *w_fval,
+				unsigned long w_nnz, const FVECTOR *x)
+{
+  double s = 0.0;
+  unsigned long t, j = 0;
+  for (t=0;t<x->n_features && j<w_nnz;t++) {
+    unsigned long lo = j, hi = w_nnz;
+    while (lo < hi) {
+      unsigned long mid = lo+(hi-lo)/2;
+      if (w_fnum[mid] < x->fnum[t])
+	lo = mid+1;
+      else
+	hi = mid;
+    }
+    j = lo;
+    if (j < w_nnz && w_fnum[j] == x->fnum[t])
+      s += w_fval[j++] * x->fval[t];
+  }
+  return s;
+}
+
+
+/** Powers of ten that are exactly representable as double */
+static const double exact_pow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static locale_t c_locale;
+static pthread_once_t c_locale_once = PTHREAD_ONCE_INIT;
+
+static void init_c_locale(void)
+{
+  c_locale = newlocale(LC_ALL_MASK,"C",(locale_t)0);
+}
+
+/** \brief Parse the number in [s,end) with strtod_l() in the C locale.
+ * @return the end of the number, or NULL if there is none
+ */
+static const char *parse_double_strtod(const char *s, const char *end, double *out)
+{
+  char small[128], *buf = small, *e;
+  size_t len = end-s;
+  if (len >= sizeof(small))
+    buf = (char*)xmalloc(len+1);
+  memcpy(buf,s,len);
+  buf[len] = 0;
+  pthread_once(&c_locale_once,init_c_locale);
+  *out = strtod_l(buf,&e,c_locale);
+  len = e-buf;
+  if (buf != small)
+    free(buf);
+  return len ? s+len : NULL;
+}
+
+/**
+ * \brief Parse a decimal floating point number at the beginning of [s,end).
+ *
+ * Numbers with at most 19 significant digits, a mantissa below 2^53 and
+ * a decimal exponent of at most 22 (which covers nearly all values in
+ * practice) are converted with a single multiplication or division by an
+ * exact power of ten, which is correctly rounded. All other numbers
+ * (including hexadecimal floats, inf and nan) are handed to strtod_l().
+ * The result does not depend on the locale.
+ * @return the end of the number, or NULL if there is none
+ */
+static const char *parse_double(const char *s, const char *end, double *out)
+{
+  const char *p = s;
+  uint64_t mant = 0;
+  int ndigits = 0, exp10 = 0, any = 0, inexact = 0, neg = 0;
+  if (p < end && (*p == '+' || *p == '-'))
+    neg = (*p++ == '-');
+  for (; p < end && *p >= '0' && *p <= '9'; ++p) {
+    any = 1;
+    if (ndigits < 19) {
+      mant = mant*10+(*p-'0');
+      if (mant) ndigits++;
+    } else {
+      exp10++;
+      if (*p != '0') inexact = 1;
+    }
+  }
+  if (p < end && *p == '.') {
+    for (++p; p < end && *p >= '0' && *p <= '9'; ++p) {
+      any = 1;
+      if (ndigits < 19) {
+	mant = mant*10+(*p-'0');
+	if (mant) ndigits++;
+	exp10--;
+      } else if (*p != '0') {
+	inexact = 1;
+      }
+    }
+  }
+  if (!any)
+    return parse_double_strtod(s,end,out);
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    const char *q = p+1;
+    int eneg = 0, e = 0;
+    if (q < end && (*q == '+' || *q == '-'))
+      eneg = (*q++ == '-');
+    if (q < end && *q >= '0' && *q <= '9') {
+      for (; q < end && *q >= '0' && *q <= '9'; ++q)
+	if (e < 100000) e = e*10+(*q-'0');
+      exp10 += eneg ? -e : e;
+      p = q;
+    }
+  }
+  if (inexact || mant > (1ULL << 53) || exp10 < -22 || exp10 > 22 ||
+      (p < end && (isalnum((unsigned char)*p) || *p == '.')))
+    return parse_double_strtod(s,end,out);
+  *out = exp10 < 0 ? (double)mant/exact_pow10[-exp10] : (double)mant*exact_pow10[exp10];
+  if (neg) *out = -*out;
+  return p;
+}
+
+/** \brief Parse a decimal integer at the beginning of [s,end).
+ * Values too large for a long are returned as LONG_MAX (or LONG_MIN).
+ * @return the end of the number, or NULL if there is none
+ */
+static const char *parse_long(const char *s, const char *end, long *out)
+{
+  const char *p = s;
+  unsigned long v = 0;
+  int neg = 0, overflow = 0;
+  if (p < end && (*p == '+' || *p == '-'))
+    neg = (*p++ == '-');
+  if (p == end || *p < '0' || *p > '9')
+    return NULL;
+  for (; p < end && *p >= '0' && *p <= '9'; ++p) {
+    if (v > (unsigned long)LONG_MAX/10)
+      overflow = 1;
+    else
+      v = v*10+(*p-'0');
+  }
+  if (overflow || v > (unsigned long)LONG_MAX)
+    *out = neg ? LONG_MIN : LONG_MAX;
+  else
+    *out = neg ? -(long)v : (long)v;
+  return p;
+}
+
+
+/** \brief Parse one line of data in the format of libSVM.
+ *
+ * This is the tokenizer behind parse_line(). It makes a single pass over
+ * the characters of [begin,end), does not modify them and does not need
+ * a terminating NUL, so that it can also parse a line in place in a larger
+ * buffer. Everything after a '#' is a comment. At most max_features
+ * features are read; the arrays fnum and fval must have room for one more
+ * (the terminator with fnum=0 and fval=0).
+ * @param begin,end The characters of the line
+ * @param fnum Receives the feature numbers
+ * @param fval Receives the values of the features
+ * @param label Receives the label
+ * @param n_features This will be filled with the number of features
+ * @param max_features The maximum features a line can have
+ * @return PARSE_OK, PARSE_EMPTY for a line without any data, or one of the
+ *         (negative) errors of enum parse_result
+ */
+int parse_line_range(const char *begin, const char *end, uint32_t *fnum, float *fval,
+		     double *label, long int *n_features, long int max_features)
+{
+  const char *p = begin, *q, *r;
+  long wpos = 0, wnum;
+  double weight;
+
+  if ((q = memchr(begin,'#',end-begin)) != NULL) /* cut off comments */
+    end = q;
+  while (p < end && space_or_null((int)*p)) p++;
+  if (p == end)
+    return PARSE_EMPTY;
+  /* the line must start with the label, not with a feature pair */
+  for (q = p; q < end && !space_or_null((int)*q); q++)
+    if (*q == ':')
+      return PARSE_BAD_LABEL;
+  if (parse_double(p,q,label) != q)
+    return PARSE_BAD_LABEL;
+  for (p = q; ; p = q) {
+    while (p < end && space_or_null((int)*p)) p++;
+    if (p == end || wpos >= max_features)
+      break;
+    for (q = p; q < end && !space_or_null((int)*q); q++)
+      ;
+    /* the token [p,q) must be fnum:value */
+    r = parse_long(p,q,&wnum);
+    if (!r || r == q || *r != ':' || parse_double(r+1,q,&weight) != q)
+      return PARSE_BAD_PAIR;
+    if (wnum <= 0)
+      return PARSE_BAD_FNUM;
+    if (wnum > MAXFEATNUM)
+      return PARSE_BAD_MAXFNUM;
+    if ((wpos > 0) && (fnum[wpos-1] >= (uint32_t)wnum))
+      return PARSE_BAD_ORDER;
+    fnum[wpos]=(uint32_t)wnum;
+    fval[wpos]=(float)weight;
+    wpos++;
+  }
+  fnum[wpos]=0;
+  fval[wpos]=0.0f;
+  (*n_features)=wpos;
+  return PARSE_OK;
+}
+
+/** \brief Description of a result of parse_line_range(). */
+const char *parse_result_string(int result)
+{
+  switch (result) {
+  case PARSE_OK:        return "OK";
+  case PARSE_EMPTY:     return "Line contains no data";
+  case PARSE_BAD_LABEL: return "Line must start with label or 0";
+  case PARSE_BAD_FNUM:  return "Feature numbers must be larger or equal to 1";
+  case PARSE_BAD_ORDER: return "Features must be in increasing order";
+  case PARSE_BAD_PAIR:  return "Cannot parse feature/value pair";
+  case PARSE_BAD_MAXFNUM: return "Maximum feature number exceeds limit defined in MAXFEATNUM";
+  default:              return "Unknown parse error";
+  }
+}
+
+
 /** \brief Read in one line of the training data
  * Note that we use the format of libSVM.
  * For example, <b>1 1:2 2:1 # your comments</b>
- * Note that for now comments are ignored
+ * Note that for now comments are ignored. The line is parsed with
+ * parse_line_range(); the program is terminated if the line is malformed.
+ * This is a convenience function for building single feature vectors
+ * with create_feature_vector(); the training data are parsed directly
+ * into separate arrays of feature numbers and values.
  *
  * @param line The input line
  * @param features This is a vector that will be filled with the results of parsing
@@ -175,74 +546,34 @@ double sparse_dotproduct(FVECTOR *a, FVECTOR *b)
 int parse_line(char *line, FEATURE *features, double *label,
 	       long int *n_features, long int max_features)
 {
-  register int pos; /* keep track of position in line */
-  register long wpos; /* 'word position, the index of the current feature (word) */
-  long wnum;
-  double weight;
-  int numread;
-  char featurepair[1000],junk[1000];
-  pos=0;
-  while(line[pos] ) {      /* cut off comments */
-    if((line[pos] == '#')) {
-      line[pos]=0;
-      break; 
-    }
-    if(line[pos] == '\n') { /* strip the CR */
-      line[pos]=0;
+  uint32_t *fnum = (uint32_t *)xmalloc(sizeof(uint32_t)*(max_features+1));
+  float *fval = (float *)xmalloc(sizeof(float)*(max_features+1));
+  int result = parse_line_range(line,line+strlen(line),fnum,fval,label,n_features,max_features);
+  long i;
+  if (result == PARSE_OK) {
+    for (i=0;i<=(*n_features);++i) {
+      features[i].fnum=fnum[i];
+      features[i].fval=fval[i];
     }
-    pos++;
   }
-  wpos=0;
-  /* check, that line starts with target value or zero, but not with
-   * feature pair. The following reads characters until a whitespace is found, and puts
-   * the result in a null-terminated string in 'featurepar'*/
-  if(sscanf(line,"%s",featurepair) == EOF) return(0);
-  pos=0;
-  while((featurepair[pos] != ':') && featurepair[pos]) pos++;
-  if(featurepair[pos] == ':') {
-    printf("[%s:%d] Line must start with label or 0 (training data file)\n",__FILE__,__LINE__); 
-    printf("LINE: %s\n",line);
-    exit (1); 
-  }
-  /* read the target value. The following puts the label into 'label' */
-  if(sscanf(line,"%lf",label) == EOF) return(0);
-  pos=0;
-  while(space_or_null((int)line[pos])) pos++;
-  while((!space_or_null((int)line[pos])) && line[pos]) pos++;
-  /** The following reads the text up to the next whitespace into 'featurepair' */
-  while(((numread=sscanf(line+pos,"%s",featurepair)) != EOF) && 
-	(numread > 0) && 
-	(wpos<max_features)) {
-    /* printf("%s\n",featurepair); */
-    /* The following advances pos until after the current 'featurepair' */
-    while(space_or_null((int)line[pos])) pos++;
-    while((!space_or_null((int)line[pos])) && line[pos]) pos++;
-    
-    if(sscanf(featurepair,"%ld:%lf%s",&wnum,&weight,junk)==2) {
-      /* it is a regular feature */
-      if(wnum<=0) { 
-	printf("[%s:%d] Feature numbers must be larger or equal to 1!!!\n",__FILE__,__LINE__); 
-	printf("LINE: %s\n",line);
-	exit (1); 
-      }
-      if((wpos>0) && ((features[wpos-1]).fnum >= wnum)) { 
-	perror ("Features must be in increasing order!!!\n"); 
-	printf("LINE: %s\n",line);
-	exit (1); 
-      }
-      (features[wpos]).fnum=wnum;
-      (features[wpos]).fval=(float)weight; 
-      wpos++;
-    }
-    else {
-      perror ("Cannot parse feature/value pair!!!\n"); 
-      printf("'%s' in LINE: %s\n",featurepair,line);
-      exit (1); 
-    }
+  free(fnum);
+  free(fval);
+  switch (result) {
+  case PARSE_OK:
+    return 1;
+  case PARSE_EMPTY:
+    return 0;
+  case PARSE_BAD_LABEL:
+  case PARSE_BAD_FNUM:
+  case PARSE_BAD_MAXFNUM:
+    printf("[%s:%d] %s!!!\n",__FILE__,__LINE__,parse_result_string(result)); 
+    break;
+  default:
+    fprintf(stderr,"%s!!!\n",parse_result_string(result)); 
+    break;
   }
-  (features[wpos]).fnum=0;
-  (*n_features)=wpos;
-  return(1);
+  printf("LINE: %s\n",line);
+  exit (1); 
 }
 
 
@@ -251,10 +582,9 @@ int parse_line(char *line, FEATURE *features, double *label,
  */
 extern void print_fvector(FVECTOR *fv){
   printf("feature vector %u\n",fv->id);
-  FEATURE *f=fv->features;
-  while(f!=NULL && f->fnum != 0) {
-    printf("%u:%.1f ",f->fnum,f->fval);
-    f++;
+  unsigned long i;
+  for(i=0;i<fv->n_features;i++) {
+    printf("%u:%.1f ",fv->fnum[i],fv->fval[i]);
   }
   printf("\n");
   printf("class: %.1f\n",fv->data_class);
@@ -262,5 +592,39 @@ extern void print_fvector(FVECTOR *fv){
 
 
 
+/** \brief Convert a float to IEEE 754 binary16, rounding to nearest even.
+ * Values beyond the range of binary16 (65504) become infinity.
+ */
+uint16_t float_to_half(float f)
+{
+  uint32_t x,absx,sign,h,rem;
+  memcpy(&x,&f,sizeof(x));
+  sign = (x >> 16) & 0x8000;
+  absx = x & 0x7fffffff;
+  if (absx >= 0x7f800000) /* inf or nan */
+    return (uint16_t)(sign | 0x7c00 | (absx > 0x7f800000 ? 0x200 : 0));
+  if (absx >= 0x477ff000) /* rounds to a value larger than 65504 */
+    return (uint16_t)(sign | 0x7c00);
+  if (absx < 0x38800000) { /* subnormal in binary16 (< 2^-14) */
+    uint32_t e,m,shift;
+    if (absx < 0x33000000) /* < 2^-25 rounds to zero */
+      return (uint16_t)sign;
+    e = absx >> 23;
+    m = (absx & 0x7fffff) | 0x800000;
+    shift = 126 - e;
+    h = m >> shift;
+    rem = m & ((1u << shift) - 1);
+    if (rem > (1u << (shift-1)) || (rem == (1u << (shift-1)) && (h & 1)))
+      h++;
+    return (uint16_t)(sign | h);
+  }
+  absx -= 112u << 23; /* rebias the exponent from 127 to 15 */
+  h = absx >> 13;
+  rem = absx & 0x1fff;
+  if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+    h++;
+  return (uint16_t)(sign | h);
+}
+
 
 /* eof */
@@ -23,6 +23,7 @@
 # include <stdlib.h>
 # include <time.h> 
 # include <float.h>
+# include <stdint.h>
 
 #define VERSION      "v0.1"
 #define VERSION_DATE "12-04-2015"
@@ -40,10 +41,12 @@
  *
  * This struct represents an individual feature. Note that
  * we are storing the data as a sparse vector, and data features
- * that are zero are not explicitly represented.
+ * that are zero are not explicitly represented. Arrays of FEATUREs
+ * are used to pass features to create_feature_vector(); an FVECTOR
+ * stores the feature numbers and values in two separate arrays.
  */
 typedef struct feature {
-  unsigned long   fnum;	/**< Feature number */
+  uint32_t        fnum;	/**< Feature number (at most MAXFEATNUM) */
   float           fval; /**< Value of the feature */
 } FEATURE;
 
@@ -53,12 +56,16 @@ typedef struct feature {
  * of its features) in the original feature space. Note that
  * we represent the features as a sparse version, i.e., feature
  * numbers that are not represented are treated as having the
- * value of zero. 
+ * value of zero. The feature numbers and the values are kept in
+ * separate arrays (8 bytes per feature), so that the feature
+ * numbers can be compared with vector instructions.
  */
 typedef struct fvector {
   unsigned long id; /**< The position of this feature vector in the training data array. */
-  FEATURE  *features; /**< An array of N features has length N+1, and
-			 the final slot is NULL. */
+  uint32_t *fnum;   /**< The N feature numbers in ascending order; the array
+		       has length N+1, and the final slot is 0. */
+  float *fval;      /**< The values of the features (length N+1, the final slot is 0) */
+  unsigned long n_features; /**< The number of features N */
   double  twonorm_sq; /**< The squared euclidian length of the
                                   feature vector (Used for the RBF kernel). */
   double  factor;   /**< Factor by which this feature vector
@@ -78,10 +85,6 @@ typedef struct training_data {
   FVECTOR *data; /**< The feature vectors */
 } TRAINING;
 
-/** verbosity level (0-4) */
-extern int verbosity;   
-
-
 /** \brief Parameters for the type of kernel used.
  */
 typedef struct kernel_parameters {
@@ -93,19 +96,71 @@ typedef struct kernel_parameters {
   char    custom[50];    /* for user supplied kernel */
 } KERNEL_PARAM;          
 
+/** \brief The complete contents of an input file.
+ *
+ * Regular files are mapped read-only into memory, so that they can be
+ * parsed in place; pipes and other streams are read into a buffer.
+ */
+typedef struct input_buffer {
+  const char *data; /**< The contents of the file (not NUL-terminated) */
+  size_t size;      /**< Number of bytes */
+  void *mapping;    /**< The mapping, or NULL if the file was read into buffer */
+  char *buffer;     /**< Buffer for streams (or NULL) */
+} INPUT_BUFFER;
+
+extern int input_open(const char *path, INPUT_BUFFER *in);
+extern void input_close(INPUT_BUFFER *in);
+extern FILE *replace_open(const char *path, char **tmp_path);
+extern int replace_close(FILE *fp, char *tmp_path, const char *path, int ok);
 extern void input_training_data(const char *path, FVECTOR ***fvec_list, unsigned long *total_features, long int *total_fvecs);
 
-extern void scan_n_lines_and_features(char *file, 
-		   unsigned *n_lines, 
-		   unsigned *wol, 
-		   unsigned *ll);
 extern int space_or_null(int c);
 extern void *xmalloc(size_t size);
+extern void *xrealloc(void *ptr, size_t size);
+extern void *xmalloc_aligned(size_t size, size_t alignment);
 extern FVECTOR *create_feature_vector(FEATURE *features,double label,double factor);
 extern double sparse_dotproduct(FVECTOR *a, FVECTOR *b);
+extern double sparse_dotproduct_scalar(FVECTOR *a, FVECTOR *b);
+extern double sparse_weight_dotproduct(const uint32_t *w_fnum, const double *w_fval,
+				       unsigned long w_nnz, const FVECTOR *x);
+/** \brief Return values of parse_line_range(). */
+enum parse_result {
+  PARSE_OK = 1,          /**< The label and the features were read */
+  PARSE_EMPTY = 0,       /**< The line contains only whitespace or a comment */
+  PARSE_BAD_LABEL = -1,  /**< The line does not start with a numeric label */
+  PARSE_BAD_FNUM = -2,   /**< A feature number is smaller than 1 */
+  PARSE_BAD_ORDER = -3,  /**< The feature numbers are not increasing */
+  PARSE_BAD_PAIR = -4,   /**< A token is not of the form fnum:value */
+  PARSE_BAD_MAXFNUM = -5 /**< A feature number is larger than MAXFEATNUM */
+};
+
 extern int parse_line(char *line, FEATURE *features, double *label,
 		      long int *n_features, long int max_features);
+extern int parse_line_range(const char *begin, const char *end, uint32_t *fnum, float *fval,
+			    double *label, long int *n_features, long int max_features);
+extern const char *parse_result_string(int result);
 extern void print_fvector(FVECTOR *fv);
+extern uint16_t float_to_half(float f);
+
+/** \brief Convert an IEEE 754 binary16 value to float. */
+static inline float half_to_float(uint16_t h)
+{
+  uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1f;
+  uint32_t mant = h & 0x3ff;
+  uint32_t bits;
+  float f;
+  if (exp == 0x1f) {         /* inf or nan */
+    bits = sign | 0x7f800000 | (mant << 13);
+  } else if (exp) {          /* normal */
+    bits = sign | ((exp + 112) << 23) | (mant << 13);
+  } else {                   /* zero or subnormal, mant * 2^-24 */
+    f = (float)mant * 5.9604644775390625e-8f;
+    return sign ? -f : f;
+  }
+  memcpy(&f,&bits,sizeof(f));
+  return f;
+}
 
 
 
@@ -9,23 +9,55 @@
 
 
 #include <glib.h>
+#include <float.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
 #include "svm.h"
+#include "kcache.h"
+#include "model.h"
+#include "dataset.h"
+#include "simd.h"
 
 
 double DELTA=0.0001;
 
+/** Six examples of three features, two classes, for the training tests */
+static char *sample_lines[6]={"+1	1:1	2:2","-1	2:1	3:4","+1	1:3	3:1",
+			      "-1	1:0.5	3:3","+1	1:2	2:1.5","-1	2:2	3:2.5"};
+
 typedef struct {
   GRAM_MATRIX *gram;
+  FVECTOR *fv[6];          /* sample_lines, filled by sample_setup() */
+  signed char labels[6];
 } gram_fixture;
 
 void gram_setup_A(gram_fixture *gf,gconstpointer test_data) {
-  gf->gram =  initialize_gram_matrix(42);
+  gf->gram =  initialize_gram_matrix(42,GRAM_FULL,GRAM_DOUBLE);
 }
 
 void gram_teardown(gram_fixture *gf,gconstpointer test_data) {
   //free(gf->gram);
 }
 
+void sample_setup(gram_fixture *gf,gconstpointer test_data) {
+  FEATURE feat[4];
+  double label;
+  long int n_features;
+  int i;
+  for (i=0;i<6;++i) {
+    parse_line(sample_lines[i],feat,&label,&n_features,3);
+    gf->fv[i] = create_feature_vector(feat,label,1.0);
+    gf->labels[i] = label > 0 ? 1 : -1;
+  }
+}
+
+void sample_teardown(gram_fixture *gf,gconstpointer test_data) {
+  int i;
+  for (i=0;i<6;++i)
+    free(gf->fv[i]);
+}
+
 void test_gram_init_A(gram_fixture *gf,gconstpointer ignored) {
   g_assert(42 == gf->gram->n);
 }
@@ -122,6 +154,54 @@ void test_parse_line_F(gram_fixture *gf,gconstpointer ignored){
   g_assert_cmpfloat((features[0].fval-111.88),<,DELTA);
 }
 
+void test_parse_line_G(gram_fixture *gf,gconstpointer ignored){
+  char *line="+1 2:0.5 7:-3e2 # 9:1";
+  uint32_t fnum[4];
+  float fval[4];
+  double label;
+  long int n_features;
+  /* the range need not be NUL-terminated */
+  g_assert(PARSE_OK==parse_line_range(line,line+13,fnum,fval,&label,&n_features,3));
+  g_assert(2==n_features);
+  g_assert(2==fnum[0] && 7==fnum[1] && 0==fnum[2]);
+  g_assert_cmpfloat(fval[1],==,-3.0f);
+  g_assert(PARSE_OK==parse_line_range(line,line+strlen(line),fnum,fval,&label,&n_features,3));
+  g_assert(2==n_features);
+  line="  # comment";
+  g_assert(PARSE_EMPTY==parse_line_range(line,line+strlen(line),fnum,fval,&label,&n_features,3));
+  line="1:1 2:1";
+  g_assert(PARSE_BAD_LABEL==parse_line_range(line,line+strlen(line),fnum,fval,&label,&n_features,3));
+  line="-1 0:1";
+  g_assert(PARSE_BAD_FNUM==parse_line_range(line,line+strlen(line),fnum,fval,&label,&n_features,3));
+  line="-1 3:1 2:1";
+  g_assert(PARSE_BAD_ORDER==parse_line_range(line,line+strlen(line),fnum,fval,&label,&n_features,3));
+  line="-1 3:1x";
+  g_assert(PARSE_BAD_PAIR==parse_line_range(line,line+strlen(line),fnum,fval,&label,&n_features,3));
+  line="-1 3:";
+  g_assert(PARSE_BAD_PAIR==parse_line_range(line,line+strlen(line),fnum,fval,&label,&n_features,3));
+}
+
+/* The number parser gives the correctly rounded results of strtod(). */
+void test_parse_line_H(gram_fixture *gf,gconstpointer ignored){
+  const char *formats[5]={"%.17g 1:%.17g","%g 1:%g","%.3f 1:%.9f","%.6e 1:%.2e","%.25f 1:%.0f"};
+  char line[200];
+  uint32_t fnum[2];
+  float fval[2];
+  double label, x, y;
+  long int n_features;
+  unsigned short state[3]={1,2,3};
+  int i,k;
+  for (i=0;i<20000;++i) {
+    x = (erand48(state)-0.5)*pow(10,(int)(erand48(state)*40)-20);
+    y = (erand48(state)-0.5)*pow(10,(int)(erand48(state)*12)-6);
+    k = i%5;
+    snprintf(line,sizeof(line),formats[k],x,y);
+    g_assert(PARSE_OK==parse_line_range(line,line+strlen(line),fnum,fval,&label,&n_features,1));
+    g_assert_cmpfloat(label,==,strtod(line,NULL));
+    g_assert_cmpfloat(fval[0],==,(float)strtod(strchr(line,':')+1,NULL));
+  }
+}
+
 void test_sparse_dotproductA(gram_fixture *gf,gconstpointer ignored){
   char *line1="+1	3:1	4:1 ";
   char *line2="+1	3:1	4:1 ";
@@ -172,6 +252,753 @@ void test_sparse_dotproductB(gram_fixture *gf,gconstpointer ignored){
   g_assert_cmpfloat((res-39.0),<,DELTA);
 }
 
+static double gram_kernel_fxn(int i1, int i2, SVM *svm) {
+  return gram_entry((GRAM_MATRIX*)svm->data,i1,i2);
+}
+
+/* kernel_row must agree with the scalar kernel for direct (full) and
+ * converted (packed) rows and for the default implementation. */
+void test_kernel_rowA(gram_fixture *gf,gconstpointer ignored){
+  FVECTOR **fv = gf->fv;  /* the first three of sample_lines */
+  double buf[3];
+  const double *row;
+  KERNEL_PARAM kp;
+  GRAM_PARAM full = {GRAM_FULL,GRAM_DOUBLE,1,GRAM_BUILD_MERGE}, packed = {GRAM_PACKED,GRAM_DOUBLE,1,GRAM_BUILD_MERGE};
+  SVM svm;
+  int i,j;
+  kp.kernel_type=LINEAR;
+  GRAM_MATRIX *gm1 = calculate_gram_matrix(3,fv,&kp,&full);
+  GRAM_MATRIX *gm2 = calculate_gram_matrix(3,fv,&kp,&packed);
+  svm.kernel = gram_kernel_fxn;
+  for (i=0;i<3;++i) {
+    svm.data = gm1;
+    svm.kernel_row = gram_kernel_row;
+    row = svm_kernel_row(&svm,i,1,3,buf);
+    g_assert(row != buf);
+    for (j=1;j<3;++j)
+      g_assert_cmpfloat(row[j-1],==,sparse_dotproduct(fv[i],fv[j]));
+    svm.data = gm2;
+    row = svm_kernel_row(&svm,i,0,3,buf);
+    g_assert(row == buf);
+    for (j=0;j<3;++j)
+      g_assert_cmpfloat(row[j],==,sparse_dotproduct(fv[i],fv[j]));
+    svm.kernel_row = NULL;
+    row = svm_kernel_row(&svm,i,0,3,buf);
+    for (j=0;j<3;++j)
+      g_assert_cmpfloat(row[j],==,sparse_dotproduct(fv[i],fv[j]));
+  }
+  free_gram_matrix(gm1);
+  free_gram_matrix(gm2);
+}
+
+/* Data for train_platt_thread() */
+typedef struct {
+  GRAM_MATRIX *gram;
+  signed char *labels;
+  SVM svm;
+} platt_thread_data;
+
+static void *train_platt_thread(void *arg) {
+  platt_thread_data *d = (platt_thread_data*)arg;
+  memset(&d->svm,0,sizeof(SVM));
+  d->svm.data = d->gram;
+  d->svm.kernel = gram_kernel_fxn;
+  d->svm.kernel_row = gram_kernel_row;
+  d->svm.data_class = d->labels;
+  d->svm.training_count = d->gram->n;
+  d->svm.C = d->svm.C_pos = d->svm.C_neg = 1.0;
+  d->svm.max_iter = 100;
+  svm_train(&d->svm,PLATT);
+  return NULL;
+}
+
+/* Two SVMs trained at the same time must give the same result as one
+ * trained alone (the solver state is not shared). */
+void test_reentrant_trainingA(gram_fixture *gf,gconstpointer ignored){
+  FVECTOR **fv = gf->fv;
+  signed char *labels = gf->labels;
+  KERNEL_PARAM kp;
+  platt_thread_data ref, d[2];
+  pthread_t th[2];
+  int i,k;
+  kp.kernel_type=LINEAR;
+  ref.gram = d[0].gram = d[1].gram = calculate_gram_matrix(6,fv,&kp,NULL);
+  ref.labels = d[0].labels = d[1].labels = labels;
+  train_platt_thread(&ref);
+  for (k=0;k<2;++k)
+    pthread_create(&th[k],NULL,train_platt_thread,&d[k]);
+  for (k=0;k<2;++k) {
+    pthread_join(th[k],NULL);
+    g_assert_cmpfloat(d[k].svm.b,==,ref.svm.b);
+    for (i=0;i<6;++i)
+      g_assert_cmpfloat(d[k].svm.alpha[i],==,ref.svm.alpha[i]);
+    free_svm(&d[k].svm);
+  }
+  free_svm(&ref.svm);
+  free_gram_matrix(ref.gram);
+}
+
+/* After training, the error cache of the Platt solver holds f(x_i)-y_i
+ * for every example, bound or not. */
+void test_platt_error_cacheA(gram_fixture *gf,gconstpointer ignored){
+  FVECTOR **fv = gf->fv;
+  signed char *labels = gf->labels;
+  KERNEL_PARAM kp;
+  platt_thread_data d;
+  int i;
+  kp.kernel_type=LINEAR;
+  d.gram = calculate_gram_matrix(6,fv,&kp,NULL);
+  d.labels = labels;
+  train_platt_thread(&d);
+  for (i=0;i<6;++i) {
+    double E = learned_func_nonlinear(&d.svm,i,d.svm.b) - labels[i];
+    g_assert_cmpfloat(fabs(d.svm.error_cache[i]-E),<,DELTA);
+  }
+  free_svm(&d.svm);
+  free_gram_matrix(d.gram);
+}
+
+/* Train the Fan solver on a Gram matrix; if pool is given, it is used
+ * for active sets of any size */
+static void train_fan(SVM *svm, GRAM_MATRIX *gram, signed char *labels, int shrinking,
+		      THREAD_POOL *pool) {
+  memset(svm,0,sizeof(SVM));
+  svm->pool = pool;
+  svm->parallel_min = 1;
+  svm->data = gram;
+  svm->kernel = gram_kernel_fxn;
+  svm->kernel_row = gram_kernel_row;
+  svm->data_class = labels;
+  svm->training_count = gram->n;
+  svm->C = svm->C_pos = svm->C_neg = 100.0;
+  svm->max_iter = 100000;
+  svm->shrinking = shrinking;
+  svm_train(svm,FAN);
+}
+
+/* n random examples of two overlapping classes with two features */
+static void random_examples(FVECTOR **fv, signed char *labels, int n) {
+  FEATURE feat[3];
+  int i;
+  srand(7);
+  for (i=0;i<n;++i) {
+    labels[i] = i%2 ? 1 : -1;
+    feat[0].fnum = 1;
+    feat[0].fval = labels[i]*0.1f+(float)rand()/RAND_MAX;
+    feat[1].fnum = 2;
+    feat[1].fval = (float)rand()/RAND_MAX;
+    feat[2].fnum = 0;
+    fv[i] = create_feature_vector(feat,labels[i],1.0);
+  }
+}
+
+/* Shrinking only removes examples that would not be selected, so the
+ * Fan solver reaches the same solution with and without it. The 50
+ * examples overlap and need about 500 iterations, so the active set is
+ * shrunk (every 50 iterations) to 22 examples and reconstructed. */
+void test_fan_shrinkingA(gram_fixture *gf,gconstpointer ignored){
+  FVECTOR *fv[50];
+  signed char labels[50];
+  KERNEL_PARAM kp;
+  GRAM_MATRIX *gram;
+  SVM plain, shrunk;
+  int i;
+  random_examples(fv,labels,50);
+  kp.kernel_type=RBF;
+  kp.rbf_gamma=10.0;
+  gram = calculate_gram_matrix(50,fv,&kp,NULL);
+  train_fan(&plain,gram,labels,0,NULL);
+  train_fan(&shrunk,gram,labels,1,NULL);
+  g_assert_cmpfloat(shrunk.b,==,plain.b);
+  for (i=0;i<50;++i)
+    g_assert_cmpfloat(shrunk.alpha[i],==,plain.alpha[i]);
+  free_svm(&plain);
+  free_svm(&shrunk);
+  free_gram_matrix(gram);
+  for (i=0;i<50;++i)
+    free(fv[i]);
+}
+
+/* The error cache stays equal to f(x_i)-y_i on a problem large enough
+ * for steps in which both multipliers are unbound (and b1 != b2) or a
+ * multiplier is only numerically unbound. */
+void test_platt_error_cacheB(gram_fixture *gf,gconstpointer ignored){
+  FVECTOR *fv[300];
+  signed char labels[300];
+  KERNEL_PARAM kp;
+  platt_thread_data d;
+  int i;
+  random_examples(fv,labels,300);
+  kp.kernel_type=LINEAR;
+  d.gram = calculate_gram_matrix(300,fv,&kp,NULL);
+  d.labels = labels;
+  train_platt_thread(&d);
+  for (i=0;i<300;++i) {
+    double E = learned_func_nonlinear(&d.svm,i,d.svm.b) - labels[i];
+    g_assert_cmpfloat(fabs(d.svm.error_cache[i]-E),<,DELTA);
+  }
+  free_svm(&d.svm);
+  free_gram_matrix(d.gram);
+  for (i=0;i<300;++i)
+    free(fv[i]);
+}
+
+/* The threaded gradient update and working set selection of the Fan
+ * solver give the same bits as the serial ones. Without shrinking all
+ * examples stay active, so each thread selects from its chunk with the
+ * vectorized (AVX2) scan, whose chunks end at any lane. */
+void test_fan_threadsA(gram_fixture *gf,gconstpointer ignored){
+  FVECTOR *fv[50];
+  signed char labels[50];
+  KERNEL_PARAM kp;
+  GRAM_MATRIX *gram;
+  THREAD_POOL *pool;
+  SVM serial, threaded;
+  int i,n_threads,shrinking;
+  random_examples(fv,labels,50);
+  kp.kernel_type=RBF;
+  kp.rbf_gamma=10.0;
+  gram = calculate_gram_matrix(50,fv,&kp,NULL);
+  for (shrinking=0;shrinking<2;++shrinking) {
+    train_fan(&serial,gram,labels,shrinking,NULL);
+    for (n_threads=2;n_threads<=4;++n_threads) {
+      pool = threadpool_create(n_threads);
+      train_fan(&threaded,gram,labels,shrinking,pool);
+      g_assert_cmpfloat(threaded.b,==,serial.b);
+      for (i=0;i<50;++i)
+	g_assert_cmpfloat(threaded.alpha[i],==,serial.alpha[i]);
+      free_svm(&threaded);
+      threadpool_free(pool);
+    }
+    free_svm(&serial);
+  }
+  free_gram_matrix(gram);
+  for (i=0;i<50;++i)
+    free(fv[i]);
+}
+
+/* The vectorized selection scans (all examples active) give the same
+ * examples and values as the scalar scan through an index, also for
+ * ranges that do not begin or end at a multiple of the vector width and
+ * with ties, which go to the later example. */
+void test_simd_selectA(gram_fixture *gf,gconstpointer ignored){
+  int n=103, ranges[4][2]={{0,103},{1,102},{5,6},{3,70}};
+  double G[103], alpha[103], C[103], QD[103], Ki[103];
+  signed char y[103];
+  int index[103];
+  int k,r,i1,i2,j1,j2;
+  double Gmax1,Gmax2,Gmin1,Gmin2,obj1,obj2;
+  srand(11);
+  for (k=0;k<n;++k) {
+    index[k] = k;
+    y[k] = rand()%2 ? 1 : -1;
+    G[k] = (double)(rand()%9-4)/4; /* many equal values */
+    C[k] = 1.0;
+    alpha[k] = (rand()%3)*0.5;
+    QD[k] = 1.0;
+    Ki[k] = (double)(rand()%5)/4;
+  }
+  for (r=0;r<4;++r) {
+    Gmax1 = Gmax2 = -FLT_MAX;
+    i1 = i2 = -1;
+    simd_select_up(G,y,alpha,C,NULL,ranges[r][0],ranges[r][1],&Gmax1,&i1);
+    simd_select_up(G,y,alpha,C,index,ranges[r][0],ranges[r][1],&Gmax2,&i2);
+    g_assert_cmpint(i1,==,i2);
+    g_assert_cmpfloat(Gmax1,==,Gmax2);
+    Gmin1 = Gmin2 = obj1 = obj2 = FLT_MAX;
+    j1 = j2 = -1;
+    simd_select_low(G,y,alpha,C,QD,Ki,0.5,1.0,1e-12,NULL,ranges[r][0],ranges[r][1],&Gmin1,&obj1,&j1);
+    simd_select_low(G,y,alpha,C,QD,Ki,0.5,1.0,1e-12,index,ranges[r][0],ranges[r][1],&Gmin2,&obj2,&j2);
+    g_assert_cmpint(j1,==,j2);
+    g_assert_cmpfloat(Gmin1,==,Gmin2);
+    g_assert_cmpfloat(obj1,==,obj2);
+  }
+}
+
+/* A model saved in either format and loaded again gives the same
+ * decision values as the trained SVM. */
+void test_model_save_loadA(gram_fixture *gf,gconstpointer ignored){
+  FVECTOR **fv = gf->fv;
+  signed char *labels = gf->labels;
+  KERNEL_PARAM kp;
+  platt_thread_data d;
+  SVM_MODEL *model, *loaded;
+  enum model_format formats[2] = {MODEL_BINARY,MODEL_TEXT};
+  char path[] = "/tmp/xsvm_modelXXXXXX";
+  int i,k;
+  kp.kernel_type=RBF;
+  kp.rbf_gamma=0.5;
+  d.gram = calculate_gram_matrix(6,fv,&kp,NULL);
+  d.labels = labels;
+  train_platt_thread(&d);
+  model = model_create(&d.svm,fv,&kp);
+  close(mkstemp(path));
+  for (k=0;k<2;++k) {
+    g_assert(0==model_save(model,path,formats[k]));
+    loaded = model_load(path);
+    g_assert(loaded!=NULL);
+    g_assert(loaded->n_sv==model->n_sv);
+    g_assert((loaded->mapping!=NULL)==(formats[k]==MODEL_BINARY));
+    g_assert_cmpfloat(loaded->b,==,d.svm.b);
+    for (i=0;i<6;++i)
+      g_assert_cmpfloat(fabs(model_predict(loaded,fv[i])-d.svm.decision_values[i]),<,DELTA);
+    /* replacing the file must not disturb the loaded (mapped) model */
+    g_assert(0==model_save(model,path,formats[1-k]));
+    for (i=0;i<6;++i)
+      g_assert_cmpfloat(fabs(model_predict(loaded,fv[i])-d.svm.decision_values[i]),<,DELTA);
+    model_free(loaded);
+  }
+  unlink(path);
+  model_free(model);
+  free_svm(&d.svm);
+  free_gram_matrix(d.gram);
+}
+
+/* A dataset written as a binary file is loaded with identical
+ * features, labels and norms. */
+void test_datasetA(gram_fixture *gf,gconstpointer ignored){
+  char *lines[4]={"+1	1:1	2:2","-1	2:1	3:4","+1	3:0.25","-1	1:0.5	2:-1	3:3"};
+  FVECTOR *fv[4];
+  FEATURE *feat = (FEATURE *)xmalloc(sizeof(FEATURE)*4);
+  double label;
+  long int n_features;
+  DATASET *ds;
+  char path[] = "/tmp/xsvm_dataXXXXXX";
+  int i,j;
+  for (i=0;i<4;++i) {
+    parse_line(lines[i],feat,&label,&n_features,3);
+    fv[i] = create_feature_vector(feat,label,1.0);
+  }
+  close(mkstemp(path));
+  g_assert(0==dataset_save(path,fv,4,3));
+  ds = dataset_load(path);
+  g_assert(ds!=NULL);
+  g_assert_cmpint(ds->n_fvecs,==,4);
+  g_assert_cmpint(ds->n_features,==,3);
+  for (i=0;i<4;++i) {
+    g_assert_cmpint(ds->fvecs[i]->id,==,i);
+    g_assert_cmpint(ds->fvecs[i]->n_features,==,fv[i]->n_features);
+    g_assert_cmpfloat(ds->fvecs[i]->data_class,==,fv[i]->data_class);
+    g_assert_cmpfloat(ds->fvecs[i]->twonorm_sq,==,fv[i]->twonorm_sq);
+    for (j=0;j<=fv[i]->n_features;++j) {
+      g_assert_cmpint(ds->fvecs[i]->fnum[j],==,fv[i]->fnum[j]);
+      g_assert_cmpfloat(ds->fvecs[i]->fval[j],==,fv[i]->fval[j]);
+    }
+  }
+  /* rewriting the file must not disturb the mapped dataset */
+  g_assert(0==dataset_save(path,fv,2,3));
+  g_assert_cmpfloat(ds->fvecs[3]->fval[2],==,fv[3]->fval[2]);
+  dataset_free(ds);
+  unlink(path);
+  for (i=0;i<4;++i)
+    free(fv[i]);
+  free(feat);
+}
+
+/* 300 examples in the text format with a comment every 50 lines; the
+ * example bad is replaced by a line with features out of order */
+static size_t text_examples(char *data, int bad) {
+  size_t size = 0;
+  int i;
+  for (i=0;i<300;++i) {
+    if (i%50 == 7)
+      size += sprintf(data+size,"# comment\n");
+    if (i == bad)
+      size += sprintf(data+size,"+1 3:1 2:1\n");
+    else
+      size += sprintf(data+size,"%+d 1:%d %d:%g\n",i%3 ? 1 : -1,i,2+i%17,0.5*i);
+  }
+  return size;
+}
+
+/* Text data parsed by several threads give the same examples as parsed
+ * by one, and a malformed line is reported with its line number in the
+ * data whichever thread finds it. */
+void test_dataset_parseA(gram_fixture *gf,gconstpointer ignored){
+  char *data = (char*)xmalloc(300*32);
+  size_t size = text_examples(data,-1);
+  FVECTOR **fv1, **fv4;
+  unsigned long nf1, nf4, n1, n4, i, j;
+  PARSE_ERROR error;
+  int n_threads;
+  g_assert(0==dataset_parse(data,size,1,0,&fv1,&nf1,&n1,&error));
+  g_assert(0==dataset_parse(data,size,4,0,&fv4,&nf4,&n4,&error));
+  g_assert_cmpint(n1,==,300);
+  g_assert_cmpint(n4,==,300);
+  g_assert_cmpint(nf4,==,nf1);
+  for (i=0;i<300;++i) {
+    g_assert_cmpint(fv4[i]->id,==,i);
+    g_assert_cmpint(fv4[i]->n_features,==,fv1[i]->n_features);
+    g_assert_cmpfloat(fv4[i]->data_class,==,fv1[i]->data_class);
+    g_assert_cmpfloat(fv4[i]->twonorm_sq,==,fv1[i]->twonorm_sq);
+    for (j=0;j<=fv1[i]->n_features;++j) {
+      g_assert_cmpint(fv4[i]->fnum[j],==,fv1[i]->fnum[j]);
+      g_assert_cmpfloat(fv4[i]->fval[j],==,fv1[i]->fval[j]);
+    }
+  }
+  free(fv1);
+  free(fv4);
+  /* example 233 follows five comments, so it is line 239 of 306, which
+   * the last of four threads parses */
+  size = text_examples(data,233);
+  for (n_threads=1;n_threads<=4;n_threads+=3) {
+    g_assert(-1==dataset_parse(data,size,n_threads,0,&fv1,&nf1,&n1,&error));
+    g_assert_cmpint(error.line,==,239);
+    g_assert_cmpint(error.result,==,PARSE_BAD_ORDER);
+    g_assert_cmpint(error.length,==,10);
+    g_assert(0==strncmp(error.text,"+1 3:1 2:1",10));
+  }
+  free(data);
+}
+
+/* A linear SVM is collapsed into its weight vector, which gives the
+ * same decision values and |w| as the support vectors. */
+void test_weight_vectorA(gram_fixture *gf,gconstpointer ignored){
+  FVECTOR **fv = gf->fv;
+  signed char *labels = gf->labels;
+  double norm;
+  KERNEL_PARAM kp;
+  GRAM_MATRIX *gram;
+  SVM svm;
+  SVM_MODEL *model, *loaded;
+  enum model_format formats[2] = {MODEL_BINARY,MODEL_TEXT};
+  char path[] = "/tmp/xsvm_modelXXXXXX";
+  int i,k;
+  kp.kernel_type=LINEAR;
+  gram = calculate_gram_matrix(6,fv,&kp,NULL);
+  memset(&svm,0,sizeof(SVM));
+  svm.data = gram;
+  svm.kernel = gram_kernel_fxn;
+  svm.kernel_row = gram_kernel_row;
+  svm.data_class = labels;
+  svm.training_count = 6;
+  svm.C = svm.C_pos = svm.C_neg = 1.0;
+  svm.max_iter = 100;
+  svm.fvecs = fv;
+  svm.kernel_parameters = &kp;
+  svm_train(&svm,PLATT);
+  g_assert(svm.w!=NULL);
+  g_assert(4==svm.n_w);
+  norm = svm_weight_norm(&svm);
+  for (i=0;i<6;++i)
+    g_assert_cmpfloat(fabs(svm.decision_values[i]-learned_func_nonlinear(&svm,i,svm.b)),<,DELTA);
+  model = model_create(&svm,fv,&kp);
+  g_assert(0==model->n_sv);
+  close(mkstemp(path));
+  for (k=0;k<2;++k) {
+    g_assert(0==model_save(model,path,formats[k]));
+    loaded = model_load(path);
+    g_assert(loaded!=NULL && loaded->w!=NULL);
+    for (i=0;i<6;++i)
+      g_assert_cmpfloat(fabs(model_predict(loaded,fv[i])-svm.decision_values[i]),<,DELTA);
+    model_free(loaded);
+  }
+  /* an index beyond n_w or an unparsable element in the W section of the text format */
+  for (k=0;k<2;++k) {
+    FILE *fp;
+    g_assert(0==model_save(model,path,MODEL_TEXT));
+    fp = fopen(path,"a");
+    fprintf(fp,k ? "2 x\n" : "4 1.0\n");
+    fclose(fp);
+    g_assert(NULL==model_load(path));
+  }
+  unlink(path);
+  model_free(model);
+  /* |w|^2 from the decision values of the support vectors */
+  free(svm.w);
+  svm.w = NULL;
+  g_assert_cmpfloat(fabs(svm_weight_norm(&svm)-norm),<,DELTA);
+  free_svm(&svm);
+  free_gram_matrix(gram);
+}
+
+/* With feature numbers far beyond the number of nonzeros, w is stored
+ * sparsely, in double, and saved and loaded as such. */
+void test_weight_vectorB(gram_fixture *gf,gconstpointer ignored){
+  FVECTOR *fv[6];
+  FEATURE feat[4];
+  double norm;
+  KERNEL_PARAM kp;
+  GRAM_MATRIX *gram;
+  SVM svm;
+  SVM_MODEL *model, *loaded;
+  enum model_format formats[2] = {MODEL_BINARY,MODEL_TEXT};
+  char path[] = "/tmp/xsvm_modelXXXXXX";
+  unsigned long t;
+  int i,k;
+  for (i=0;i<6;++i) {
+    for (t=0;t<=gf->fv[i]->n_features;++t) {
+      feat[t].fnum = gf->fv[i]->fnum[t]*100000;
+      feat[t].fval = gf->fv[i]->fval[t];
+    }
+    fv[i] = create_feature_vector(feat,gf->fv[i]->data_class,1.0);
+  }
+  kp.kernel_type=LINEAR;
+  gram = calculate_gram_matrix(6,fv,&kp,NULL);
+  memset(&svm,0,sizeof(SVM));
+  svm.data = gram;
+  svm.kernel = gram_kernel_fxn;
+  svm.kernel_row = gram_kernel_row;
+  svm.data_class = gf->labels;
+  svm.training_count = 6;
+  svm.C = svm.C_pos = svm.C_neg = 1.0;
+  svm.max_iter = 100;
+  svm.fvecs = fv;
+  svm.kernel_parameters = &kp;
+  svm_train(&svm,PLATT);
+  g_assert(svm.w==NULL && svm.w_fnum!=NULL);
+  g_assert(3==svm.w_nnz);
+  g_assert(300000==svm.w_fnum[2]);
+  norm = svm_weight_norm(&svm);
+  for (i=0;i<6;++i)
+    g_assert_cmpfloat(fabs(svm.decision_values[i]-learned_func_nonlinear(&svm,i,svm.b)),<,DELTA);
+  model = model_create(&svm,fv,&kp);
+  g_assert(0==model->n_sv && model->w==NULL && 3==model->w_nnz);
+  close(mkstemp(path));
+  for (k=0;k<2;++k) {
+    g_assert(0==model_save(model,path,formats[k]));
+    loaded = model_load(path);
+    g_assert(loaded!=NULL && 0==loaded->n_sv && 3==loaded->w_nnz);
+    /* w is kept in double, so the decision values are exactly those of the SVM */
+    for (i=0;i<6;++i)
+      g_assert_cmpfloat(model_predict(loaded,fv[i]),==,svm.decision_values[i]);
+    model_free(loaded);
+  }
+  unlink(path);
+  model_free(model);
+  /* |w|^2 from the decision values of the support vectors */
+  free(svm.w_fnum);
+  free(svm.w_fval);
+  svm.w_fnum = NULL;
+  svm.w_fval = NULL;
+  g_assert_cmpfloat(fabs(svm_weight_norm(&svm)-norm),<,DELTA);
+  free_svm(&svm);
+  free_gram_matrix(gram);
+  for (i=0;i<6;++i)
+    free(fv[i]);
+}
+
+/* Batch prediction in tiles and threads gives the decision values of
+ * model_predict(), independently of the number of threads. */
+void test_model_predict_batchA(gram_fixture *gf,gconstpointer ignored){
+  FVECTOR **fv = gf->fv, *x[300];
+  signed char *labels = gf->labels;
+  FEATURE feat[5];
+  double f1[300], f3[300];
+  KERNEL_PARAM kp;
+  platt_thread_data d;
+  SVM_MODEL *model;
+  THREAD_POOL *pool;
+  int i,k;
+  kp.kernel_type=RBF;
+  kp.rbf_gamma=0.5;
+  d.gram = calculate_gram_matrix(6,fv,&kp,NULL);
+  d.labels = labels;
+  train_platt_thread(&d);
+  model = model_create(&d.svm,fv,&kp);
+  for (i=0;i<300;++i) {
+    for (k=0;k<4;++k) {
+      feat[k].fnum = k+1;
+      feat[k].fval = (float)((i*(k+3))%7)/2;
+    }
+    feat[4].fnum = 0;
+    x[i] = create_feature_vector(feat,1.0,1.0);
+  }
+  model_predict_batch(model,x,300,f1,NULL);
+  pool = threadpool_create(3);
+  model_predict_batch(model,x,300,f3,pool);
+  threadpool_free(pool);
+  for (i=0;i<300;++i) {
+    g_assert_cmpfloat(f1[i],==,f3[i]);
+    g_assert_cmpfloat(fabs(f1[i]-model_predict(model,x[i])),<,DELTA);
+    free(x[i]);
+  }
+  model_free(model);
+  free_svm(&d.svm);
+  free_gram_matrix(d.gram);
+}
+
+/* Streaming classification gives the same decision values as the
+ * trained SVM and skips comments and empty lines. */
+void test_model_predict_streamA(gram_fixture *gf,gconstpointer ignored){
+  FVECTOR **fv = gf->fv;
+  signed char *labels = gf->labels;
+  double f, y;
+  KERNEL_PARAM kp;
+  platt_thread_data d;
+  SVM_MODEL *model;
+  MODEL_CONFUSION counts;
+  FILE *in = tmpfile(), *out = tmpfile();
+  int i, errors = 0;
+  fprintf(in,"# test data\n");
+  for (i=0;i<6;++i)
+    fprintf(in,"%s\n%s",sample_lines[i],i==2 ? "\n" : "");
+  rewind(in);
+  kp.kernel_type=POLY;
+  kp.poly_degree=2;
+  kp.coef_lin=1.0;
+  kp.coef_const=1.0;
+  d.gram = calculate_gram_matrix(6,fv,&kp,NULL);
+  d.labels = labels;
+  train_platt_thread(&d);
+  model = model_create(&d.svm,fv,&kp);
+  g_assert(6==model_predict_stream(model,in,out,&counts,NULL));
+  rewind(out);
+  for (i=0;i<6;++i) {
+    g_assert(2==fscanf(out,"%lf %lf",&f,&y));
+    g_assert_cmpfloat(fabs(f-d.svm.decision_values[i]),<,DELTA*(1+fabs(f)));
+    g_assert_cmpfloat(y,==,labels[i]);
+    if ((f > 0) != (y > 0))
+      errors++;
+  }
+  g_assert(counts.TP+counts.TN+counts.FP+counts.FN==6);
+  g_assert(counts.FP+counts.FN==errors);
+  g_assert(0==counts.unlabeled);
+  fclose(in);
+  fclose(out);
+  model_free(model);
+  free_svm(&d.svm);
+  free_gram_matrix(d.gram);
+}
+
+void test_kernel_cacheA(gram_fixture *gf,gconstpointer ignored){
+  FVECTOR **fv = gf->fv;  /* the first three of sample_lines */
+  KERNEL_PARAM kp;
+  SVM svm;
+  unsigned int i,j;
+  kp.kernel_type=LINEAR;
+  /* a budget of one row is raised to the minimum of two rows */
+  KERNEL_CACHE *kc = kcache_create(3,fv,&kp,3*sizeof(double));
+  g_assert(2==kc->max_rows);
+  svm.data = kc;
+  for (i=0;i<3;++i)
+    for (j=0;j<3;++j)
+      g_assert_cmpfloat(fabs(kcache_kernel(i,j,&svm)-sparse_dotproduct(fv[i],fv[j])),<,DELTA);
+  /* only rows 0 and 1 are calculated; K(2,j) is found in the row of j */
+  g_assert(2==kc->misses);
+  kcache_free(kc);
+}
+
+void test_gram_layoutA(gram_fixture *gf,gconstpointer ignored){
+  FVECTOR **fv = gf->fv;  /* the first three of sample_lines */
+  KERNEL_PARAM kp;
+  GRAM_PARAM full = {GRAM_FULL,GRAM_DOUBLE,1,GRAM_BUILD_MERGE}, packed = {GRAM_PACKED,GRAM_DOUBLE,2,GRAM_BUILD_MERGE};
+  unsigned int i,j;
+  kp.kernel_type=LINEAR;
+  GRAM_MATRIX *gm1 = calculate_gram_matrix(3,fv,&kp,&full);
+  GRAM_MATRIX *gm2 = calculate_gram_matrix(3,fv,&kp,&packed);
+  g_assert(0 == ((size_t)gm1->matrix % 64));
+  for (i=0;i<3;++i)
+    for (j=0;j<3;++j) {
+      g_assert_cmpfloat(gram_entry(gm1,i,j),==,sparse_dotproduct(fv[i],fv[j]));
+      g_assert_cmpfloat(gram_entry(gm2,i,j),==,gram_entry(gm1,i,j));
+    }
+  free_gram_matrix(gm1);
+  free_gram_matrix(gm2);
+}
+
+void test_half_precisionA(gram_fixture *gf,gconstpointer ignored){
+  g_assert_cmpfloat(half_to_float(float_to_half(1.0f)),==,1.0f);
+  g_assert_cmpfloat(half_to_float(float_to_half(-2.5f)),==,-2.5f);
+  g_assert_cmpfloat(half_to_float(float_to_half(65504.0f)),==,65504.0f);
+  g_assert(0x7c00 == float_to_half(70000.0f)); /* overflow to infinity */
+  g_assert(0x0001 == float_to_half(5.9604644775390625e-8f)); /* smallest subnormal */
+  /* 1+2^-11 lies halfway between 1 and 1+2^-10 and is rounded to even */
+  g_assert_cmpfloat(half_to_float(float_to_half(1.00048828125f)),==,1.0f);
+  g_assert_cmpfloat(fabs(half_to_float(float_to_half(0.1f))-0.1f),<,1e-4);
+}
+
+/** The tiled, multithreaded calculation and the inverted index builder
+ * must give the same bits as the serial one. The last features have
+ * numbers close to MAXFEATNUM, which the index must handle without
+ * tables of that size. */
+void test_gram_threadsA(gram_fixture *gf,gconstpointer ignored){
+  unsigned int n=150,i,j,k;
+  FVECTOR *fv[150];
+  FEATURE feat[11];
+  KERNEL_PARAM kp;
+  GRAM_PARAM serial = {GRAM_FULL,GRAM_DOUBLE,1,GRAM_BUILD_MERGE}, threaded = {GRAM_FULL,GRAM_DOUBLE,3,GRAM_BUILD_MERGE};
+  GRAM_PARAM indexed = {GRAM_PACKED,GRAM_DOUBLE,2,GRAM_BUILD_INDEX};
+  srand(42);
+  for (i=0;i<n;++i) {
+    for (k=0;k<10;++k) {
+      feat[k].fnum=1+k*3+rand()%3+(k>=8 ? MAXFEATNUM-100 : 0);
+      feat[k].fval=(float)rand()/RAND_MAX;
+    }
+    feat[10].fnum=0;
+    fv[i] = create_feature_vector(feat,i%2?1.0:-1.0,1.0);
+  }
+  kp.kernel_type=LINEAR;
+  GRAM_MATRIX *gm1 = calculate_gram_matrix(n,fv,&kp,&serial);
+  GRAM_MATRIX *gm2 = calculate_gram_matrix(n,fv,&kp,&threaded);
+  GRAM_MATRIX *gm3 = calculate_gram_matrix(n,fv,&kp,&indexed);
+  for (i=0;i<n;++i)
+    for (j=0;j<n;++j) {
+      g_assert(0==memcmp(&((double*)gm1->matrix)[gram_offset(gm1,i,j)],
+			 &((double*)gm2->matrix)[gram_offset(gm2,i,j)],sizeof(double)));
+      g_assert(0==memcmp(&((double*)gm1->matrix)[gram_offset(gm1,i,j)],
+			 &((double*)gm3->matrix)[gram_offset(gm3,i,j)],sizeof(double)));
+    }
+  free_gram_matrix(gm1);
+  free_gram_matrix(gm2);
+  free_gram_matrix(gm3);
+}
+
+/** The batched (vectorized) kernels must agree with kernel_function() */
+void test_kernel_transformA(gram_fixture *gf,gconstpointer ignored){
+  char *lines[3]={"+1	1:1	2:2","-1	2:1	3:4","+1	1:3	3:0.5"};
+  FVECTOR *fv[3];
+  FEATURE *feat = (FEATURE *)xmalloc(sizeof(FEATURE)*4);
+  double label,values[3],norms[3];
+  long int n_features;
+  KERNEL_PARAM kp;
+  unsigned int i,j;
+  for (i=0;i<3;++i) {
+    parse_line(lines[i],feat,&label,&n_features,3);
+    fv[i] = create_feature_vector(feat,label,1.0);
+    norms[i] = fv[i]->twonorm_sq;
+  }
+  g_assert_cmpfloat(fv[2]->twonorm_sq,==,9.25);
+  kp.poly_degree=3;
+  kp.rbf_gamma=0.1;
+  kp.coef_lin=0.5;
+  kp.coef_const=-1.0;
+  for (kp.kernel_type=LINEAR;kp.kernel_type<=SIGMOID;kp.kernel_type++) {
+    for (i=0;i<3;++i) {
+      for (j=0;j<3;++j)
+	values[j] = sparse_dotproduct(fv[i],fv[j]);
+      kernel_transform_row(&kp,values,3,norms[i],norms);
+      for (j=0;j<3;++j)
+	g_assert_cmpfloat(fabs(values[j]-kernel_function(&kp,fv[i],fv[j])),<,1e-12);
+    }
+  }
+}
+
+
+/* The vectorized/galloping intersection must return exactly the same
+ * value as the scalar merge, including for very unequal lengths. */
+void test_sparse_dotproductC(gram_fixture *gf,gconstpointer ignored){
+  FEATURE *feat = (FEATURE *)xmalloc(sizeof(FEATURE)*1001);
+  FVECTOR *fv[6];
+  int len[6]={1,3,9,40,400,1000};
+  int step[6]={7,2,3,2,2,3};
+  unsigned int i,j;
+  int k;
+  for (i=0;i<6;++i) {
+    for (k=0;k<len[i];++k) {
+      feat[k].fnum = 1+k*step[i]+(k%3==0);
+      feat[k].fval = 0.1f*(float)(k%11)-0.37f;
+    }
+    feat[len[i]].fnum = 0;
+    fv[i] = create_feature_vector(feat,1.0,1.0);
+    g_assert(fv[i]->n_features==(unsigned long)len[i]);
+  }
+  for (i=0;i<6;++i)
+    for (j=0;j<6;++j)
+      g_assert(sparse_dotproduct(fv[i],fv[j])==sparse_dotproduct_scalar(fv[i],fv[j]));
+  free(feat);
+}
+
 
 int main(int argc,char**argv) {
   g_test_init(&argc, &argv, NULL);
@@ -185,7 +1012,29 @@ int main(int argc,char**argv) {
   g_test_add("/set1/parseline",gram_fixture,NULL,NULL,test_parse_line_D,NULL);
   g_test_add("/set1/parseline",gram_fixture,NULL,NULL,test_parse_line_E,NULL);
   g_test_add("/set1/parseline",gram_fixture,NULL,NULL,test_parse_line_F,NULL);
+  g_test_add("/set1/parseline",gram_fixture,NULL,NULL,test_parse_line_G,NULL);
+  g_test_add("/set1/parseline",gram_fixture,NULL,NULL,test_parse_line_H,NULL);
   g_test_add("/set2/dotproduct",gram_fixture,NULL,NULL,test_sparse_dotproductA,NULL);
   g_test_add("/set2/dotproduct",gram_fixture,NULL,NULL,test_sparse_dotproductB,NULL);
+  g_test_add("/set2/dotproduct",gram_fixture,NULL,NULL,test_sparse_dotproductC,NULL);
+  g_test_add("/set3/kerneltransform",gram_fixture,NULL,NULL,test_kernel_transformA,NULL);
+  g_test_add("/set3/gramlayout",gram_fixture,NULL,sample_setup,test_gram_layoutA,sample_teardown);
+  g_test_add("/set3/gramthreads",gram_fixture,NULL,NULL,test_gram_threadsA,NULL);
+  g_test_add("/set3/halfprecision",gram_fixture,NULL,NULL,test_half_precisionA,NULL);
+  g_test_add("/set3/kernelrow",gram_fixture,NULL,sample_setup,test_kernel_rowA,sample_teardown);
+  g_test_add("/set3/reentrant",gram_fixture,NULL,sample_setup,test_reentrant_trainingA,sample_teardown);
+  g_test_add("/set3/platterrorcache",gram_fixture,NULL,sample_setup,test_platt_error_cacheA,sample_teardown);
+  g_test_add("/set3/fanshrinking",gram_fixture,NULL,NULL,test_fan_shrinkingA,NULL);
+  g_test_add("/set3/platterrorcache",gram_fixture,NULL,NULL,test_platt_error_cacheB,NULL);
+  g_test_add("/set3/fanthreads",gram_fixture,NULL,NULL,test_fan_threadsA,NULL);
+  g_test_add("/set3/simdselect",gram_fixture,NULL,NULL,test_simd_selectA,NULL);
+  g_test_add("/set3/model",gram_fixture,NULL,sample_setup,test_model_save_loadA,sample_teardown);
+  g_test_add("/set3/model",gram_fixture,NULL,sample_setup,test_model_predict_streamA,sample_teardown);
+  g_test_add("/set3/model",gram_fixture,NULL,sample_setup,test_model_predict_batchA,sample_teardown);
+  g_test_add("/set3/dataset",gram_fixture,NULL,NULL,test_datasetA,NULL);
+  g_test_add("/set3/dataset",gram_fixture,NULL,NULL,test_dataset_parseA,NULL);
+  g_test_add("/set3/weightvector",gram_fixture,NULL,sample_setup,test_weight_vectorA,sample_teardown);
+  g_test_add("/set3/weightvector",gram_fixture,NULL,sample_setup,test_weight_vectorB,sample_teardown);
+  g_test_add("/set3/kernelcache",gram_fixture,NULL,sample_setup,test_kernel_cacheA,sample_teardown);
   return g_test_run();
 }
@@ -0,0 +1,144 @@
+/************************************************************************/
+/*                                                                      */
+/*   threadpool.c                                                       */
+/*                                                                      */
+/*   Persistent pool of worker threads.                                 */
+/*                                                                      */
+/*   Author: Peter N Robinson                                           */
+/*   Date: 12.04.15                                                     */
+/*                                                                      */
+/*   Copyright (c) 2015  Peter Robinson - All rights reserved           */
+/*                                                                      */
+/*   This software is available on a BSD2 license.                      */
+/*                                                                      */
+/************************************************************************/
+
+#include "threadpool.h"
+#include "svm_util.h"
+
+/** Number of polls before a waiting thread goes to sleep */
+#define SPIN_COUNT 20000
+
+/** Argument of worker_main() */
+typedef struct worker_arg {
+  THREAD_POOL *pool;
+  int thread_id;
+} WORKER_ARG;
+
+
+static void *worker_main(void *p)
+{
+  WORKER_ARG *wa = (WORKER_ARG*)p;
+  THREAD_POOL *pool = wa->pool;
+  int id = wa->thread_id;
+  unsigned long seen = 0;
+  free(wa);
+
+  for (;;) {
+    int spin;
+    for (spin=0; spin<SPIN_COUNT; ++spin) {
+      if (__atomic_load_n(&pool->generation,__ATOMIC_ACQUIRE) != seen)
+	break;
+    }
+    if (spin == SPIN_COUNT) {
+      pthread_mutex_lock(&pool->lock);
+      while (pool->generation == seen)
+	pthread_cond_wait(&pool->work_cond,&pool->lock);
+      pthread_mutex_unlock(&pool->lock);
+    }
+    seen = __atomic_load_n(&pool->generation,__ATOMIC_ACQUIRE);
+    if (pool->shutdown)
+      break;
+    pool->fn(pool->arg,id);
+    if (__atomic_sub_fetch(&pool->pending,1,__ATOMIC_ACQ_REL) == 0) {
+      pthread_mutex_lock(&pool->lock);
+      pthread_cond_signal(&pool->done_cond);
+      pthread_mutex_unlock(&pool->lock);
+    }
+  }
+  return NULL;
+}
+
+
+/**
+ * \brief Start a pool with n_threads threads (including the calling thread).
+ * @param n_threads Number of threads; values < 1 are treated as 1, i.e.,
+ * the work is done by the calling thread alone.
+ */
+THREAD_POOL *threadpool_create(int n_threads)
+{
+  THREAD_POOL *pool = (THREAD_POOL*)xmalloc(sizeof(THREAD_POOL));
+  if (n_threads < 1) n_threads = 1;
+  pool->n_threads = n_threads;
+  pool->generation = 0;
+  pool->pending = 0;
+  pool->shutdown = 0;
+  pool->fn = NULL;
+  pool->arg = NULL;
+  pthread_mutex_init(&pool->lock,NULL);
+  pthread_cond_init(&pool->work_cond,NULL);
+  pthread_cond_init(&pool->done_cond,NULL);
+  pool->threads = (pthread_t*)xmalloc(n_threads*sizeof(pthread_t));
+  for (int t=1; t<n_threads; ++t) {
+    WORKER_ARG *wa = (WORKER_ARG*)xmalloc(sizeof(WORKER_ARG));
+    wa->pool = pool;
+    wa->thread_id = t;
+    if (pthread_create(&pool->threads[t],NULL,worker_main,wa)) {
+      perror("Could not start worker thread");
+      exit(1);
+    }
+  }
+  return pool;
+}
+
+
+/**
+ * \brief Execute fn(arg,thread_id) on all threads of the pool and wait
+ * until all of them have returned.
+ */
+void threadpool_run(THREAD_POOL *pool, THREADPOOL_FN fn, void *arg)
+{
+  if (pool->n_threads == 1) {
+    fn(arg,0);
+    return;
+  }
+  pool->fn = fn;
+  pool->arg = arg;
+  __atomic_store_n(&pool->pending,pool->n_threads-1,__ATOMIC_RELEASE);
+  pthread_mutex_lock(&pool->lock);
+  __atomic_add_fetch(&pool->generation,1,__ATOMIC_RELEASE);
+  pthread_cond_broadcast(&pool->work_cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  fn(arg,0);
+
+  for (int spin=0; spin<SPIN_COUNT; ++spin) {
+    if (__atomic_load_n(&pool->pending,__ATOMIC_ACQUIRE) == 0)
+      return;
+  }
+  pthread_mutex_lock(&pool->lock);
+  while (__atomic_load_n(&pool->pending,__ATOMIC_ACQUIRE) != 0)
+    pthread_cond_wait(&pool->done_cond,&pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+
+/** \brief Stop the worker threads and deallocate memory */
+void threadpool_free(THREAD_POOL *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = 1;
+  __atomic_add_fetch(&pool->generation,1,__ATOMIC_RELEASE);
+  pthread_cond_broadcast(&pool->work_cond);
+  pthread_mutex_unlock(&pool->lock);
+  for (int t=1; t<pool->n_threads; ++t)
+    pthread_join(pool->threads[t],NULL);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work_cond);
+  pthread_cond_destroy(&pool->done_cond);
+  free(pool->threads);
+  free(pool);
+}
+
+
+/* eof */
@@ -0,0 +1,52 @@
+/************************************************************************/
+/*                                                                      */
+/*   threadpool.h                                                       */
+/*                                                                      */
+/*   Persistent pool of worker threads.                                 */
+/*                                                                      */
+/*   Author: Peter N Robinson                                           */
+/*   Date: 12.04.15                                                     */
+/*                                                                      */
+/*   Copyright (c) 2015  Peter Robinson - All rights reserved           */
+/*                                                                      */
+/*   This software is available on a BSD2 license.                      */
+/*                                                                      */
+/************************************************************************/
+
+#ifndef THREADPOOL_H_
+#define THREADPOOL_H_
+
+#include <pthread.h>
+
+/** \brief Work function executed by every thread of the pool.
+ * @param arg The argument passed to threadpool_run()
+ * @param thread_id 0..n_threads-1; the calling thread has id 0
+ */
+typedef void (*THREADPOOL_FN)(void *arg, int thread_id);
+
+/** \brief A pool of threads that execute the same function in parallel.
+ *
+ * The threads are started once and then wait for work, so that
+ * threadpool_run() can be called many times (e.g., once per iteration
+ * of a solver) without paying for thread creation. Workers spin for a
+ * short time before going to sleep, which keeps the latency of
+ * back-to-back calls low.
+ */
+typedef struct threadpool {
+  int n_threads;            /**< Number of threads including the caller */
+  pthread_t *threads;       /**< The n_threads-1 worker threads */
+  pthread_mutex_t lock;
+  pthread_cond_t work_cond; /**< Signalled when a new generation starts */
+  pthread_cond_t done_cond; /**< Signalled when the last worker finishes */
+  unsigned long generation; /**< Incremented for each call of threadpool_run() */
+  int pending;              /**< Workers that have not finished the current call */
+  int shutdown;
+  THREADPOOL_FN fn;
+  void *arg;
+} THREAD_POOL;
+
+THREAD_POOL *threadpool_create(int n_threads);
+void threadpool_run(THREAD_POOL *pool, THREADPOOL_FN fn, void *arg);
+void threadpool_free(THREAD_POOL *pool);
+
+#endif /* THREADPOOL_H_ */
@@ -15,60 +15,273 @@
 
 #include "svm_util.h"
 #include "svm.h"
+#include "kcache.h"
+#include "model.h"
+#include "dataset.h"
 
-/** Path to the file with training data */
-char training_data_file[200];
-/** Path to the SVM model file */
-char model_file[200];
+/** Verbosity level for output */
+int verbosity;
 
-void input_arguments(int argc,char *argv[],char *docfile,char *modelfile,
-		     int *verbosity, KERNEL_PARAM *kernel_parameters);
+void input_arguments(int argc,char *argv[],char **trainingfile,char **modelfile,
+		     int *verbosity, KERNEL_PARAM *kernel_parameters,
+		     GRAM_PARAM *gram_parameters, double *cache_mb);
 void print_help();
+void load_training_data(char *trainfile, FVECTOR ***fvecs, unsigned long *n_features,
+			unsigned long *n_fvecs, int n_threads);
 void read_training_data(char *trainfile, FVECTOR ***fvecs, 
-		    unsigned long *n_features, unsigned long *n_fvecs);
+			unsigned long *n_features, unsigned long *n_fvecs, int n_threads);
 int parse_line(char *line, FEATURE *features, double *label,
 	       long int *n_features, long int max_words_doc);
-void initialize_svm(SVM *svm, GRAM_MATRIX *gram, FVECTOR **fv_list);
+void initialize_svm(SVM *svm, unsigned int N, FVECTOR **fv_list);
+double dumbkernelfxn(int i1, int i2, SVM *svm);
+void report_precision_deviation(SVM *svm, GRAM_MATRIX *gram, FVECTOR **fv_list,
+				KERNEL_PARAM *kernel_parameters, GRAM_PARAM *gram_parameters);
+int classify_test_data(char *testfile, char *modelfile, char *outputfile, int n_threads);
 
 /** Determined wheter the optimization will be performed using the Fan algorithm (default)
  * or the SMO algorithm of Platt).
  */
 enum optimization opt_type=FAN;
+/** Determines whether the Fan algorithm uses shrinking (default) */
+int shrinking=1;
+/** Format in which the model file is written (binary by default) */
+enum model_format model_format=MODEL_BINARY;
+/** If set (-m), classify the data file with this model instead of training */
+char *predict_model_file=NULL;
+/** If set (-C), the parsed training data are written to a binary dataset file */
+int write_dataset_cache=0;
+/** If set (-D), a reduced precision training is compared with a training
+ * on the double precision Gram matrix */
+int compare_double_training=0;
 
 int main(int argc,char ** argv) {
   FVECTOR **feature_vector_list; /* the training data */
   unsigned long total_features;
   unsigned long total_feature_vectors;
   KERNEL_PARAM kernel_parameters;
-  GRAM_MATRIX *gram;
+  GRAM_PARAM gram_parameters;
+  GRAM_MATRIX *gram = NULL;
+  KERNEL_CACHE *cache = NULL;
+  double cache_mb = 0.0; /* size of the kernel cache; 0 means full Gram matrix */
   SVM svm;
+  SVM_MODEL *model;
+  char *training_data_file; /* path to the file with training data */
+  char *model_file; /* path to the SVM model file */
  
   printf("xsvm\n");
-  input_arguments(argc,argv,training_data_file,model_file,&verbosity, &kernel_parameters);
-  read_training_data(training_data_file,&feature_vector_list,&total_features,
-		     &total_feature_vectors);
-  // For now, let us use a Euclidean kernel
-  gram = calculate_gram_matrix(total_feature_vectors,feature_vector_list,&kernel_parameters);
+  input_arguments(argc,argv,&training_data_file,&model_file,&verbosity, &kernel_parameters,
+		  &gram_parameters,&cache_mb);
+  if (predict_model_file)
+    return classify_test_data(training_data_file,predict_model_file,model_file,
+			      gram_parameters.n_threads);
+  load_training_data(training_data_file,&feature_vector_list,&total_features,
+		     &total_feature_vectors,gram_parameters.n_threads);
   
-  initialize_svm(&svm, gram, feature_vector_list);
+  initialize_svm(&svm, total_feature_vectors, feature_vector_list);
+  svm.shrinking = shrinking;
+  svm.verbosity = verbosity;
+  svm.kernel_parameters = &kernel_parameters;
+  if (gram_parameters.n_threads > 1)
+    svm.pool = threadpool_create(gram_parameters.n_threads);
+  if (cache_mb > 0) {
+    /* Calculate kernel rows on demand instead of storing the Gram matrix */
+    cache = kcache_create(total_feature_vectors,feature_vector_list,&kernel_parameters,
+			  (size_t)(cache_mb*1024*1024));
+    svm.data = cache;
+    svm.kernel = kcache_kernel;
+    svm.kernel_row = kcache_kernel_row;
+  } else {
+    // For now, let us use a Euclidean kernel
+    gram = calculate_gram_matrix(total_feature_vectors,feature_vector_list,&kernel_parameters,
+				 &gram_parameters);
+    svm.data = gram;
+    svm.kernel = dumbkernelfxn;
+    svm.kernel_row = gram_kernel_row;
+  }
+  if ( plausibility_check(&svm) < 0 ) {
+    fprintf(stderr,"Terminating program because of errors in SVM initialization\n");
+    exit(1);
+  }
   
   svm_train(&svm,opt_type);
 
   svm_output_message(&svm);
+  model = model_create(&svm,feature_vector_list,&kernel_parameters);
+  if (model_save(model,model_file,model_format) == 0 && verbosity>=1) {
+    if (model->w)
+      printf("Wrote linear model (weight vector of length %lu) to %s\n",model->n_w,model_file);
+    else if (model->w_fnum)
+      printf("Wrote linear model (sparse weight vector with %lu features) to %s\n",
+	     model->w_nnz,model_file);
+    else
+      printf("Wrote model with %lu support vectors to %s\n",model->n_sv,model_file);
+  }
+  model_free(model);
+  if (gram && gram->precision != GRAM_DOUBLE)
+    report_precision_deviation(&svm,gram,feature_vector_list,&kernel_parameters,
+			       &gram_parameters);
+  if (cache && verbosity>=1)
+    kcache_print_statistics(cache,stdout);
+  if (svm.pool)
+    threadpool_free(svm.pool);
+
+  return 0;
+}
+
 
+/**
+ * \brief Classify the examples of a test file with a saved model (-m).
+ *
+ * The test file is streamed through model_predict_stream(), so that
+ * files of any size can be classified.
+ * @param testfile Examples in the format of the training data
+ * @param modelfile A model saved by a training run
+ * @param outputfile Receives the decision value and label of each example
+ * @param n_threads Number of threads used for the classification
+ * @return The exit status of the program
+ */
+int classify_test_data(char *testfile, char *modelfile, char *outputfile, int n_threads)
+{
+  SVM_MODEL *model;
+  MODEL_CONFUSION counts;
+  THREAD_POOL *pool = NULL;
+  FILE *in, *out;
+  long n, errors;
+  struct timespec t0, t1;
+  double seconds;
+
+  if ((model = model_load(modelfile)) == NULL) {
+    fprintf(stderr,"Could not load model %s\n",modelfile);
+    return 1;
+  }
+  if (verbosity>=1 && model->w)
+    printf("Loaded linear model (weight vector of length %lu) from %s\n",model->n_w,modelfile);
+  else if (verbosity>=1)
+    printf("Loaded model with %lu support vectors from %s\n",model->n_sv,modelfile);
+  if (!strcmp(testfile,"-")) {
+    in = stdin;
+  } else if ((in = fopen(testfile,"r")) == NULL) {
+    perror(testfile);
+    exit(1);
+  }
+  if ((out = fopen(outputfile,"w")) == NULL) {
+    perror(outputfile);
+    exit(1);
+  }
+  if (n_threads > 1)
+    pool = threadpool_create(n_threads);
+  clock_gettime(CLOCK_MONOTONIC,&t0);
+  n = model_predict_stream(model,in,out,&counts,pool);
+  clock_gettime(CLOCK_MONOTONIC,&t1);
+  if (in != stdin)
+    fclose(in);
+  fclose(out);
+  model_free(model);
+  if (pool)
+    threadpool_free(pool);
+  if (n < 0)
+    return 1;
+  seconds = (t1.tv_sec-t0.tv_sec)+1e-9*(t1.tv_nsec-t0.tv_nsec);
+  errors = counts.FP+counts.FN;
+  n -= counts.unlabeled;
+  printf("Classified %ld examples (%ld misclassified [%.2f%%], %ld correctly classified [%.2f%%])\n",
+	 n,errors,n ? 100.0*errors/n : 0.0,n-errors,n ? 100.0*(n-errors)/n : 0.0);
+  printf("TP:%lu, TN:%lu, FP:%lu, FN:%lu",counts.TP,counts.TN,counts.FP,counts.FN);
+  if (counts.unlabeled)
+    printf(" (%lu unlabeled examples)",counts.unlabeled);
+  printf("\nDecision values written to %s\n",outputfile);
+  if (verbosity>=1)
+    printf("Classification took %.3f s (%.0f predictions/s, %d thread%s)\n",
+	   seconds,seconds > 0 ? (n+counts.unlabeled)/seconds : 0.0,
+	   n_threads,n_threads > 1 ? "s" : "");
   return 0;
 }
 
 
 double dumbkernelfxn(int i1, int i2, SVM *svm) {
-  double** mat = (double**)svm->data;
-  return mat[i1][i2];
+  return gram_entry((GRAM_MATRIX*)svm->data,i1,i2);
+}
+
+/** \brief Examples and kernel for exactkernelfxn (passed in svm->userdata). */
+typedef struct exact_kernel_data {
+  FVECTOR **fv_list;
+  KERNEL_PARAM *kernel_parameters;
+} EXACT_KERNEL_DATA;
+
+/** \brief Kernel callback that evaluates the kernel in double precision
+ * on each call (used to check the reduced precision Gram matrices). */
+double exactkernelfxn(int i1, int i2, SVM *svm) {
+  EXACT_KERNEL_DATA *ek = (EXACT_KERNEL_DATA*)svm->userdata;
+  return kernel_function(ek->kernel_parameters,ek->fv_list[i1],ek->fv_list[i2]);
 }
 
-void initialize_svm(SVM *svm, GRAM_MATRIX *gram, FVECTOR **fv_list)
+/** \brief Report the error caused by storing the Gram matrix in reduced precision.
+ *
+ * By default, the objective of the dual is evaluated for the learned
+ * alphas once with the stored Gram matrix and once with kernel values in
+ * double precision. This only shows the error of the objective for the
+ * same alphas, not how far the solution moved. With -D, the SVM is also
+ * trained on a double precision Gram matrix, and the objectives and
+ * decision values of the two trainings are compared.
+ */
+void report_precision_deviation(SVM *svm, GRAM_MATRIX *gram, FVECTOR **fv_list,
+				KERNEL_PARAM *kernel_parameters, GRAM_PARAM *gram_parameters)
 {
-  svm->data = gram->matrix;
-  unsigned int N = gram->n;
+  EXACT_KERNEL_DATA ek;
+  SVM exact = *svm;
+  double obj, obj_exact;
+  ek.fv_list = fv_list;
+  ek.kernel_parameters = kernel_parameters;
+  exact.userdata = &ek;
+  exact.kernel = exactkernelfxn;
+  exact.kernel_row = NULL;
+  obj = objective_function(svm);
+  obj_exact = objective_function(&exact);
+  printf("Reduced precision Gram matrix: max |K-K_double|=%g; for the same alphas: "
+	 "objective=%.10g, double precision objective=%.10g, |deviation|=%g\n",
+	 gram_max_deviation(gram,fv_list,kernel_parameters),obj,obj_exact,fabs(obj-obj_exact));
+  if (compare_double_training) {
+    GRAM_PARAM double_parameters = *gram_parameters;
+    SVM ref = *svm; /* the same labels and settings; svm_train allocates the results */
+    double obj_double, max_df = 0.0;
+    int i;
+    double_parameters.precision = GRAM_DOUBLE;
+    ref.data = calculate_gram_matrix(svm->training_count,fv_list,kernel_parameters,
+				     &double_parameters);
+    ref.kernel = dumbkernelfxn;
+    ref.kernel_row = gram_kernel_row;
+    ref.output_file = NULL;
+    ref.verbosity = 0;
+    svm_train(&ref,opt_type);
+    obj_double = objective_function(&ref);
+    for (i=0;i<svm->training_count;++i)
+      if (fabs(svm->decision_values[i]-ref.decision_values[i]) > max_df)
+	max_df = fabs(svm->decision_values[i]-ref.decision_values[i]);
+    printf("Training on the double precision Gram matrix: objective=%.10g, "
+	   "|objective-objective_double|=%g, max |f-f_double|=%g\n",
+	   obj_double,fabs(obj-obj_double),max_df);
+    free_svm(&ref);
+    free_gram_matrix((GRAM_MATRIX*)ref.data);
+  }
+}
+
+/** \brief Initialize the SVM with the class labels and parameters.
+ *
+ * The kernel backend (svm->data, svm->kernel and svm->kernel_row) is set by the caller.
+ * @param svm The SVM to be initialized
+ * @param N The number of training examples
+ * @param fv_list The training examples
+ */
+void initialize_svm(SVM *svm, unsigned int N, FVECTOR **fv_list)
+{
+  svm->data = NULL;
+  svm->kernel = NULL;
+  svm->kernel_row = NULL;
+  svm->row_buffer = NULL;
+  svm->pool = NULL;
+  svm->parallel_min = 0;
+  svm->fvecs = fv_list;
+  svm->kernel_parameters = NULL;
   signed char *labels = xmalloc(N*sizeof(signed char));
   for (unsigned int i=0;i<N;++i) {
     if (fv_list[i]->data_class < 0)
@@ -84,108 +297,97 @@ void initialize_svm(SVM *svm, GRAM_MATRIX *gram, FVECTOR **fv_list)
   svm->training_count = N;
   svm->test_count = 0;
   svm->end_support_i = N;
-  svm->kernel = dumbkernelfxn;
   double C=1.0;
   svm->C=C;
   svm->C_neg = C;
   svm->C_pos = C;
   svm->output_file = "xsvm.out";
+  svm->verbosity = 1;
+  svm->seed = 0;
   int maxIter=100;
   svm->max_iter = maxIter;
-  
-  if ( plausibility_check(svm) < 0 ) {
-    fprintf(stderr,"Terminating program because of errors in SVM initialization\n");
-    exit(1);
-  }
 }
 
 
 
+/** Files smaller than this are parsed by a single thread */
+#define PARALLEL_PARSE_MIN (1<<20)
+
 /** \brief Input the data from the training data file.
  *
- * @param trainfile A file with training data (sparse format)
+ * The file is made available in memory with input_open() (mapped if it is a
+ * regular file) and parsed with dataset_parse(), by n_threads threads if
+ * it is at least PARALLEL_PARSE_MIN bytes long. The file may also be a
+ * pipe. The whole data set is released with free(*fvecs). The program
+ * exits with the line number of the first malformed line, if any.
+ * @param trainfile A file with training data (sparse format), or "-" for stdin
  * @param fvecs The data will be put here
  * @param n_features The total number of features will be put here
  * @param n_fvecs The total number of training data points will be put here
+ * @param n_threads The number of threads used for parsing
  */
 void read_training_data(char *trainfile, FVECTOR ***fvecs, 
-			unsigned long *n_features, unsigned long *n_fvecs){
-  char *line;
-  FEATURE *features;
-  long dnum=0,wpos,dpos=0,dneg=0,dunlab=0;
-  unsigned n_featvecs; /* number of feature vectores in the training data */
-  unsigned max_features; /* maximum number of features in a feature vector */
-  unsigned ll; /* maximum line length */
-  double doc_label;
-  FILE *FH;
+			unsigned long *n_features, unsigned long *n_fvecs, int n_threads){
+  INPUT_BUFFER in;
+  PARSE_ERROR error;
+
+  if (input_open(trainfile,&in) < 0)
+    exit(1);
+  if (n_threads < 1 || in.size < PARALLEL_PARSE_MIN)
+    n_threads = 1;
 
   if(verbosity>=1) {
-    printf("Scanning examples..."); fflush(stdout);
+    printf("Reading training data into memory..."); fflush(stdout);
   }
-  scan_n_lines_and_features(trainfile,&n_featvecs,&max_features,&ll); /* scan size of input file */
-  max_features+=2;
-  ll+=2;
-  n_featvecs+=2;
+  if (dataset_parse(in.data,in.size,n_threads,verbosity>=1,fvecs,n_features,n_fvecs,
+		    &error) < 0) {
+    printf("\nParsing error in line %ld: %s\n%.*s\n",error.line,
+	   parse_result_string(error.result),error.length,error.text);
+    exit(1);
+  }
+  input_close(&in);
   if(verbosity>=1) {
-    printf("done [lines=%u, max features=%u, max line len=%u]\n",
-	   n_featvecs,max_features,ll); 
-    fflush(stdout);
+    fprintf(stdout, "OK. (%lu examples read)\n", *n_fvecs);
   }
+}
 
-  (*fvecs) = (FVECTOR **)xmalloc(sizeof(FVECTOR *)*n_featvecs);    /* feature vectors */
-  //(*label) = (double *)xmalloc(sizeof(double)*max_docs); /* target values */
-  line = (char *)xmalloc(sizeof(char)*ll);
-  
-  if ((FH = fopen (trainfile, "r")) == NULL){ 
-    perror (trainfile); 
-    exit (1); 
-  }
 
-  features = (FEATURE *)xmalloc(sizeof(FEATURE)*(max_features+10));
-  if(verbosity>=1) {
-    printf("Reading training data into memory..."); fflush(stdout);
-  }
-  dnum=0;
-  (*n_features)=0;
-  while((!feof(FH)) && fgets(line,(int)ll,FH)) {
-    if(line[0] == '#') continue;  /* line contains comments */
-  
-    if(!parse_line(line,features,&doc_label,&wpos,max_features)){
-      printf("\nParsing error in line %ld!\n%s",dnum,line);
-      exit(1);
-    }
-    //printf("docnum=%ld: Class=%f,wpos=%ld,max_features=%ud\n",dnum,doc_label,wpos,max_features); 
-    if(doc_label > 0) dpos++;
-    if (doc_label < 0) dneg++;
-    if (doc_label == 0) dunlab++;
-
-    if((wpos>1) && ((features[wpos-2]).fnum>(*n_features))) 
-      (*n_features)=(features[wpos-2]).fnum;
-    if((*n_features) > MAXFEATNUM) {
-      printf("\nMaximum feature number exceeds limit defined in MAXFEATNUM!\n");
-      printf("LINE: %s\n",line);
-      exit(1);
-    }
+/**
+ * \brief Obtain the training data from the binary cache of trainfile, or parse trainfile.
+ *
+ * If trainfile has a cache (trainfile.xcsr) that is newer than trainfile,
+ * the cache is mapped into memory instead of parsing the text. Otherwise
+ * the text is read with read_training_data() and, if the flag -C was given,
+ * the cache is (re)written.
+ */
+void load_training_data(char *trainfile, FVECTOR ***fvecs, unsigned long *n_features,
+			unsigned long *n_fvecs, int n_threads)
+{
+  char *cachefile;
+  DATASET *ds = NULL;
 
-    double factor=1.0; /* todo: implement this or remove it */
-     (*fvecs)[dnum] = create_feature_vector(features,doc_label,factor);
-     //printf("\nNorm=%f\n",((*docs)[dnum]->fvec)->twonorm_sq);  
-     dnum++;  
-     if(verbosity>=1) {
-       if((dnum % 100) == 0) {
-	 printf("%ld..",dnum); fflush(stdout);
-       }
-     }
-  } 
-
-  fclose(FH);
-  free(line);
-  free(features);
-  if(verbosity>=1) {
-    fprintf(stdout, "OK. (%ld examples read)\n", dnum);
+  if (!strcmp(trainfile,"-")) {
+    read_training_data(trainfile,fvecs,n_features,n_fvecs,n_threads);
+    return;
   }
-  (*n_fvecs)=dnum;
-  
+  cachefile = (char*)xmalloc(strlen(trainfile)+strlen(DATASET_SUFFIX)+1);
+  sprintf(cachefile,"%s%s",trainfile,DATASET_SUFFIX);
+  if (dataset_is_current(cachefile,trainfile))
+    ds = dataset_load(cachefile);
+  if (ds) {
+    if (verbosity>=1)
+      fprintf(stdout,"Loaded %lu examples from %s\n",ds->n_fvecs,cachefile);
+    /* The views and the mapping are used until the program exits */
+    (*fvecs) = ds->fvecs;
+    (*n_features) = ds->n_features;
+    (*n_fvecs) = ds->n_fvecs;
+  } else {
+    read_training_data(trainfile,fvecs,n_features,n_fvecs,n_threads);
+    if (write_dataset_cache && dataset_save(cachefile,*fvecs,*n_fvecs,*n_features) == 0
+	&& verbosity>=1)
+      fprintf(stdout,"Wrote %s\n",cachefile);
+  }
+  free(cachefile);
 }
 
 
@@ -196,20 +398,111 @@ void read_training_data(char *trainfile, FVECTOR ***fvecs,
  * TODO: Need to extend for testing and custom kernel as well
  */
 void input_arguments(int argc,char *argv[],
-		     char *trainingfile,
-		     char *modelfile,
+		     char **trainingfile,
+		     char **modelfile,
 		     int *verbosity,
-		     KERNEL_PARAM *kernel_parameters)
+		     KERNEL_PARAM *kernel_parameters,
+		     GRAM_PARAM *gram_parameters,
+		     double *cache_mb)
 {
   unsigned int i;
   /* default values for model file and verbosity level */
-  strcpy (modelfile, "svm_model");
+  (*modelfile) = "svm_model";
   (*verbosity)=1;
   kernel_parameters->kernel_type=LINEAR;
-  for(i=1;(i<argc) && ((argv[i])[0] == '-');i++) {
+  kernel_parameters->poly_degree=3;
+  kernel_parameters->rbf_gamma=1.0;
+  kernel_parameters->coef_lin=1.0;
+  kernel_parameters->coef_const=1.0;
+  gram_parameters->layout=GRAM_FULL;
+  gram_parameters->precision=GRAM_DOUBLE;
+  gram_parameters->n_threads=1;
+  gram_parameters->builder=GRAM_BUILD_AUTO;
+  gram_parameters->verbosity=1;
+  for(i=1;(i<argc) && ((argv[i])[0] == '-') && (argv[i])[1];i++) {
     switch ((argv[i])[1]) {
     case '?': print_help(); exit(0);
-    case 'v': i++; (*verbosity)=atol(argv[i]); break;
+    case 'v': i++; (*verbosity)=atol(argv[i]); gram_parameters->verbosity=(*verbosity); break;
+    case 'h': i++; shrinking=atoi(argv[i]); break;
+    case 'm': i++; predict_model_file=argv[i]; break;
+    case 'C': write_dataset_cache=1; break;
+    case 'D': compare_double_training=1; break;
+    case 'c': i++; (*cache_mb)=atof(argv[i]); break;
+    case 't': i++; gram_parameters->n_threads=atoi(argv[i]); break;
+    case 'k':
+      i++;
+      if (!strcmp(argv[i],"linear"))
+	kernel_parameters->kernel_type=LINEAR;
+      else if (!strcmp(argv[i],"poly"))
+	kernel_parameters->kernel_type=POLY;
+      else if (!strcmp(argv[i],"rbf"))
+	kernel_parameters->kernel_type=RBF;
+      else if (!strcmp(argv[i],"sigmoid"))
+	kernel_parameters->kernel_type=SIGMOID;
+      else {
+	printf("did not recognize kernel %s\n",argv[i]);
+	print_help();
+	exit(0);
+      }
+      break;
+    case 'd': i++; kernel_parameters->poly_degree=atol(argv[i]); break;
+    case 'g': i++; kernel_parameters->rbf_gamma=atof(argv[i]); break;
+    case 's': i++; kernel_parameters->coef_lin=atof(argv[i]); break;
+    case 'r': i++; kernel_parameters->coef_const=atof(argv[i]); break;
+    case 'b':
+      i++;
+      if (!strcmp(argv[i],"auto"))
+	gram_parameters->builder=GRAM_BUILD_AUTO;
+      else if (!strcmp(argv[i],"merge"))
+	gram_parameters->builder=GRAM_BUILD_MERGE;
+      else if (!strcmp(argv[i],"index"))
+	gram_parameters->builder=GRAM_BUILD_INDEX;
+      else {
+	printf("did not recognize Gram matrix builder %s\n",argv[i]);
+	print_help();
+	exit(0);
+      }
+      break;
+    case 'l':
+      i++;
+      if (!strcmp(argv[i],"packed"))
+	gram_parameters->layout=GRAM_PACKED;
+      else if (!strcmp(argv[i],"full"))
+	gram_parameters->layout=GRAM_FULL;
+      else {
+	printf("did not recognize Gram matrix layout %s\n",argv[i]);
+	print_help();
+	exit(0);
+      }
+      break;
+    case 'p':
+      i++;
+      if (!strcmp(argv[i],"double"))
+	gram_parameters->precision=GRAM_DOUBLE;
+      else if (!strcmp(argv[i],"float"))
+	gram_parameters->precision=GRAM_FLOAT;
+      else if (!strcmp(argv[i],"half"))
+	gram_parameters->precision=GRAM_HALF;
+      else if (!strcmp(argv[i],"int"))
+	gram_parameters->precision=GRAM_INT32;
+      else {
+	printf("did not recognize Gram matrix precision %s\n",argv[i]);
+	print_help();
+	exit(0);
+      }
+      break;
+    case 'F':
+      i++;
+      if (!strcmp(argv[i],"binary"))
+	model_format=MODEL_BINARY;
+      else if (!strcmp(argv[i],"text"))
+	model_format=MODEL_TEXT;
+      else {
+	printf("did not recognize model format %s\n",argv[i]);
+	print_help();
+	exit(0);
+      }
+      break;
     case 'o': /* default is Fan, so only change if user enters Platt */
       i++;
       const char *opt=argv[i];
@@ -229,9 +522,11 @@ void input_arguments(int argc,char *argv[],
     print_help();
     exit(0);
   }
-  strcpy (trainingfile, argv[i]);
+  (*trainingfile) = argv[i];
+  if (predict_model_file)
+    (*modelfile) = "xsvm.out"; /* in this case the output file for the decision values */
   if((i+1)<argc) {
-    strcpy (modelfile, argv[i+1]);
+    (*modelfile) = argv[i+1];
   }
 
 }
@@ -241,14 +536,48 @@ void print_help(void) {
  printf("\nxsvm %s: Support Vector Machine learning and classification     %s\n\n",VERSION,VERSION_DATE);
  printf("Author: Peter N Robinson, peter.robinson@charite.de\n\n");
  printf("License: BSD2\n\n");
- printf("\tusage: xsvm [options] file\n\n");
- printf("Argument: file contains the training data or the test data \n");
- printf("\tif the flag -m (model) is set, the argument will be interpreted as test data\n");
+ printf("\tusage: xsvm [options] file [modelfile]\n");
+ printf("\t       xsvm [options] -m modelfile file [outputfile]\n\n");
+ printf("Argument: file contains the training data or the test data (- for stdin)\n");
+ printf("\tmodelfile receives the learned model (default: svm_model)\n");
+ printf("\tif the flag -m (model) is set, the argument will be interpreted as test data,\n");
+ printf("\twhich is classified with the model. The decision values are written to\n");
+ printf("\toutputfile (default: xsvm.out)\n");
  printf("General options:\n");
  printf("\t-?\t->Show help message\n");
  printf("\t-v [0..3]\t-> verbosity level (default 1)\n");
+ printf("\t-m modelfile\t->Classify the test data in file with a saved model\n");
+ printf("\t-F [binary|text]\t->Format of the model file. binary can be mapped\n");
+ printf("\t\t\t  into memory without parsing; text is for debugging (default: binary)\n");
+ printf("\t-C\t\t->Write the parsed training data to file%s. This binary\n",DATASET_SUFFIX);
+ printf("\t\t\t  cache is loaded instead of file as long as it is newer\n");
  printf("Learning options:\n");
  printf("\t-o [Fan|Platt]\t->Optimization  (default: Fan)\n");
+ printf("\t-h [0|1]\t->Use shrinking in the Fan algorithm (default 1)\n");
+ printf("Kernel options:\n");
+ printf("\t-k [linear|poly|rbf|sigmoid]\t->Type of kernel (default: linear)\n");
+ printf("\t\t\t  poly: (s a*b+r)^d, rbf: exp(-g ||a-b||^2), sigmoid: tanh(s a*b+r)\n");
+ printf("\t-d int\t\t->Parameter d of the polynomial kernel (default 3)\n");
+ printf("\t-g float\t->Parameter g of the rbf kernel (default 1)\n");
+ printf("\t-s float\t->Parameter s of the polynomial and sigmoid kernels (default 1)\n");
+ printf("\t-r float\t->Parameter r of the polynomial and sigmoid kernels (default 1)\n");
+ printf("Gram matrix options:\n");
+ printf("\t-l [full|packed]\t->Storage of the Gram matrix. packed stores only the\n");
+ printf("\t\t\t  lower triangle and needs half the memory (default: full)\n");
+ printf("\t-p [double|float|half|int]\t->Precision in which the Gram matrix is\n");
+ printf("\t\t\t  stored; int is for kernels with integer values (default: double)\n");
+ printf("\t-D\t\t->With a reduced precision, also train on the double precision\n");
+ printf("\t\t\t  Gram matrix and report the differences of the objective\n");
+ printf("\t\t\t  and of the decision values\n");
+ printf("\t-t int\t\t->Number of threads used to parse the training data, to\n");
+ printf("\t\t\t  calculate the Gram matrix, in the inner loops of the Fan\n");
+ printf("\t\t\t  solver and to classify test data with -m (default 1)\n");
+ printf("\t-b [auto|merge|index]\t->Calculation of the dot products for the Gram matrix:\n");
+ printf("\t\t\t  pairwise merges or an inverted feature index, which is faster\n");
+ printf("\t\t\t  for very sparse data (default: auto)\n");
+ printf("\t-c float\t->Size of the kernel row cache in MB. If set, kernel rows\n");
+ printf("\t\t\t  are calculated on demand instead of storing the full\n");
+ printf("\t\t\t  Gram matrix (default: 0, i.e., full Gram matrix)\n");
 
   
 }